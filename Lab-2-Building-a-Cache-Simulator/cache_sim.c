@@ -1,375 +1,7000 @@
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
-typedef enum { dm, fa } cache_map_t;
-typedef enum { uc, sc } cache_org_t;
-typedef enum { instruction, data } access_t;
+#include "cache_sim.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CACHE_SIM_X86 1
+#endif
+
+/* Set associative cache of num_sets x num_ways lines. Direct mapped is
+ * num_ways = 1 and fully associative is num_sets = 1. The full block address
+ * is kept as the tag, which makes the index bits redundant but lets evicted
+ * blocks be recovered without knowing the geometry.
+ */
+typedef struct {
+  uint32_t num_sets;
+  uint32_t num_ways;
+  uint32_t set_mask;
+  uint32_t valid_words;   // 64-bit valid words per set
+  uint32_t* tags;         // num_sets * num_ways, way-contiguous per set, 64B aligned
+  uint64_t* valid;        // valid bit per line, kept apart from the tags
+  uint64_t* dirty;        // dirty bit per line laid out like valid, NULL if write-through
+  uint64_t* policy_state; // replacement state per set, see replace_line()
+  uint32_t policy_words;  // 64-bit policy state words per set
+  cache_policy_t policy;
+  // Fully associative caches only, see access_fa()
+  uint64_t* fa_index;     // open addressing FA_ENTRY(block, way), 0 is an empty slot
+  uint32_t fa_index_mask;
+  uint32_t fa_index_shift; // 32 - log2(index size), see fa_hash()
+  uint32_t* fa_slot;      // index slot of each way in use
+  uint32_t* fa_prev;      // recency list through the ways, head is the newest
+  uint32_t* fa_next;
+  uint32_t fa_head;
+  uint32_t fa_tail;
+  uint32_t fa_fill;       // ways in use, they fill up in order
+  uint32_t* fa_free;      // invalidated ways, used before fa_fill grows
+  uint32_t fa_free_count;
+  int write_allocate;     // fill on a store miss, see write_miss_policy_t
+  cache_stat_t stats;
+  uint64_t fills;         // blocks put into lines
+  uint64_t cold_fills;    // fills into an empty line, the others evicted
+  uint64_t prefetch_cold_fills; // prefetch fills into an empty line, kept out of cold_fills
+  uint64_t writebacks;    // dirty blocks written to the level below
+  uint64_t stores;        // stores passed down, write-through or not allocated
+  uint64_t* set_misses;   // misses per set, NULL unless counted
+} cache_t;
+
+#define STORE_BYTES 4  // one 32-bit word, the trace does not carry store sizes
+
+#define FA_LIST_END UINT32_MAX
+
+// Index entries carry the block so probing never looks at the tags
+#define FA_ENTRY(block, way) (((uint64_t)(block) << 32) | ((way) + 1))
+#define FA_ENTRY_BLOCK(entry) ((uint32_t)((entry) >> 32))
+#define FA_ENTRY_WAY(entry) ((uint32_t)(entry) - 1)
+
+/* LRU stack distance of every access in one pass (Mattson et al.). Each block
+ * marks the time of its latest access in a Fenwick tree, so the number of
+ * distinct blocks touched since the previous access to a block is a prefix
+ * sum. An access hits in every fully associative LRU cache with more lines
+ * than its stack distance. Times are renumbered when the tree fills up, so
+ * its size follows the number of distinct blocks rather than the trace length.
+ */
+#define STACK_DISTANCE_BUCKETS 34  // ceil(log2(distance + 1)) for 32-bit blocks
+
+typedef struct {
+  uint32_t* tree;         // Fenwick tree over access times, 1 = latest access
+  uint32_t* block_at;     // block accessed at each time
+  uint32_t capacity;      // number of times before renumbering
+  uint32_t time;
+  uint32_t* map_blocks;   // open addressing block -> latest time + 1
+  uint32_t* map_times;
+  uint32_t map_mask;
+  uint32_t distinct;
+  uint64_t histogram[STACK_DISTANCE_BUCKETS];  // accesses per distance bucket
+  uint64_t cold_misses;
+  uint64_t accesses;
+} stack_distance_t;
+
+// Widest tag compare kernel the runners may use, see select_cache_runner()
+typedef enum { simd_scalar, simd_sse2, simd_avx2, simd_avx512 } simd_level_t;
+
+typedef struct cache_sim cache_sim_t;
+
+typedef void (*cache_runner_t)(cache_sim_t* sim, const mem_access_t* batch, size_t batch_size);
+
+#define MAX_CACHE_LEVELS 3
+#define MAX_MSHRS 64
+
+/* Prefetcher state of one access type, see issue_prefetches(). A stream
+ * holds the block of its last miss until a second miss next to it sets the
+ * direction, then the block it expects next.
+ */
+#define PREFETCH_STREAMS 8          // streams tracked per access type
+#define PREFETCH_LATE_ACCESSES 64   // prefetches used sooner count as late
+#define PREFETCH_MAX_DEGREE 64
+
+typedef struct {
+  uint32_t block;
+  int32_t direction;    // +1 or -1, 0 until confirmed
+  uint64_t last_used;   // prefetch_clock, 0 for an unused entry
+} prefetch_stream_t;
+
+typedef struct {
+  uint32_t last_block;  // stride prefetcher
+  int32_t stride;
+  uint32_t confidence;  // repeats of stride, saturating at 3
+  prefetch_stream_t streams[PREFETCH_STREAMS];
+} prefetcher_state_t;
+
+/* Simulator context behind the library interface in cache_sim.h. caches are
+ * the L1 instances per access type, levels[1] and levels[2] the optional L2
+ * and L3.
+ */
+struct cache_sim {
+  cache_config_t config;
+  cache_t* caches[2];
+  cache_t* levels[MAX_CACHE_LEVELS];
+  inclusion_t inclusion[MAX_CACHE_LEVELS];
+  uint32_t num_levels;
+  uint64_t blocks_in[MAX_CACHE_LEVELS];
+  uint64_t blocks_out[MAX_CACHE_LEVELS];
+  uint64_t back_invalidations[MAX_CACHE_LEVELS];
+  // Miss classification only, per L1 instance like caches
+  cache_t* shadows[2];         // fully associative LRU cache of the same size
+  uint64_t* seen[2];           // bit per block address accessed so far
+  cache_miss_stat_t misses[2]; // per access type
+  // Per access type, misses and cold fills follow from the others
+  cache_stream_stat_t streams[2];
+  // Prefetching only, bitmaps and stamps per L1 instance like caches
+  uint64_t* prefetched[2];       // bit per block filled by a prefetch and not used since
+  uint64_t* polluted[2];         // bit per block a prefetch evicted, until it is filled again
+  uint64_t* prefetch_stamps[2];  // per line, prefetch_clock at the fill << 1 | issuing type
+  uint64_t prefetch_clock;       // demand accesses so far
+  uint64_t coalesced;            // repeats coalesce_batch() answered, included in the stats
+  prefetcher_state_t prefetchers[2];    // per access type
+  cache_prefetch_stat_t prefetches[2];  // per access type
+  // TLBs only, caches of page numbers
+  cache_t* tlbs[2];              // per access type, NULL without
+  cache_t* l2_tlb;
+  cache_tlb_stat_t translations[2];
+  // Timing model only, see access_timed()
+  uint32_t fill_source;          // level the last L1 miss found its block in, num_levels for memory
+  uint64_t clock;                // cycle the next access issues
+  uint64_t channel_free;         // cycle the memory channel can take the next block
+  uint64_t last_arrival;         // latest cycle an access completes
+  uint64_t mshr_ready[MAX_MSHRS];  // cycle each MSHR frees
+  uint32_t mshr_blocks[MAX_MSHRS];
+  cache_timing_stat_t timing;
+  cache_runner_t runner;
+};
+
+typedef enum { text_trace, binary_trace } trace_format_t;
+
+/* A trace read from stdin or a pipe cannot be mapped. A reader thread reads
+ * it in STREAM_READ_BYTES pieces and decodes them into a ring of
+ * STREAM_SLOTS slots while the simulation consumes the slots before it.
+ * When the ring is full the reader stops reading, so a producer faster than
+ * the simulation blocks in its writes.
+ */
+#define STREAM_SLOTS 4
+#define STREAM_SLOT_ACCESSES (1 << 16)
+#define STREAM_READ_BYTES (1 << 20)
+
+typedef struct {
+  mem_access_t accesses[STREAM_SLOT_ACCESSES];
+  size_t size;
+} stream_slot_t;
+
+typedef struct {
+  pthread_t thread;
+  int started;
+  pthread_mutex_t mutex;
+  pthread_cond_t filled;      // the reader published a slot or reached the end
+  pthread_cond_t drained;     // the simulation released a slot
+  uint64_t published;         // slots the reader has filled, slot = count % STREAM_SLOTS
+  uint64_t consumed;          // slots the simulation has released
+  int done;
+  size_t next;                // next access in the oldest published slot
+  stream_slot_t slots[STREAM_SLOTS];
+  // Written by the reader, read once it is done
+  uint64_t bytes;
+  uint64_t skipped_accesses;
+  double read_seconds;        // reader blocked in read(), waiting for the producer
+  double full_seconds;        // reader waiting for a free slot, waiting for the simulation
+  double reader_seconds;      // reader running at all
+  char error[128];            // why the reader stopped early, empty if it did not
+  // Simulation side
+  double empty_seconds;       // simulation waiting for a published slot
+} trace_stream_t;
+
+// Memory mapped trace file, decoded in batches of TRACE_BATCH_SIZE accesses
+typedef struct {
+  int fd;
+  const char* data;
+  size_t size;
+  size_t pos;
+  trace_format_t format;
+  // Binary traces only
+  size_t end;                 // start of the chunk index, records stop here
+  uint32_t type_bits;         // below the block delta in a record, 2 with a store bit
+  uint32_t chunk_accesses;
+  uint32_t chunk_left;        // accesses left before the delta base resets
+  uint32_t prev_block;
+  // Set sampling, see sampled_block()
+  uint32_t sample_mask;       // set index bits the sample is drawn on
+  uint32_t sample_threshold;  // 0 keeps every access
+  uint64_t skipped_accesses;  // decoded but dropped by the sample
+  double decode_seconds;      // spent in read_transactions()
+  trace_stream_t* stream;     // stdin or a pipe, data is unused then
+  char error[128];            // why decoding stopped early, empty if it did not
+  int keep_errors;            // leave error to the caller instead of exiting
+  uint64_t line_base;         // text lines before data, numbers the lines in errors
+  uint64_t byte_base;         // binary trace bytes before data, places records in errors
+} trace_reader_t;
+
+#define TRACE_BATCH_SIZE 4096
+
+/* Set sampling simulates only the sets whose hash falls below a threshold,
+ * about one set in rate. The sampled sets are split into SAMPLE_GROUPS groups
+ * by hash, and the spread of the hit rates of the groups gives the confidence
+ * interval of the estimate, see print_sampling_statistics().
+ */
+#define SAMPLE_GROUPS 32
+
+typedef struct {
+  uint32_t rate;
+  uint64_t sampled_sets;
+  uint64_t total_sets;          // of the level with the fewest sets
+  uint64_t skipped_accesses;
+  cache_stat_t groups[SAMPLE_GROUPS];
+} set_sampling_t;
+
+/* Multi-core mode: one trace per core, each core with private L1 caches
+ * (one, or an instruction and a data half) kept coherent by a directory.
+ * Every L1 cache is an agent of its own, so a core's instruction cache is
+ * invalidated by stores to code like any other cache. The directory knows
+ * which caches hold each block, whether the one holding it may write it (E
+ * or M) and, with MOESI, which cache owns it dirty while others share it
+ * (O). Whether an exclusive copy is E or M is the dirty bit of its line.
+ * The caches are write-back and write-allocate, memory sits right below
+ * them.
+ */
+#define MAX_CORES 32                // sharers hold a bit per cache, two per core
+#define DIRECTORY_PAGE_BITS 12      // entries per lazily allocated directory page
+#define DIRECTORY_STRIPE_BITS 8     // 256 locks over the directory, threaded driver only
+#define MC_DRIFT 1024               // accesses a core thread may run ahead of the slowest
+
+typedef enum { mesi, moesi } coherence_t;
+
+typedef struct {
+  uint64_t sharers;      // bit per agent holding the block
+  uint64_t invalidated;  // agents a write took the block from, until they get it back
+  uint8_t exclusive;     // the single sharer may write it, E or M
+  uint8_t owned;         // MOESI: owner holds it dirty while others share it
+  uint8_t owner;
+} directory_entry_t;
+
+// Coherence traffic of one L1 cache, writebacks are in the cache itself
+typedef struct {
+  uint64_t coherence_misses;    // misses on blocks a write of another cache took away
+  uint64_t bus_reads;           // read misses
+  uint64_t bus_read_exclusives; // write misses
+  uint64_t upgrades;            // writes to a shared copy, invalidating the others
+  uint64_t invalidations;       // lines taken away by writes of other caches
+  uint64_t transfers;           // misses another cache supplied the block for
+} coherence_stat_t;
+
+// A core's caches together, see core_stats()
+typedef struct {
+  uint64_t accesses;
+  uint64_t hits;
+  uint64_t writebacks;
+  coherence_stat_t coherence;
+} core_stat_t;
+
+typedef struct {
+  cache_t* cache;
+  uint64_t* exclusive;   // bit per line held E or M, laid out like valid
+  coherence_stat_t stats;
+  atomic_flag lock;      // threaded driver only
+} coherent_cache_t;
+
+typedef struct multi_core {
+  coherence_t protocol;
+  uint32_t num_cores;
+  uint32_t num_agents;
+  uint32_t interleave;                 // accesses per core per turn, serial driver
+  int threaded;
+  coherent_cache_t* agents;            // num_agents, core c has 2c and 2c + 1
+  uint32_t agents_per_core;            // 1 with a unified L1, 2 with a split one
+  directory_entry_t* _Atomic* directory;  // pages of 2^DIRECTORY_PAGE_BITS entries
+  uint64_t directory_pages;
+  atomic_flag stripes[1 << DIRECTORY_STRIPE_BITS];
+  trace_reader_t** traces;
+  _Alignas(64) atomic_uint_fast64_t progress[MAX_CORES];  // threaded driver only
+} multi_core_t;
+
+/* Windowed mode: the statistics of every window of a fixed number of
+ * accesses, and a signature of what each window touched. Like the basic
+ * block vectors of SimPoint, instruction blocks are hashed into the first
+ * half of PHASE_BUCKETS counters. Data sweeps through new blocks all the
+ * time, so the second half holds the regions of the data accesses and the
+ * size class of the stride from one to the next. The counters are
+ * normalized to sum to one. A window joins the phase with the nearest
+ * centroid, by Manhattan distance out of 2, unless it is farther than
+ * PHASE_THRESHOLD, then it starts a new phase. The representative of a
+ * phase is its window nearest the final centroid.
+ */
+#define PHASE_BUCKETS 32
+#define PHASE_CODE_BUCKETS 16
+#define PHASE_REGION_BUCKETS 8
+#define PHASE_STRIDE_CLASSES 8   // 0, 1, 2-3, ... blocks, the last one also for farther
+#define PHASE_REGION_BITS 14     // data regions of 1 MiB
+#define PHASE_THRESHOLD 0.3
+#define MAX_PHASES 64
+
+typedef struct {
+  uint64_t accesses;
+  uint64_t hits;
+  uint64_t misses[2];  // per access type
+  uint32_t phase;
+} window_stat_t;
+
+typedef struct {
+  uint64_t window;           // accesses per window
+  FILE* out;                 // streaming CSV, a row per window
+  uint32_t counts[PHASE_BUCKETS];  // of the current window
+  uint32_t prev_data_block;  // for the stride classes
+  cache_stat_t last;         // totals at the end of the previous window
+  uint64_t last_misses[2];
+  uint64_t num_windows;
+  uint64_t capacity;
+  window_stat_t* windows;
+  float* signatures;         // PHASE_BUCKETS per window
+  uint32_t num_phases;
+  double centroids[MAX_PHASES][PHASE_BUCKETS];  // sums of the member signatures
+  uint64_t members[MAX_PHASES];
+} phase_detector_t;
+
+/* What the JSON and CSV reports hold about one run, see write_json_report() */
+typedef struct {
+  cache_stat_t stats;        // as print_statistics() prints them
+  const cache_sim_t* sim;    // NULL for OPT replacement, which only has totals
+  const multi_core_t* mc;    // multi-core mode only, sim is NULL then
+  const phase_detector_t* phases;  // windowed mode only
+  double decode_seconds;
+  double total_seconds;
+  size_t state_bytes;        // simulator state, without the decoded trace
+  const cache_config_t* config;
+  const char* trace;         // file name, the first one with several cores
+} run_report_t;
+
+/* Binary trace layout (little endian):
+ * - binary_trace_header_t
+ * - records, one varint per access holding
+ *   (zigzag(block delta) << 2) | store bit << 1 | I/D bit. The delta base
+ *   resets to 0 every chunk_accesses accesses, so each chunk decodes on its
+ *   own
+ * - chunk index, one uint64_t file offset per chunk, at index_offset
+ * A stream decodes the records in order and skips the index, which only
+ * serves to split a file into chunks. Only the block address is stored,
+ * the offset within the 64B block is dropped since the simulator never
+ * looks at it. Version 1 traces have no store bit and are still read,
+ * their data accesses are all loads.
+ */
+#define BINARY_TRACE_MAGIC "CSIMTRC"
+#define BINARY_TRACE_VERSION 2
+#define BINARY_TRACE_CHUNK 65536
+
+typedef struct {
+  char magic[7];
+  uint8_t version;
+  uint8_t block_offset_bits;
+  uint8_t reserved[3];
+  uint32_t chunk_accesses;
+  uint64_t num_accesses;
+  uint64_t index_offset;
+} binary_trace_header_t;
+
+/* Job queue of one worker in a thread_pool_t. The owner pops from the back,
+ * idle workers steal from the front.
+ */
+typedef struct {
+  pthread_mutex_t lock;
+  void (**functions)(void*);
+  void** args;
+  size_t head;
+  size_t tail;
+  size_t capacity;
+} job_queue_t;
+
+typedef struct {
+  pthread_t* threads;
+  uint32_t num_threads;
+  job_queue_t* queues;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t idle;
+  size_t queued;          // jobs waiting in the queues
+  size_t unfinished;      // jobs submitted but not done
+  uint32_t next_queue;
+  int stop;
+} thread_pool_t;
+
+// DECLARE CACHES AND COUNTERS FOR THE STATS HERE
+static const uint32_t BLOCK_SIZE = 64;
+static const uint32_t ADDRESS_SIZE = 32;
+static const uint32_t BLOCK_OFFSET_NUM_OF_BITS = 6;  // log2(BLOCK_SIZE)
+#ifndef CACHE_SIM_LIBRARY
+static cache_config_t cache_config = {.size = 0, .mapping = dm, .org = uc, .ways = 4, .policy = fifo,
+                               .write_policy = write_back, .write_miss_policy = write_allocate,
+                               .prefetcher = no_prefetch};
+static char* trace_file_name = "mem_trace.txt";
+static char* trace_file_names[MAX_CORES];  // one per core, the first is trace_file_name
+static uint32_t num_trace_files = 0;
+static int multi_core_mode = 0;            // several traces or --coherence, see run_multi_core()
+static coherence_t coherence_protocol = mesi;
+static uint32_t core_interleave = 1;       // accesses per core per turn of simulate_multi_core()
+static uint32_t sample_rate = 1;  // simulate about one set in sample_rate
+static uint32_t num_sim_threads = 1;  // workers of simulate_trace_sharded()
+static char* json_file_name = NULL;   // write_json_report() target, "-" is stdout
+static char* csv_file_name = NULL;    // write_csv_report() target, "-" is stdout
+static uint64_t window_size = 0;      // accesses per window of simulate_windowed_trace(), 0 is off
+static char* window_file_name = "-";  // its streaming CSV
+
+static const char* mapping_names[] = {"dm", "fa", "sa"};
+static const char* org_names[] = {"uc", "sc"};
+static const char* policy_names[] = {"fifo", "lru", "plru", "srrip", "brrip", "nru", "random", "opt"};
+static const char* write_policy_names[] = {"wb", "wt"};
+static const char* write_miss_policy_names[] = {"wa", "nwa"};
+static const char* prefetcher_names[] = {"none", "next", "stride", "stream"};
+static const char* coherence_names[] = {"mesi", "moesi"};
+#endif
+static const uint32_t prefetch_default_degree[] = {0, 1, 2, 4};
+
+#ifndef CACHE_SIM_LIBRARY
+// USE THIS FOR YOUR CACHE STATISTICS
+static cache_stat_t cache_statistics;
+
+
+static void read_params_and_init(int argc, char** argv);
+
+static trace_reader_t* read_access_from_file(char *file_name);
+
+static trace_reader_t* open_trace(const char* file_name, char* error, size_t error_size);
+
+static void close_trace(trace_reader_t* trace);
+
+static void print_stream_statistics(const trace_reader_t* trace);
+#endif
+
+static const char* check_cache_config(const cache_config_t* config);
+
+static uint32_t cache_config_ways(const cache_config_t* config);
+
+static cache_t* create_cache(uint32_t size, uint32_t ways, cache_policy_t policy, uint32_t seed);
+
+static uint32_t policy_state_bits(cache_policy_t policy, uint32_t ways);
+
+static void init_policy_state(cache_t* cache, uint32_t seed);
+
+static void set_write_policy(cache_t* cache, write_policy_t policy, write_miss_policy_t miss_policy);
+
+static void free_cache(cache_t* cache);
+
+static void create_caches(const cache_config_t* config, cache_t* caches[2]);
+
+static void free_caches(cache_t* caches[2]);
+
+static cache_stat_t collect_statistics(cache_t* caches[2]);
+
+static cache_runner_t select_cache_runner(cache_t* cache, int classify);
+
+#ifndef CACHE_SIM_LIBRARY
+static void simulate_trace(cache_sim_t* sim, trace_reader_t* trace);
+
+static void simulate_trace_sharded(cache_sim_t* sim, trace_reader_t* trace, uint32_t num_threads);
+
+static void simulate_windowed_trace(cache_sim_t* sim, trace_reader_t* trace, phase_detector_t* phases);
+
+static void init_phase_detector(phase_detector_t* phases, uint64_t window, FILE* out);
+
+static void free_phase_detector(phase_detector_t* phases);
+
+static uint32_t shared_set_mask(const cache_sim_t* sim);
+
+static void init_set_sampling(set_sampling_t* sampling, const cache_sim_t* sim, trace_reader_t* trace);
+
+static cache_stat_t simulate_sampled_trace(cache_sim_t* sim, trace_reader_t* trace, set_sampling_t* sampling);
+
+static cache_stat_t simulate_opt_trace(trace_reader_t* trace, size_t* peak_bytes);
+
+static mem_access_t* load_trace(trace_reader_t* trace, size_t* num_accesses);
+
+static void thread_pool_init(thread_pool_t* pool, uint32_t num_threads);
+
+static void thread_pool_submit(thread_pool_t* pool, void (*function)(void*), void* arg);
+
+static void thread_pool_wait(thread_pool_t* pool);
+
+static void thread_pool_destroy(thread_pool_t* pool);
+
+static void run_sweep(int argc, char** argv);
+
+static void generate_trace(int argc, char** argv);
+
+static void run_benchmark(int argc, char** argv);
+#endif
+
+void run_multi_core(void);
+
+void run_daemon(int argc, char** argv);
+
+#ifndef CACHE_SIM_LIBRARY
+static void init_multi_core(multi_core_t* mc, const cache_config_t* config, coherence_t protocol,
+                     trace_reader_t** traces, uint32_t num_cores);
+
+static void free_multi_core(multi_core_t* mc);
+
+static void simulate_multi_core(multi_core_t* mc);
+
+static void simulate_multi_core_threaded(multi_core_t* mc);
+
+static cache_stat_t multi_core_stats(const multi_core_t* mc);
+
+static size_t multi_core_bytes(const multi_core_t* mc);
+
+static int parse_cache_size(const char* arg, cache_config_t* config);
+
+static int parse_count(const char* arg, uint32_t* count);
+
+static int parse_cache_mapping(const char* arg, cache_config_t* config);
+
+static int parse_cache_org(const char* arg, cache_config_t* config);
+
+static int parse_cache_policy(const char* arg, cache_config_t* config);
+
+static int parse_level_config(const char* arg, level_config_t* level);
+
+static int parse_config_option(const char* option, cache_config_t* config, char* error,
+                               size_t error_size);
+
+static double seconds_since(const struct timespec* start);
+
+static void write_json_string(FILE* out, const char* string);
+
+static int parse_write_policy(const char* arg, cache_config_t* config);
+
+static int parse_write_miss_policy(const char* arg, cache_config_t* config);
+
+static int parse_prefetcher(const char* arg, cache_config_t* config);
+
+static int parse_tlb_config(const char* arg, tlb_config_t* tlb);
+
+static int parse_latencies(const char* arg, timing_config_t* timing);
+
+static void enable_timing(timing_config_t* timing);
+
+static size_t read_transactions(trace_reader_t* trace, mem_access_t* batch, size_t max_accesses);
+
+static void convert_trace(char* text_file_name, char* binary_file_name);
+
+static void print_hit_rate_curve(trace_reader_t* trace);
+
+static void print_statistics(cache_stat_t cache_statistics);
+
+static void print_hierarchy_statistics(const cache_sim_t* sim);
+
+static void print_miss_classification(const cache_sim_t* sim);
+
+static void print_traffic_statistics(const cache_sim_t* sim);
+
+static void print_tlb_statistics(const cache_sim_t* sim);
+
+static void print_timing_statistics(const cache_sim_t* sim);
+
+static void print_prefetch_statistics(const cache_sim_t* sim);
+
+static void print_sampling_statistics(const set_sampling_t* sampling);
+
+static void print_coherence_statistics(const multi_core_t* mc);
+
+static void print_phase_statistics(const phase_detector_t* phases);
+
+static size_t sim_state_bytes(const cache_sim_t* sim);
+
+static void write_json_report(FILE* out, const run_report_t* report);
+
+static void write_csv_report(FILE* out, const run_report_t* report);
+
+static void write_reports(const run_report_t* report);
+
+
+int main(int argc, char** argv) {
+  if (argc == 4 && strcmp(argv[1], "convert") == 0) {
+    convert_trace(argv[2], argv[3]);
+    return 0;
+  }
+  if ((argc == 2 || argc == 3) && strcmp(argv[1], "curve") == 0) {
+    trace_reader_t* trace = read_access_from_file(argc == 3 ? argv[2] : trace_file_name);
+    print_hit_rate_curve(trace);
+    close_trace(trace);
+    return 0;
+  }
+  if (argc >= 2 && strcmp(argv[1], "sweep") == 0) {
+    run_sweep(argc, argv);
+    return 0;
+  }
+  if (argc >= 2 && strcmp(argv[1], "gen") == 0) {
+    generate_trace(argc, argv);
+    return 0;
+  }
+  if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+    run_benchmark(argc, argv);
+    return 0;
+  }
+  if (argc >= 2 && strcmp(argv[1], "serve") == 0) {
+    run_daemon(argc, argv);
+    return 0;
+  }
+
+  // Reset statistics:
+  memset(&cache_statistics, 0, sizeof(cache_stat_t));
+
+  read_params_and_init(argc, argv);
+  if (multi_core_mode) {
+    run_multi_core();
+    return 0;
+  }
+
+  trace_reader_t* trace = read_access_from_file(trace_file_name);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  cache_sim_t* sim = NULL;
+  size_t opt_bytes = 0;
+  set_sampling_t sampling = {.rate = sample_rate};
+  phase_detector_t* phases = NULL;
+  FILE* window_file = NULL;
+  if (window_size > 0) {
+    window_file = strcmp(window_file_name, "-") == 0 ? stdout : fopen(window_file_name, "w");
+    if (!window_file) {
+      printf("Unable to open the window file %s\n", window_file_name);
+      exit(1);
+    }
+    phases = (phase_detector_t*)malloc(sizeof(phase_detector_t));
+    init_phase_detector(phases, window_size, window_file);
+  }
+  if (cache_config.policy == opt) {
+    cache_statistics = simulate_opt_trace(trace, &opt_bytes);
+  } else {
+    sim = cache_sim_create();
+    cache_sim_configure(sim, &cache_config);
+    if (sample_rate > 1) {
+      init_set_sampling(&sampling, sim, trace);
+      cache_statistics = simulate_sampled_trace(sim, trace, &sampling);
+    } else if (num_sim_threads > 1) {
+      simulate_trace_sharded(sim, trace, num_sim_threads);
+      cache_statistics = cache_sim_stats(sim);
+    } else if (phases) {
+      simulate_windowed_trace(sim, trace, phases);
+      cache_statistics = cache_sim_stats(sim);
+    } else {
+      simulate_trace(sim, trace);
+      cache_statistics = cache_sim_stats(sim);
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  print_statistics(cache_statistics);
+  if (sample_rate > 1) {
+    print_sampling_statistics(&sampling);
+  }
+  if (sim) {
+    if (cache_config.l2.size > 0) {
+      print_hierarchy_statistics(sim);
+    }
+    if (sim->tlbs[instruction] || sim->tlbs[data]) {
+      print_tlb_statistics(sim);
+    }
+    if (cache_config.classify_misses) {
+      print_miss_classification(sim);
+    }
+    // Traces without stores keep the output they had before stores existed
+    if (cache_sim_stream_stats(sim, data).writes > 0 || cache_config.write_policy != write_back ||
+        cache_config.write_miss_policy != write_allocate) {
+      print_traffic_statistics(sim);
+    }
+    if (cache_config.prefetcher != no_prefetch) {
+      print_prefetch_statistics(sim);
+    }
+    if (cache_config.timing.hit_latency[0] > 0) {
+      print_timing_statistics(sim);
+    }
+  }
+  if (phases) {
+    print_phase_statistics(phases);
+  }
+
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+  run_report_t report = {cache_statistics, sim, NULL, phases, trace->decode_seconds, seconds,
+                         sim ? sim_state_bytes(sim) : opt_bytes, &cache_config, trace_file_name};
+  write_reports(&report);
+  uint64_t coalesced = 0;
+  if (sim) {
+    coalesced = sim->coalesced;
+    cache_sim_destroy(sim);
+  }
+  if (phases) {
+    free_phase_detector(phases);
+    free(phases);
+    if (window_file != stdout) fclose(window_file);
+  }
+
+  // Throughput goes to stderr so the statistics block above stays unchanged
+  fprintf(stderr,
+          "\nSimulated %" PRIu64 " accesses in %.3f s (%.2f M accesses/s), %.3f s of it decoding\n",
+          cache_statistics.accesses, seconds,
+          seconds > 0 ? cache_statistics.accesses / seconds * 1e-6 : 0.0, trace->decode_seconds);
+  if (coalesced > 0) {
+    fprintf(stderr, "Coalesced %" PRIu64 " repeated loads (%.1f%%) before they reached the caches\n",
+            coalesced, 100.0 * coalesced / cache_statistics.accesses);
+  }
+  print_stream_statistics(trace);
+  if (opt_bytes > 0) {
+    fprintf(stderr, "OPT held at most %.1f MiB for the trace and its next-use index\n",
+            opt_bytes / (1024.0 * 1024.0));
+  }
+
+  /* Close the trace file */
+  close_trace(trace);
+  return 0;
+}
+
+/* Runs one trace per core through private L1 caches kept coherent by the
+ * directory, see init_multi_core(). With --threads the cores run in parallel.
+ */
+void run_multi_core(void) {
+  trace_reader_t* traces[MAX_CORES];
+  for (uint32_t core = 0; core < num_trace_files; core++) {
+    traces[core] = read_access_from_file(trace_file_names[core]);
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  multi_core_t mc;
+  init_multi_core(&mc, &cache_config, coherence_protocol, traces, num_trace_files);
+  mc.interleave = core_interleave;
+  if (num_sim_threads > 1 && num_trace_files > 1) {
+    simulate_multi_core_threaded(&mc);
+  } else {
+    simulate_multi_core(&mc);
+  }
+  cache_statistics = multi_core_stats(&mc);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  print_statistics(cache_statistics);
+  print_coherence_statistics(&mc);
+
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+  double decode_seconds = 0.0;
+  for (uint32_t core = 0; core < num_trace_files; core++) {
+    decode_seconds += traces[core]->decode_seconds;
+  }
+  run_report_t report = {cache_statistics, NULL, &mc, NULL, decode_seconds, seconds,
+                         multi_core_bytes(&mc), &cache_config, trace_file_name};
+  write_reports(&report);
+
+  fprintf(stderr,
+          "\nSimulated %" PRIu64 " accesses of %" PRIu32 " cores in %.3f s (%.2f M accesses/s), "
+          "%.3f s of it decoding\n",
+          cache_statistics.accesses, num_trace_files, seconds,
+          seconds > 0 ? cache_statistics.accesses / seconds * 1e-6 : 0.0, decode_seconds);
+
+  free_multi_core(&mc);
+  for (uint32_t core = 0; core < num_trace_files; core++) {
+    print_stream_statistics(traces[core]);
+    close_trace(traces[core]);
+  }
+}
+
+/* Simulation daemon: ./cache_sim serve [socket] [--threads=N] [--max-results=N] listens on a
+ * Unix domain socket, cache_sim.sock by default. Every line a client sends
+ * is a request, either a run given like the command line,
+ *   SIZE MAPPING ORGANIZATION TRACE [options of the configuration]
+ * or stats. Each gets one line back, a JSON object holding the request and
+ * either the report --json would write or an error. Requests run on a pool
+ * of N workers, one line may be answered before an earlier one of the same
+ * connection, hence the request in the reply. Traces are decoded once and
+ * kept in memory until the file changes. Reports are kept under their
+ * trace and configuration, up to --max-results of them, dropping the least
+ * recently used one first.
+ */
+#define SERVE_MAX_LINE 4096
+#define SERVE_MAX_ARGS 64
+#define SERVE_RESULT_BUCKETS 1024
+#define SERVE_MAX_RESULTS 4096  // default of --max-results
+
+// A decoded trace, keyed by its real path and told apart from later versions by its stat
+typedef struct served_trace {
+  struct served_trace* next;
+  char path[PATH_MAX];
+  struct stat file_stat;
+  mem_access_t* accesses;
+  size_t num_accesses;
+  uint32_t refs;  // requests using it, and the list while it is current
+} served_trace_t;
+
+/* The report of one run. The configuration holds only 32-bit fields, so
+ * the key has no padding up to its end, but it is padded after it. Keys
+ * are hashed and compared on their RESULT_KEY_BYTES with memcmp(), which
+ * leaves the padding out.
+ */
+typedef struct {
+  uint64_t device;
+  uint64_t inode;
+  int64_t size;
+  int64_t mtime_seconds;
+  int64_t mtime_nanoseconds;
+  cache_config_t config;
+} result_key_t;
+
+#define RESULT_KEY_BYTES (offsetof(result_key_t, config) + sizeof(cache_config_t))
+
+typedef struct served_result {
+  struct served_result* next;   // in its bucket
+  struct served_result* newer;  // in the order of use
+  struct served_result* older;
+  result_key_t key;
+  char* report;  // on one line
+} served_result_t;
+
+typedef struct {
+  pthread_mutex_t lock;  // everything below but the pool
+  pthread_mutex_t load_lock;  // held while a trace decodes, one at a time
+  served_trace_t* traces;
+  served_result_t* results[SERVE_RESULT_BUCKETS];
+  served_result_t* newest;
+  served_result_t* oldest;
+  uint64_t num_results;
+  uint64_t max_results;
+  uint64_t evicted_results;
+  uint64_t requests;
+  uint64_t cached_replies;
+  struct serve_connection* connections;  // open ones, which the daemon waits for on exit
+  pthread_cond_t closed;
+  thread_pool_t pool;
+} serve_daemon_t;
+
+typedef struct serve_connection {
+  struct serve_connection* next;  // under daemon->lock
+  serve_daemon_t* daemon;
+  int fd;
+  pthread_mutex_t lock;  // replies and pending
+  pthread_cond_t idle;
+  uint32_t pending;      // requests submitted and not answered yet
+} serve_connection_t;
+
+typedef struct {
+  serve_connection_t* connection;
+  char* line;
+} serve_request_t;
+
+static volatile sig_atomic_t serve_stopping;
+
+static void stop_serving(int signal_number) {
+  (void)signal_number;
+  serve_stopping = 1;
+}
+
+static void release_trace(serve_daemon_t* daemon, served_trace_t* trace) {
+  pthread_mutex_lock(&daemon->lock);
+  int unused = --trace->refs == 0;
+  pthread_mutex_unlock(&daemon->lock);
+  if (unused) {
+    free(trace->accesses);
+    free(trace);
+  }
+}
+
+static int same_file(const struct stat* a, const struct stat* b) {
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+         a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// Current version of the trace under daemon->lock with a reference taken, NULL if not loaded
+static served_trace_t* find_trace(serve_daemon_t* daemon, const char* path,
+                                  const struct stat* file_stat) {
+  for (served_trace_t* trace = daemon->traces; trace; trace = trace->next) {
+    if (strcmp(trace->path, path) == 0 && same_file(&trace->file_stat, file_stat)) {
+      trace->refs++;
+      return trace;
+    }
+  }
+  return NULL;
+}
+
+/* Returns the decoded trace with a reference for the caller, decoding it
+ * if it is new or its file changed. A version it replaces goes once the
+ * requests still using it are done. Returns NULL with why in error if the
+ * file cannot be served.
+ */
+static served_trace_t* acquire_trace(serve_daemon_t* daemon, const char* name,
+                                     char* error, size_t error_size) {
+  char path[PATH_MAX];
+  struct stat file_stat;
+  if (!realpath(name, path) || stat(path, &file_stat) != 0 || access(path, R_OK) != 0) {
+    snprintf(error, error_size, "Unable to open the trace file");
+    return NULL;
+  }
+  if (!S_ISREG(file_stat.st_mode)) {
+    snprintf(error, error_size, "Only trace files can be served, not streams");
+    return NULL;
+  }
+
+  pthread_mutex_lock(&daemon->lock);
+  served_trace_t* trace = find_trace(daemon, path, &file_stat);
+  pthread_mutex_unlock(&daemon->lock);
+  if (trace) return trace;
+
+  // Another request may have decoded it while this one waited
+  pthread_mutex_lock(&daemon->load_lock);
+  pthread_mutex_lock(&daemon->lock);
+  trace = find_trace(daemon, path, &file_stat);
+  pthread_mutex_unlock(&daemon->lock);
+  if (!trace) {
+    trace = (served_trace_t*)calloc(1, sizeof(served_trace_t));
+    snprintf(trace->path, sizeof(trace->path), "%s", path);
+    trace->file_stat = file_stat;
+    // A malformed trace is the request's error, the daemon keeps serving
+    char reason[sizeof(((trace_reader_t*)NULL)->error)];
+    trace_reader_t* reader = open_trace(path, reason, sizeof(reason));
+    if (reader) {
+      reader->keep_errors = 1;
+      trace->accesses = load_trace(reader, &trace->num_accesses);
+      snprintf(reason, sizeof(reason), "%s", reader->error);
+      close_trace(reader);
+    }
+    if (!reader || reason[0]) {
+      snprintf(error, error_size, "Not a valid trace file: %s", reason);
+      free(trace->accesses);
+      free(trace);
+      pthread_mutex_unlock(&daemon->load_lock);
+      return NULL;
+    }
+    trace->refs = 2;
+
+    pthread_mutex_lock(&daemon->lock);
+    served_trace_t** link = &daemon->traces;
+    while (*link && strcmp((*link)->path, path) != 0) link = &(*link)->next;
+    served_trace_t* replaced = *link;
+    if (replaced) {
+      *link = replaced->next;
+    }
+    trace->next = daemon->traces;
+    daemon->traces = trace;
+    pthread_mutex_unlock(&daemon->lock);
+    if (replaced) release_trace(daemon, replaced);
+  }
+  pthread_mutex_unlock(&daemon->load_lock);
+  return trace;
+}
+
+static uint32_t result_bucket(const result_key_t* key) {
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  const unsigned char* bytes = (const unsigned char*)key;
+  for (size_t i = 0; i < RESULT_KEY_BYTES; i++) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash % SERVE_RESULT_BUCKETS;
+}
+
+static void unlink_result_use(serve_daemon_t* daemon, served_result_t* result) {
+  if (result->newer) result->newer->older = result->older; else daemon->newest = result->older;
+  if (result->older) result->older->newer = result->newer; else daemon->oldest = result->newer;
+}
+
+static void link_result_use(serve_daemon_t* daemon, served_result_t* result) {
+  result->newer = NULL;
+  result->older = daemon->newest;
+  if (daemon->newest) daemon->newest->newer = result; else daemon->oldest = result;
+  daemon->newest = result;
+}
+
+/* The kept report of the key under daemon->lock, NULL if there is none.
+ * Finding it makes it the most recently used.
+ */
+static const char* find_result(serve_daemon_t* daemon, const result_key_t* key) {
+  for (served_result_t* result = daemon->results[result_bucket(key)]; result; result = result->next) {
+    if (memcmp(&result->key, key, RESULT_KEY_BYTES) == 0) {
+      unlink_result_use(daemon, result);
+      link_result_use(daemon, result);
+      return result->report;
+    }
+  }
+  return NULL;
+}
+
+// Keeps the report under daemon->lock, dropping the least recently used one past max_results
+static void keep_result(serve_daemon_t* daemon, const result_key_t* key, char* report) {
+  served_result_t* result = (served_result_t*)malloc(sizeof(served_result_t));
+  memcpy(&result->key, key, sizeof(*key));
+  result->report = report;
+  uint32_t bucket = result_bucket(key);
+  result->next = daemon->results[bucket];
+  daemon->results[bucket] = result;
+  link_result_use(daemon, result);
+  daemon->num_results++;
+
+  if (daemon->num_results > daemon->max_results) {
+    served_result_t* oldest = daemon->oldest;
+    served_result_t** slot = &daemon->results[result_bucket(&oldest->key)];
+    while (*slot != oldest) slot = &(*slot)->next;
+    *slot = oldest->next;
+    unlink_result_use(daemon, oldest);
+    free(oldest->report);
+    free(oldest);
+    daemon->num_results--;
+    daemon->evicted_results++;
+  }
+}
+
+/* Simulates the configuration on the trace and returns the report
+ * write_json_report() writes for it, on one line
+ */
+static char* simulate_served(const cache_config_t* config, const served_trace_t* trace) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  cache_sim_t* sim = NULL;
+  cache_stat_t stats;
+  size_t state_bytes = 0;
+  if (config->policy == opt) {
+    stats = cache_sim_opt(config, trace->accesses, trace->num_accesses, &state_bytes);
+  } else {
+    sim = cache_sim_create();
+    cache_sim_configure(sim, config);
+    cache_sim_feed(sim, trace->accesses, trace->num_accesses);
+    stats = cache_sim_stats(sim);
+    state_bytes = sim_state_bytes(sim);
+  }
+
+  run_report_t report = {stats, sim, NULL, NULL, 0.0, seconds_since(&start), state_bytes, config,
+                         trace->path};
+  char* json;
+  size_t length;
+  FILE* out = open_memstream(&json, &length);
+  write_json_report(out, &report);
+  fclose(out);
+  if (sim) cache_sim_destroy(sim);
+
+  // Newlines only separate the members, the strings escape theirs
+  while (length > 0 && json[length - 1] == '\n') json[--length] = '\0';
+  for (char* c = json; *c; c++) {
+    if (*c == '\n') *c = ' ';
+  }
+  return json;
+}
+
+/* Answers one request into out, without the newline. Runs on the workers. */
+static void answer_request(serve_daemon_t* daemon, char* line, FILE* out) {
+  char* args[SERVE_MAX_ARGS];
+  int num_args = 0;
+  char* saved;
+  char* arg = strtok_r(line, " \t", &saved);
+  for (; arg && num_args < SERVE_MAX_ARGS; arg = strtok_r(NULL, " \t", &saved)) {
+    args[num_args++] = arg;
+  }
+  pthread_mutex_lock(&daemon->lock);
+  daemon->requests++;
+  pthread_mutex_unlock(&daemon->lock);
+  if (arg) {
+    fprintf(out, "\"error\": \"Requests have at most %d words\"", SERVE_MAX_ARGS);
+    return;
+  }
+
+  if (num_args == 1 && strcmp(args[0], "stats") == 0) {
+    pthread_mutex_lock(&daemon->lock);
+    uint64_t num_traces = 0, num_accesses = 0;
+    for (served_trace_t* trace = daemon->traces; trace; trace = trace->next) {
+      num_traces++;
+      num_accesses += trace->num_accesses;
+    }
+    fprintf(out, "\"stats\": {\"traces\": %" PRIu64 ", \"resident_accesses\": %" PRIu64
+            ", \"results\": %" PRIu64 ", \"evicted_results\": %" PRIu64 ", \"requests\": %" PRIu64
+            ", \"cached_replies\": %" PRIu64 "}",
+            num_traces, num_accesses, daemon->num_results, daemon->evicted_results,
+            daemon->requests, daemon->cached_replies);
+    pthread_mutex_unlock(&daemon->lock);
+    return;
+  }
+
+  char error[256];
+  if (num_args < 4) {
+    fprintf(out, "\"error\": \"Requests are SIZE MAPPING ORGANIZATION TRACE [options] or stats\"");
+    return;
+  }
+  cache_config_t config = {.size = 0, .mapping = dm, .org = uc, .ways = 4, .policy = fifo};
+  if (!parse_cache_size(args[0], &config)) {
+    fprintf(out, "\"error\": \"Unknown cache size\"");
+    return;
+  }
+  if (!parse_cache_mapping(args[1], &config) || !parse_cache_org(args[2], &config)) {
+    fprintf(out, "\"error\": \"Unknown cache mapping or organization\"");
+    return;
+  }
+  for (int i = 4; i < num_args; i++) {
+    int parsed = parse_config_option(args[i], &config, error, sizeof(error));
+    if (parsed <= 0) {
+      if (parsed == 0) snprintf(error, sizeof(error), "Unknown option %s", args[i]);
+      fprintf(out, "\"error\": ");
+      write_json_string(out, error);
+      return;
+    }
+  }
+  const char* message = check_cache_config(&config);
+  if (!message && config.policy == opt && config.timing.hit_latency[0] > 0) {
+    message = "The timing model is not supported with OPT replacement";
+  }
+  if (message) {
+    fprintf(out, "\"error\": ");
+    write_json_string(out, message);
+    return;
+  }
+  served_trace_t* trace = acquire_trace(daemon, args[3], error, sizeof(error));
+  if (!trace) {
+    fprintf(out, "\"error\": ");
+    write_json_string(out, error);
+    return;
+  }
+
+  result_key_t key;
+  memset(&key, 0, sizeof(key));
+  key.device = trace->file_stat.st_dev;
+  key.inode = trace->file_stat.st_ino;
+  key.size = trace->file_stat.st_size;
+  key.mtime_seconds = trace->file_stat.st_mtim.tv_sec;
+  key.mtime_nanoseconds = trace->file_stat.st_mtim.tv_nsec;
+  key.config = config;
+
+  pthread_mutex_lock(&daemon->lock);
+  const char* kept = find_result(daemon, &key);
+  if (kept) {
+    daemon->cached_replies++;
+    fprintf(out, "\"cached\": true, \"report\": %s", kept);
+  }
+  pthread_mutex_unlock(&daemon->lock);
+  if (kept) {
+    release_trace(daemon, trace);
+    return;
+  }
+
+  // The same request in flight twice simulates twice, the first report is kept
+  char* report = simulate_served(&config, trace);
+  release_trace(daemon, trace);
+  fprintf(out, "\"cached\": false, \"report\": %s", report);
+  pthread_mutex_lock(&daemon->lock);
+  if (!find_result(daemon, &key)) {
+    keep_result(daemon, &key, report);
+    report = NULL;
+  }
+  pthread_mutex_unlock(&daemon->lock);
+  free(report);
+}
+
+static void write_all(int fd, const char* data, size_t length) {
+  while (length > 0) {
+    ssize_t written = write(fd, data, length);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) return;  // the client went away, its replies are dropped
+    data += written;
+    length -= written;
+  }
+}
+
+static void run_request(void* arg) {
+  serve_request_t* request = (serve_request_t*)arg;
+  serve_connection_t* connection = request->connection;
+
+  char* reply;
+  size_t length;
+  FILE* out = open_memstream(&reply, &length);
+  fprintf(out, "{\"request\": ");
+  write_json_string(out, request->line);
+  fprintf(out, ", ");
+  answer_request(connection->daemon, request->line, out);
+  fprintf(out, "}\n");
+  fclose(out);
+
+  pthread_mutex_lock(&connection->lock);
+  write_all(connection->fd, reply, length);
+  if (--connection->pending == 0) {
+    pthread_cond_signal(&connection->idle);
+  }
+  pthread_mutex_unlock(&connection->lock);
+  free(reply);
+  free(request->line);
+  free(request);
+}
+
+static void submit_request(serve_connection_t* connection, const char* line) {
+  serve_request_t* request = (serve_request_t*)malloc(sizeof(serve_request_t));
+  request->connection = connection;
+  request->line = strdup(line);
+  pthread_mutex_lock(&connection->lock);
+  connection->pending++;
+  pthread_mutex_unlock(&connection->lock);
+  thread_pool_submit(&connection->daemon->pool, run_request, request);
+}
+
+/* Reads the requests of one client and hands them to the workers. Lines
+ * longer than SERVE_MAX_LINE are answered with an error and skipped. Once
+ * the client stops sending, or the daemon stops reading, waits for its last
+ * replies and closes.
+ */
+static void* serve_connection(void* arg) {
+  serve_connection_t* connection = (serve_connection_t*)arg;
+  char buffer[SERVE_MAX_LINE];
+  size_t used = 0;
+  int skipping = 0;
+
+  while (1) {
+    ssize_t got = read(connection->fd, buffer + used, sizeof(buffer) - 1 - used);
+    if (got < 0 && errno == EINTR) continue;
+    if (got <= 0) break;
+    used += got;
+
+    size_t start = 0;
+    for (size_t i = 0; i < used; i++) {
+      if (buffer[i] != '\n') continue;
+      buffer[i] = '\0';
+      if (i > start && buffer[i - 1] == '\r') buffer[i - 1] = '\0';
+      if (!skipping && buffer[start] != '\0') submit_request(connection, buffer + start);
+      skipping = 0;
+      start = i + 1;
+    }
+    memmove(buffer, buffer + start, used - start);
+    used -= start;
+    if (used == sizeof(buffer) - 1) {
+      if (!skipping) {
+        static const char reply[] = "{\"error\": \"Requests are at most 4095 bytes long\"}\n";
+        pthread_mutex_lock(&connection->lock);
+        write_all(connection->fd, reply, sizeof(reply) - 1);
+        pthread_mutex_unlock(&connection->lock);
+      }
+      skipping = 1;
+      used = 0;
+    }
+  }
+
+  pthread_mutex_lock(&connection->lock);
+  while (connection->pending > 0) {
+    pthread_cond_wait(&connection->idle, &connection->lock);
+  }
+  pthread_mutex_unlock(&connection->lock);
+
+  // Off the list before the descriptor can be reused
+  serve_daemon_t* daemon = connection->daemon;
+  pthread_mutex_lock(&daemon->lock);
+  serve_connection_t** link = &daemon->connections;
+  while (*link != connection) link = &(*link)->next;
+  *link = connection->next;
+  pthread_cond_signal(&daemon->closed);
+  pthread_mutex_unlock(&daemon->lock);
+  close(connection->fd);
+  pthread_cond_destroy(&connection->idle);
+  pthread_mutex_destroy(&connection->lock);
+  free(connection);
+  return NULL;
+}
+
+void run_daemon(int argc, char** argv) {
+  const char* socket_path = "cache_sim.sock";
+  uint32_t num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t max_results = SERVE_MAX_RESULTS;
+  for (int i = 2; i < argc; i++) {
+    if (strncmp(argv[i], "--threads=", 10) == 0) {
+      if (!parse_count(argv[i] + 10, &num_threads)) {
+        printf("The number of daemon threads must be a positive number\n");
+        exit(0);
+      }
+    } else if (strncmp(argv[i], "--max-results=", 14) == 0) {
+      if (!parse_count(argv[i] + 14, &max_results)) {
+        printf("The number of kept reports must be a positive number\n");
+        exit(0);
+      }
+    } else {
+      socket_path = argv[i];
+    }
+  }
+  if (num_threads == 0) num_threads = 1;
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    printf("The socket path is too long\n");
+    exit(0);
+  }
+  snprintf(address.sun_path, sizeof(address.sun_path), "%s", socket_path);
+
+  // A socket left behind by an earlier daemon is replaced, any other file is not
+  struct stat file_stat;
+  if (lstat(socket_path, &file_stat) == 0) {
+    if (!S_ISSOCK(file_stat.st_mode)) {
+      printf("%s exists and is not a socket\n", socket_path);
+      exit(1);
+    }
+    unlink(socket_path);
+  }
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+      listen(listener, SOMAXCONN) != 0) {
+    printf("Unable to listen on %s\n", socket_path);
+    exit(1);
+  }
+
+  /* Clients that go away must not take the daemon with them, SIGINT and
+   * SIGTERM end it cleanly. Only the wait for a client takes them, the
+   * threads started here inherit them blocked.
+   */
+  signal(SIGPIPE, SIG_IGN);
+  struct sigaction stop;
+  memset(&stop, 0, sizeof(stop));
+  stop.sa_handler = stop_serving;
+  sigaction(SIGINT, &stop, NULL);
+  sigaction(SIGTERM, &stop, NULL);
+  sigset_t stop_signals, wait_mask;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, &wait_mask);
+  sigdelset(&wait_mask, SIGINT);
+  sigdelset(&wait_mask, SIGTERM);
+
+  serve_daemon_t* daemon = (serve_daemon_t*)calloc(1, sizeof(serve_daemon_t));
+  pthread_mutex_init(&daemon->lock, NULL);
+  pthread_mutex_init(&daemon->load_lock, NULL);
+  pthread_cond_init(&daemon->closed, NULL);
+  daemon->max_results = max_results;
+  thread_pool_init(&daemon->pool, num_threads);
+  fprintf(stderr, "Serving on %s with %u threads\n", socket_path, num_threads);
+
+  while (!serve_stopping) {
+    fd_set ready;
+    FD_ZERO(&ready);
+    FD_SET(listener, &ready);
+    if (pselect(listener + 1, &ready, NULL, NULL, NULL, &wait_mask) <= 0) continue;  // maybe to stop
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) continue;
+    serve_connection_t* connection = (serve_connection_t*)calloc(1, sizeof(serve_connection_t));
+    connection->daemon = daemon;
+    connection->fd = fd;
+    pthread_mutex_init(&connection->lock, NULL);
+    pthread_cond_init(&connection->idle, NULL);
+    pthread_mutex_lock(&daemon->lock);
+    connection->next = daemon->connections;
+    daemon->connections = connection;
+    pthread_mutex_unlock(&daemon->lock);
+    pthread_t thread;
+    pthread_create(&thread, NULL, serve_connection, connection);
+    pthread_detach(thread);
+  }
+
+  close(listener);
+  unlink(socket_path);
+
+  // Clients still connected get the replies to what they sent, then are closed
+  pthread_mutex_lock(&daemon->lock);
+  for (serve_connection_t* connection = daemon->connections; connection; connection = connection->next) {
+    shutdown(connection->fd, SHUT_RD);
+  }
+  while (daemon->connections) {
+    pthread_cond_wait(&daemon->closed, &daemon->lock);
+  }
+  pthread_mutex_unlock(&daemon->lock);
+  thread_pool_wait(&daemon->pool);
+  thread_pool_destroy(&daemon->pool);
+
+  // Nothing holds a trace any more but the list
+  while (daemon->traces) {
+    served_trace_t* trace = daemon->traces;
+    daemon->traces = trace->next;
+    free(trace->accesses);
+    free(trace);
+  }
+  for (uint32_t bucket = 0; bucket < SERVE_RESULT_BUCKETS; bucket++) {
+    while (daemon->results[bucket]) {
+      served_result_t* result = daemon->results[bucket];
+      daemon->results[bucket] = result->next;
+      free(result->report);
+      free(result);
+    }
+  }
+  fprintf(stderr, "Answered %" PRIu64 " requests, %" PRIu64 " of them from %" PRIu64
+          " kept reports, %" PRIu64 " more dropped\n", daemon->requests, daemon->cached_replies,
+          daemon->num_results, daemon->evicted_results);
+  pthread_cond_destroy(&daemon->closed);
+  pthread_mutex_destroy(&daemon->load_lock);
+  pthread_mutex_destroy(&daemon->lock);
+  free(daemon);
+}
+
+
+/* Lookup table for the hex decoder, 0xFF marks a non-hex character */
+static uint8_t hex_value[256];
+
+static pthread_once_t hex_table_once = PTHREAD_ONCE_INIT;
+
+static void init_hex_table(void) {
+  memset(hex_value, 0xFF, sizeof(hex_value));
+  for (int c = '0'; c <= '9'; c++) hex_value[c] = c - '0';
+  for (int c = 'a'; c <= 'f'; c++) hex_value[c] = c - 'a' + 10;
+  for (int c = 'A'; c <= 'F'; c++) hex_value[c] = c - 'A' + 10;
+}
+#endif
+
+/* Mixes the set index for set sampling, see set_sampling_t */
+static inline uint32_t sample_hash(uint32_t set) {
+  set ^= set >> 16;
+  set *= 0x85EBCA6Bu;
+  set ^= set >> 13;
+  set *= 0xC2B2AE35u;
+  set ^= set >> 16;
+  return set;
+}
+
+/* Returns 0 for a block in a set the sample of the trace reader leaves out.
+ * Decoding drops those accesses before they reach a cache.
+ */
+static inline int sampled_block(uint32_t block, uint32_t sample_mask, uint32_t sample_threshold) {
+  return sample_threshold == 0 || sample_hash(block & sample_mask) < sample_threshold;
+}
+
+#ifndef CACHE_SIM_LIBRARY
+// Records in trace->error what is wrong with the text line starting at line
+static void text_line_error(trace_reader_t* trace, const char* line, const char* what) {
+  uint64_t number = trace->line_base + 1;
+  for (const char* p = trace->data; (p = memchr(p, '\n', line - p)) != NULL; p++) {
+    number++;
+  }
+  snprintf(trace->error, sizeof(trace->error), "%s on line %" PRIu64, what, number);
+}
+
+/* Decodes up to max_accesses memory accesses from the mapped trace into batch.
+ * Every line holds
+ * 1) access type, I for an instruction, D or R for a data load and W for a
+ *    data store
+ * 2) memory address in hex, at most 8 digits past any leading zeros
+ * separated and possibly followed by spaces. Returns the number of accesses
+ * decoded, 0 once the whole trace has been read. A malformed line sets
+ * trace->error and ends the trace before it.
+ */
+static size_t read_text_transactions(trace_reader_t* trace, mem_access_t* batch, size_t max_accesses) {
+  const char* p = trace->data + trace->pos;
+  const char* end = trace->data + trace->size;
+  const uint32_t sample_mask = trace->sample_mask;
+  const uint32_t sample_threshold = trace->sample_threshold;
+  size_t n = 0;
+  uint64_t skipped = 0;
+
+  while (n < max_accesses) {
+    // Skip blank space between lines
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+    if (p == end) break;
+
+    const char* line = p;
+    char type = *p++;
+    if (type != 'I' && type != 'D' && type != 'R' && type != 'W') {
+      text_line_error(trace, line, "Unknown access type");
+      p = end;
+      break;
+    }
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+
+    const char* digits = p;
+    while (p < end && *p == '0') p++;
+    const char* significant = p;
+    uint32_t address = 0;
+    uint8_t digit;
+    while (p < end && (digit = hex_value[(uint8_t)*p]) != 0xFF) {
+      address = (address << 4) | digit;
+      p++;
+    }
+    if (p == digits || p - significant > 8) {
+      text_line_error(trace, line, p == digits ? "Missing address" : "Address wider than 32 bits");
+      p = end;
+      break;
+    }
+
+    // Dropped accesses are overwritten by the next one
+    batch[n].address = address;
+    batch[n].accesstype = (type == 'I') ? instruction : data;
+    batch[n].write = type == 'W';
+    int keep = sampled_block(address >> BLOCK_OFFSET_NUM_OF_BITS, sample_mask, sample_threshold);
+    n += keep;
+    skipped += !keep;
+  }
+
+  trace->skipped_accesses += skipped;
+  trace->pos = p - trace->data;
+  return n;
+}
+
+/* Decodes up to max_accesses memory accesses from the binary trace into
+ * batch, see binary_trace_header_t. A record longer than the 5 bytes a
+ * 32-bit varint takes, or cut off by the end of the records, sets
+ * trace->error and ends the trace before it.
+ */
+static size_t read_binary_transactions(trace_reader_t* trace, mem_access_t* batch, size_t max_accesses) {
+  const uint8_t* p = (const uint8_t*)trace->data + trace->pos;
+  const uint8_t* end = (const uint8_t*)trace->data + trace->end;
+  const uint32_t type_bits = trace->type_bits;
+  uint32_t block = trace->prev_block;
+  const uint32_t sample_mask = trace->sample_mask;
+  const uint32_t sample_threshold = trace->sample_threshold;
+  size_t n = 0;
+  uint64_t skipped = 0;
+
+  while (n < max_accesses && p < end) {
+    if (trace->chunk_left == 0) {
+      trace->chunk_left = trace->chunk_accesses;
+      block = 0;
+    }
+
+    // Most deltas fit in one byte, take that path without a loop
+    const uint8_t* record = p;
+    uint32_t value = *p++;
+    if (value & 0x80) {
+      value &= 0x7F;
+      uint8_t byte = 0x80;
+      for (uint32_t shift = 7; (byte & 0x80) && shift < 32 && p < end; shift += 7) {
+        byte = *p++;
+        value |= (uint32_t)(byte & 0x7F) << shift;
+      }
+      // Still going after 5 bytes or at the end, or a fifth byte with bits past 32
+      if ((byte & 0x80) || (p - record == 5 && byte > 0x0F)) {
+        snprintf(trace->error, sizeof(trace->error), "Corrupt binary trace record at byte %zu",
+                 (size_t)((const char*)record - trace->data + trace->byte_base));
+        p = end;
+        break;
+      }
+    }
+
+    uint32_t zigzag = value >> type_bits;
+    block += (zigzag >> 1) ^ -(zigzag & 1);
+
+    batch[n].address = block << BLOCK_OFFSET_NUM_OF_BITS;
+    batch[n].accesstype = (value & 1) ? data : instruction;
+    batch[n].write = (value >> 1) & (type_bits - 1);  // version 1 has no store bit
+    int keep = sampled_block(block, sample_mask, sample_threshold);
+    n += keep;
+    skipped += !keep;
+    trace->chunk_left--;
+  }
+
+  trace->skipped_accesses += skipped;
+  trace->prev_block = block;
+  trace->pos = (const char*)p - trace->data;
+  return n;
+}
+
+static double seconds_since(const struct timespec* start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+// Waits for a slot the simulation has released and returns it
+static stream_slot_t* stream_slot_to_fill(trace_stream_t* stream) {
+  pthread_mutex_lock(&stream->mutex);
+  if (stream->published - stream->consumed == STREAM_SLOTS) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (stream->published - stream->consumed == STREAM_SLOTS) {
+      pthread_cond_wait(&stream->drained, &stream->mutex);
+    }
+    stream->full_seconds += seconds_since(&start);
+  }
+  stream_slot_t* slot = &stream->slots[stream->published % STREAM_SLOTS];
+  pthread_mutex_unlock(&stream->mutex);
+  slot->size = 0;
+  return slot;
+}
+
+static void stream_publish(trace_stream_t* stream, int done) {
+  pthread_mutex_lock(&stream->mutex);
+  stream->published += !done;
+  stream->done = done;
+  pthread_cond_signal(&stream->filled);
+  pthread_mutex_unlock(&stream->mutex);
+}
+
+/* Whether the binary trace header can be read, with the records of a
+ * trace of size bytes between it and the chunk index.
+ */
+static int binary_header_supported(const binary_trace_header_t* header, uint64_t size) {
+  return header->version >= 1 && header->version <= BINARY_TRACE_VERSION &&
+         header->block_offset_bits == BLOCK_OFFSET_NUM_OF_BITS && header->chunk_accesses > 0 &&
+         header->index_offset >= sizeof(*header) && header->index_offset <= size;
+}
+
+/* Reads the stream until its end and decodes it slot by slot. Only whole
+ * lines are decoded, a line cut by a read waits at the front of the buffer
+ * for the rest of it. A binary trace is decoded the same way, record by
+ * record, one chunk after another up to its chunk index, which a stream
+ * has no use for. Whatever stops the reader early goes to the simulation
+ * in stream->error, after the accesses decoded before it.
+ */
+static void* stream_reader(void* arg) {
+  trace_reader_t* trace = (trace_reader_t*)arg;
+  trace_stream_t* stream = trace->stream;
+  char* buffer = (char*)malloc(STREAM_READ_BYTES);
+  size_t length = 0;
+  stream_slot_t* slot = NULL;
+  int end_of_stream = 0;
+  int format_checked = 0;
+  const size_t magic_length = sizeof(BINARY_TRACE_MAGIC) - 1;
+  uint64_t records_left = 0;  // bytes of binary records not read yet
+  struct timespec started;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+
+  // The decoders run on a view of the buffer
+  trace_reader_t view;
+  memset(&view, 0, sizeof(view));
+  view.format = text_trace;
+  view.sample_mask = trace->sample_mask;
+  view.sample_threshold = trace->sample_threshold;
+
+  while (!end_of_stream && !stream->error[0]) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ssize_t got = read(trace->fd, buffer + length, STREAM_READ_BYTES - length);
+    stream->read_seconds += seconds_since(&start);
+    if (got < 0 && errno == EINTR) continue;
+    if (got < 0) {
+      snprintf(stream->error, sizeof(stream->error), "Unable to read the trace stream");
+      break;
+    }
+    end_of_stream = got == 0;
+    length += got;
+    stream->bytes += got;
+
+    // A pipe may hand over the magic bytes, and the header, a few at a time
+    if (!format_checked) {
+      binary_trace_header_t header;
+      int binary = length >= magic_length && memcmp(buffer, BINARY_TRACE_MAGIC, magic_length) == 0;
+      if ((length < (binary ? sizeof(header) : magic_length)) && !end_of_stream) continue;
+      format_checked = 1;
+      if (binary) {
+        memcpy(&header, buffer, length < sizeof(header) ? length : sizeof(header));
+        if (length < sizeof(header) || !binary_header_supported(&header, UINT64_MAX)) {
+          snprintf(stream->error, sizeof(stream->error), "Unsupported binary trace");
+          break;
+        }
+        view.format = binary_trace;
+        view.type_bits = header.version == 1 ? 1 : 2;
+        view.chunk_accesses = header.chunk_accesses;
+        view.byte_base = sizeof(header);
+        records_left = header.index_offset - sizeof(header);
+        memmove(buffer, buffer + sizeof(header), length - sizeof(header));
+        length -= sizeof(header);
+      }
+    }
+
+    size_t whole = length;
+    if (view.format == binary_trace) {
+      // Records end in a byte below 0x80, the chunk index after them is dropped
+      if (whole >= records_left) {
+        whole = records_left;
+      } else if (!end_of_stream) {
+        while (whole > 0 && (uint8_t)buffer[whole - 1] >= 0x80) whole--;
+      }
+      if (records_left == 0) {
+        length = 0;
+        continue;
+      }
+      if (end_of_stream && whole < records_left) {
+        snprintf(stream->error, sizeof(stream->error), "Binary trace stream ends before its records do");
+      }
+    } else if (!end_of_stream) {
+      while (whole > 0 && buffer[whole - 1] != '\n') whole--;
+    }
+    if (whole == 0) {
+      if (length == STREAM_READ_BYTES) {
+        snprintf(stream->error, sizeof(stream->error),
+                 view.format == binary_trace ? "Corrupt binary trace" : "Trace line too long");
+      }
+      continue;
+    }
+
+    view.data = buffer;
+    view.size = whole;
+    view.end = whole;
+    view.pos = 0;
+    while (view.pos < whole) {
+      if (!slot) slot = stream_slot_to_fill(stream);
+      size_t room = STREAM_SLOT_ACCESSES - slot->size;
+      slot->size += view.format == binary_trace
+                        ? read_binary_transactions(&view, slot->accesses + slot->size, room)
+                        : read_text_transactions(&view, slot->accesses + slot->size, room);
+      if (slot->size == STREAM_SLOT_ACCESSES) {
+        stream_publish(stream, 0);
+        slot = NULL;
+      }
+    }
+    if (view.error[0]) {
+      memcpy(stream->error, view.error, sizeof(stream->error));
+    }
+    if (view.format == binary_trace) {
+      records_left -= whole;
+      view.byte_base += whole;
+    } else {
+      for (const char* p = buffer; (p = memchr(p, '\n', buffer + whole - p)) != NULL; p++) {
+        view.line_base++;
+      }
+    }
+    memmove(buffer, buffer + whole, length - whole);
+    length -= whole;
+  }
+
+  if (slot && slot->size > 0) {
+    stream_publish(stream, 0);
+  }
+  free(buffer);
+  stream->skipped_accesses = view.skipped_accesses;
+  stream->reader_seconds = seconds_since(&started);
+  stream_publish(stream, 1);
+  return NULL;
+}
+
+/* Copies decoded accesses out of the published slots. Waits only while the
+ * batch is still empty, so a slow producer does not hold back the ones there.
+ */
+static size_t read_stream_transactions(trace_reader_t* trace, mem_access_t* batch, size_t max_accesses) {
+  trace_stream_t* stream = trace->stream;
+  if (!stream->started) {
+    // Started on the first read, once set sampling has set up the trace
+    stream->started = 1;
+    pthread_create(&stream->thread, NULL, stream_reader, trace);
+  }
+
+  size_t n = 0;
+  while (n < max_accesses) {
+    pthread_mutex_lock(&stream->mutex);
+    if (n == 0 && stream->consumed == stream->published && !stream->done) {
+      struct timespec start;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      while (stream->consumed == stream->published && !stream->done) {
+        pthread_cond_wait(&stream->filled, &stream->mutex);
+      }
+      stream->empty_seconds += seconds_since(&start);
+    }
+    int empty = stream->consumed == stream->published;
+    int done = stream->done;
+    pthread_mutex_unlock(&stream->mutex);
+    if (empty) {
+      if (done) {
+        trace->skipped_accesses = stream->skipped_accesses;
+        memcpy(trace->error, stream->error, sizeof(trace->error));
+      }
+      break;
+    }
+
+    const stream_slot_t* slot = &stream->slots[stream->consumed % STREAM_SLOTS];
+    size_t take = slot->size - stream->next;
+    if (take > max_accesses - n) take = max_accesses - n;
+    memcpy(batch + n, slot->accesses + stream->next, take * sizeof(mem_access_t));
+    n += take;
+    stream->next += take;
+    if (stream->next == slot->size) {
+      stream->next = 0;
+      pthread_mutex_lock(&stream->mutex);
+      stream->consumed++;
+      pthread_cond_signal(&stream->drained);
+      pthread_mutex_unlock(&stream->mutex);
+    }
+  }
+  return n;
+}
+
+/* Decodes up to max_accesses memory accesses from the trace into batch,
+ * returns 0 once the whole trace has been read. For a stream the time
+ * includes waiting for the reader thread. A malformed trace exits with why,
+ * unless trace->keep_errors leaves trace->error to the caller.
+ */
+static size_t read_transactions(trace_reader_t* trace, mem_access_t* batch, size_t max_accesses) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  size_t n = trace->stream ? read_stream_transactions(trace, batch, max_accesses)
+             : trace->format == binary_trace ? read_binary_transactions(trace, batch, max_accesses)
+                                             : read_text_transactions(trace, batch, max_accesses);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  trace->decode_seconds += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+  if (trace->error[0] && !trace->keep_errors) {
+    printf("%s\n", trace->error);
+    close_trace(trace);  // joins the reader of a stream
+    exit(0);
+  }
+  return n;
+}
+
+// Returns 0 if the write failed
+static int write_varint(FILE* file, uint32_t value) {
+  uint8_t bytes[5];
+  size_t n = 0;
+  while (value >= 0x80) {
+    bytes[n++] = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  bytes[n++] = value;
+  return fwrite(bytes, 1, n, file) == n;
+}
+
+/* Converts a text trace into the binary trace format. The header is
+ * rewritten at the end with the counts, so the output must be a file, but
+ * the result can be streamed like a text trace. A failed conversion leaves
+ * no partial output file behind.
+ */
+static void convert_trace(char* text_file_name, char* binary_file_name) {
+  trace_reader_t* trace = read_access_from_file(text_file_name);
+  if (trace->format != text_trace) {
+    printf("Trace is already in the binary format\n");
+    exit(1);
+  }
+  trace->keep_errors = 1;
+
+  FILE* out = fopen(binary_file_name, "wb");
+  struct stat out_stat;
+  if (!out || fstat(fileno(out), &out_stat) != 0) {
+    printf("Unable to open the output file\n");
+    exit(1);
+  }
+
+  binary_trace_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BINARY_TRACE_MAGIC, sizeof(header.magic));
+  header.version = BINARY_TRACE_VERSION;
+  header.block_offset_bits = BLOCK_OFFSET_NUM_OF_BITS;
+  header.chunk_accesses = BINARY_TRACE_CHUNK;
+  int written = fwrite(&header, sizeof(header), 1, out) == 1;
+
+  uint64_t* chunk_index = NULL;
+  uint64_t num_chunks = 0;
+  uint32_t prev_block = 0;
+
+  mem_access_t batch[TRACE_BATCH_SIZE];
+  size_t batch_size;
+  while (written && (batch_size = read_transactions(trace, batch, TRACE_BATCH_SIZE)) > 0) {
+    for (size_t i = 0; i < batch_size && written; i++, header.num_accesses++) {
+      if (header.num_accesses % BINARY_TRACE_CHUNK == 0) {
+        if ((num_chunks & (num_chunks - 1)) == 0) {
+          chunk_index = (uint64_t*)realloc(chunk_index, (num_chunks ? 2 * num_chunks : 1) * sizeof(uint64_t));
+        }
+        long offset = ftell(out);
+        written = offset >= 0;
+        chunk_index[num_chunks++] = offset;
+        prev_block = 0;
+      }
+
+      uint32_t block = batch[i].address >> BLOCK_OFFSET_NUM_OF_BITS;
+      int32_t delta = (int32_t)(block - prev_block);
+      uint32_t zigzag = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+      written &= write_varint(out, (zigzag << 2) | (batch[i].write << 1) | (batch[i].accesstype == data));
+      prev_block = block;
+    }
+  }
+
+  long index_offset = written ? ftell(out) : -1;
+  header.index_offset = index_offset;
+  written = index_offset >= 0 && !trace->error[0] &&
+            fwrite(chunk_index, sizeof(uint64_t), num_chunks, out) == num_chunks &&
+            fseek(out, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, out) == 1;
+  written = fclose(out) == 0 && written;
+  free(chunk_index);
+  if (!written) {
+    if (S_ISREG(out_stat.st_mode)) remove(binary_file_name);
+    printf("%s\n", trace->error[0] ? trace->error : "Unable to write the output file");
+    close_trace(trace);
+    exit(1);
+  }
+
+  printf("Converted %" PRIu64 " accesses (%zu bytes) into %" PRIu64 " bytes\n",
+         header.num_accesses, trace->stream ? (size_t)trace->stream->bytes : trace->size,
+         (uint64_t)header.index_offset);
+  close_trace(trace);
+}
+
+/* Decodes the whole trace into one array, for modes that share it between
+ * simulations or need to look ahead.
+ */
+static mem_access_t* load_trace(trace_reader_t* trace, size_t* num_accesses) {
+  size_t capacity = 1 << 16;
+  size_t n = 0;
+  mem_access_t* accesses = (mem_access_t*)malloc(capacity * sizeof(mem_access_t));
+  size_t batch_size;
+
+  while ((batch_size = read_transactions(trace, accesses + n, capacity - n)) > 0) {
+    n += batch_size;
+    if (n == capacity) {
+      capacity *= 2;
+      accesses = (mem_access_t*)realloc(accesses, capacity * sizeof(mem_access_t));
+    }
+  }
+  *num_accesses = n;
+  return accesses;
+}
+
+
+static int pop_job(job_queue_t* queue, int steal, void (**function)(void*), void** arg) {
+  int found = 0;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->head != queue->tail) {
+    size_t slot = steal ? queue->head++ : --queue->tail;
+    *function = queue->functions[slot % queue->capacity];
+    *arg = queue->args[slot % queue->capacity];
+    found = 1;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return found;
+}
+
+static void* thread_pool_worker(void* arg) {
+  thread_pool_t* pool = (thread_pool_t*)((void**)arg)[0];
+  uint32_t id = (uint32_t)(uintptr_t)((void**)arg)[1];
+  free(arg);
+
+  while (1) {
+    void (*function)(void*);
+    void* job_arg;
+
+    // Own queue first, then steal from the others
+    int found = pop_job(&pool->queues[id], 0, &function, &job_arg);
+    for (uint32_t i = 1; !found && i < pool->num_threads; i++) {
+      found = pop_job(&pool->queues[(id + i) % pool->num_threads], 1, &function, &job_arg);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (!found) {
+      while (pool->queued == 0 && !pool->stop) {
+        pthread_cond_wait(&pool->wake, &pool->lock);
+      }
+      int stop = pool->stop && pool->queued == 0;
+      pthread_mutex_unlock(&pool->lock);
+      if (stop) return NULL;
+      continue;
+    }
+    pool->queued--;
+    pthread_mutex_unlock(&pool->lock);
+
+    function(job_arg);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->unfinished == 0) {
+      pthread_cond_broadcast(&pool->idle);
+    }
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+/* Work stealing thread pool: every worker owns a job queue, jobs are handed
+ * out round robin and workers that run dry take jobs from the others.
+ */
+static void thread_pool_init(thread_pool_t* pool, uint32_t num_threads) {
+  memset(pool, 0, sizeof(*pool));
+  pool->num_threads = num_threads;
+  pool->threads = (pthread_t*)malloc(num_threads * sizeof(pthread_t));
+  pool->queues = (job_queue_t*)calloc(num_threads, sizeof(job_queue_t));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+
+  for (uint32_t i = 0; i < num_threads; i++) {
+    pthread_mutex_init(&pool->queues[i].lock, NULL);
+  }
+  for (uint32_t i = 0; i < num_threads; i++) {
+    void** worker_arg = (void**)malloc(2 * sizeof(void*));
+    worker_arg[0] = pool;
+    worker_arg[1] = (void*)(uintptr_t)i;
+    pthread_create(&pool->threads[i], NULL, thread_pool_worker, worker_arg);
+  }
+}
+
+static void thread_pool_submit(thread_pool_t* pool, void (*function)(void*), void* arg) {
+  pthread_mutex_lock(&pool->lock);
+  job_queue_t* queue = &pool->queues[pool->next_queue];
+  pool->next_queue = (pool->next_queue + 1) % pool->num_threads;
+  pool->queued++;
+  pool->unfinished++;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->tail - queue->head == queue->capacity) {
+    // Grow and unwrap the ring
+    size_t capacity = queue->capacity ? 2 * queue->capacity : 16;
+    void (**functions)(void*) = malloc(capacity * sizeof(*functions));
+    void** args = (void**)malloc(capacity * sizeof(void*));
+    for (size_t i = queue->head; i < queue->tail; i++) {
+      functions[i - queue->head] = queue->functions[i % queue->capacity];
+      args[i - queue->head] = queue->args[i % queue->capacity];
+    }
+    free(queue->functions);
+    free(queue->args);
+    queue->functions = functions;
+    queue->args = args;
+    queue->tail -= queue->head;
+    queue->head = 0;
+    queue->capacity = capacity;
+  }
+  queue->functions[queue->tail % queue->capacity] = function;
+  queue->args[queue->tail % queue->capacity] = arg;
+  queue->tail++;
+  pthread_mutex_unlock(&queue->lock);
+
+  pthread_cond_signal(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+// Blocks until every submitted job has finished
+static void thread_pool_wait(thread_pool_t* pool) {
+  pthread_mutex_lock(&pool->lock);
+  while (pool->unfinished > 0) {
+    pthread_cond_wait(&pool->idle, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void thread_pool_destroy(thread_pool_t* pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (uint32_t i = 0; i < pool->num_threads; i++) {
+    pthread_join(pool->threads[i], NULL);
+    pthread_mutex_destroy(&pool->queues[i].lock);
+    free(pool->queues[i].functions);
+    free(pool->queues[i].args);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wake);
+  pthread_cond_destroy(&pool->idle);
+  free(pool->threads);
+  free(pool->queues);
+}
+#endif
+
+
+typedef struct {
+  cache_config_t config;
+  const mem_access_t* trace;
+  size_t num_accesses;
+  cache_stat_t stats;
+  double seconds;
+} sweep_job_t;
+
+#ifndef CACHE_SIM_LIBRARY
+static void run_sweep_job(void* arg) {
+  sweep_job_t* job = (sweep_job_t*)arg;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (job->config.policy == opt) {
+    job->stats = cache_sim_opt(&job->config, job->trace, job->num_accesses, NULL);
+  } else {
+    cache_sim_t* sim = cache_sim_create();
+    cache_sim_configure(sim, &job->config);
+    cache_sim_feed(sim, job->trace, job->num_accesses);
+    job->stats = cache_sim_stats(sim);
+    cache_sim_destroy(sim);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  job->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+}
+
+/* Splits a comma separated list into at most max_items items, in place */
+static int split_list(char* list, char** items, int max_items) {
+  int n = 0;
+  char* saved;
+  for (char* item = strtok_r(list, ",", &saved); item && n < max_items;
+       item = strtok_r(NULL, ",", &saved)) {
+    items[n++] = item;
+  }
+  return n;
+}
+#endif
+
+#define SWEEP_MAX_ITEMS 64
+
+#ifndef CACHE_SIM_LIBRARY
+/* Simulates every combination of the given sizes, mappings, organizations and
+ * policies on a thread pool, all reading the same decoded trace:
+ * ./cache_sim sweep [trace file] [sizes] [mappings] [organizations] [policies] [--threads=N]
+ * Lists are comma separated, a size item may be a power of two range 128-4096
+ * and a mapping item may give the ways, as in sa8.
+ */
+static void run_sweep(int argc, char** argv) {
+  char* positional[5] = {trace_file_name, "128-4096", "dm,fa", "uc,sc", "fifo"};
+  uint32_t num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  for (int i = 2, n = 0; i < argc; i++) {
+    if (strncmp(argv[i], "--threads=", 10) == 0) {
+      if (!parse_count(argv[i] + 10, &num_threads)) {
+        printf("The number of sweep threads must be a positive number\n");
+        exit(0);
+      }
+    } else if (n < 5) {
+      positional[n++] = argv[i];
+    } else {
+      printf("Too many sweep parameters\n");
+      exit(0);
+    }
+  }
+  if (num_threads == 0) num_threads = 1;
+
+  char* sizes[SWEEP_MAX_ITEMS];
+  char* mappings[SWEEP_MAX_ITEMS];
+  char* orgs[SWEEP_MAX_ITEMS];
+  char* policies[SWEEP_MAX_ITEMS];
+  int num_sizes = split_list(positional[1], sizes, SWEEP_MAX_ITEMS);
+  int num_mappings = split_list(positional[2], mappings, SWEEP_MAX_ITEMS);
+  int num_orgs = split_list(positional[3], orgs, SWEEP_MAX_ITEMS);
+  int num_policies = split_list(positional[4], policies, SWEEP_MAX_ITEMS);
+
+  // Expand the configurations, dropping the ones that cannot be simulated
+  size_t max_jobs = (size_t)num_mappings * num_orgs * num_policies * 32 * num_sizes;
+  sweep_job_t* jobs = (sweep_job_t*)calloc(max_jobs, sizeof(sweep_job_t));
+  size_t num_jobs = 0;
+  for (int size_item = 0; size_item < num_sizes; size_item++) {
+    uint32_t first = atoi(sizes[size_item]);
+    char* range = strchr(sizes[size_item], '-');
+    uint32_t last = range ? (uint32_t)atoi(range + 1) : first;
+
+    for (uint64_t size = first; size <= last && size > 0; size = range ? size * 2 : last + 1ull) {
+      for (int m = 0; m < num_mappings; m++) {
+        for (int o = 0; o < num_orgs; o++) {
+          for (int p = 0; p < num_policies; p++) {
+            cache_config_t config = {.size = (uint32_t)size, .mapping = dm, .org = uc, .ways = 4,
+                                     .policy = fifo};
+            if (!parse_cache_mapping(mappings[m], &config) || !parse_cache_org(orgs[o], &config) ||
+                !parse_cache_policy(policies[p], &config)) {
+              printf("Unknown sweep parameter in %s %s %s\n", mappings[m], orgs[o], policies[p]);
+              exit(0);
+            }
+            const char* error = check_cache_config(&config);
+            if (error) {
+              fprintf(stderr, "Skipping %" PRIu64 " %s %s %s: %s\n", size, mappings[m], orgs[o],
+                      policies[p], error);
+              continue;
+            }
+            jobs[num_jobs++].config = config;
+          }
+        }
+      }
+    }
+  }
+
+  // More threads than configurations would only idle
+  if (num_threads > num_jobs) num_threads = num_jobs > 0 ? num_jobs : 1;
+
+  // Decode the trace once, every simulation reads the same copy
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  trace_reader_t* trace = read_access_from_file(positional[0]);
+  size_t num_accesses;
+  mem_access_t* accesses = load_trace(trace, &num_accesses);
+  close_trace(trace);
+
+  thread_pool_t pool;
+  thread_pool_init(&pool, num_threads);
+  for (size_t i = 0; i < num_jobs; i++) {
+    jobs[i].trace = accesses;
+    jobs[i].num_accesses = num_accesses;
+    thread_pool_submit(&pool, run_sweep_job, &jobs[i]);
+  }
+  thread_pool_wait(&pool);
+  thread_pool_destroy(&pool);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  printf("\nCache Sweep\n");
+  printf("-----------\n\n");
+  printf("%-10s %-8s %-4s %-7s %-14s %-14s %-9s %s\n", "Size", "Mapping", "Org", "Policy",
+         "Accesses", "Hits", "Hit Rate", "Seconds");
+  for (size_t i = 0; i < num_jobs; i++) {
+    cache_config_t* config = &jobs[i].config;
+    char mapping[16];
+    if (config->mapping == sa) {
+      snprintf(mapping, sizeof(mapping), "sa%u", config->ways);
+    } else {
+      snprintf(mapping, sizeof(mapping), "%s", mapping_names[config->mapping]);
+    }
+    printf("%-10u %-8s %-4s %-7s %-14" PRIu64 " %-14" PRIu64 " %-9.4f %.3f\n", config->size, mapping,
+           org_names[config->org], policy_names[config->policy], jobs[i].stats.accesses,
+           jobs[i].stats.hits,
+           jobs[i].stats.accesses ? (double)jobs[i].stats.hits / jobs[i].stats.accesses : 0.0,
+           jobs[i].seconds);
+  }
+
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+  fprintf(stderr, "\n%zu configurations on %u threads in %.3f s\n", num_jobs, num_threads, seconds);
+
+  free(accesses);
+  free(jobs);
+}
+#endif
+
+
+/* Synthetic traces. Instructions run straight through a small code region
+ * and loop, data accesses follow one of the patterns below over a footprint
+ * rounded up to a power of two blocks:
+ * - seq: consecutive words
+ * - stride: every stride bytes, wrapping around the footprint
+ * - uniform: uniformly random words
+ * - zipf: random blocks with a Zipfian popularity of the given skew, the
+ *   popular blocks scattered over the footprint
+ * - chase: a pointer chase along one random cycle through all blocks
+ * Equal parameters and seeds give equal traces.
+ */
+#define GEN_CODE_BASE 0x00400000u
+#define GEN_CODE_BYTES (16 * 1024)
+#define GEN_DATA_BASE 0x10000000u
+
+typedef enum { seq_pattern, stride_pattern, uniform_pattern, zipf_pattern, chase_pattern } trace_pattern_t;
+
+#ifndef CACHE_SIM_LIBRARY
+static const char* pattern_names[] = {"seq", "stride", "uniform", "zipf", "chase"};
+#endif
+
+typedef struct {
+  trace_pattern_t pattern;
+  uint32_t footprint;     // bytes of data touched
+  uint32_t stride;        // bytes between stride accesses
+  double skew;            // Zipf exponent
+  uint32_t data_percent;  // share of data accesses
+  uint64_t seed;
+  uint32_t write_percent; // share of the data accesses that are stores
+} trace_gen_config_t;
+
+typedef struct {
+  trace_gen_config_t config;
+  uint32_t num_blocks;
+  uint64_t rng;
+  uint32_t pc;            // offset of the next instruction in the code region
+  uint64_t position;      // data offset of seq and stride, block of chase
+  uint32_t* next_block;   // chase cycle
+  double* zipf_cdf;       // cumulative popularity of the ranks
+} trace_gen_t;
+
+static inline uint64_t splitmix64(uint64_t* state) {
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+// Uniform in [0, bound)
+static inline uint32_t gen_below(trace_gen_t* gen, uint32_t bound) {
+  return (uint32_t)(((splitmix64(&gen->rng) >> 32) * bound) >> 32);
+}
+
+#ifndef CACHE_SIM_LIBRARY
+static void init_trace_gen(trace_gen_t* gen, const trace_gen_config_t* config) {
+  memset(gen, 0, sizeof(trace_gen_t));
+  gen->config = *config;
+  gen->rng = config->seed;
+  gen->num_blocks = 1;
+  while ((uint64_t)gen->num_blocks * BLOCK_SIZE < config->footprint) gen->num_blocks <<= 1;
+  gen->config.footprint = gen->num_blocks * BLOCK_SIZE;
+  if (gen->config.stride == 0) gen->config.stride = BLOCK_SIZE;
+
+  if (config->pattern == chase_pattern) {
+    // Sattolo's algorithm gives a single cycle through every block
+    gen->next_block = (uint32_t*)malloc(gen->num_blocks * sizeof(uint32_t));
+    for (uint32_t i = 0; i < gen->num_blocks; i++) gen->next_block[i] = i;
+    for (uint32_t i = gen->num_blocks - 1; i > 0; i--) {
+      uint32_t j = gen_below(gen, i);
+      uint32_t block = gen->next_block[i];
+      gen->next_block[i] = gen->next_block[j];
+      gen->next_block[j] = block;
+    }
+  } else if (config->pattern == zipf_pattern) {
+    gen->zipf_cdf = (double*)malloc(gen->num_blocks * sizeof(double));
+    double sum = 0;
+    for (uint32_t rank = 0; rank < gen->num_blocks; rank++) {
+      sum += 1.0 / pow(rank + 1.0, config->skew);
+      gen->zipf_cdf[rank] = sum;
+    }
+    for (uint32_t rank = 0; rank < gen->num_blocks; rank++) gen->zipf_cdf[rank] /= sum;
+  }
+}
+
+static void free_trace_gen(trace_gen_t* gen) {
+  free(gen->next_block);
+  free(gen->zipf_cdf);
+}
+#endif
+
+static uint32_t next_data_offset(trace_gen_t* gen) {
+  uint32_t offset = 0;
+  switch (gen->config.pattern) {
+    case seq_pattern:
+    case stride_pattern:
+      offset = (uint32_t)gen->position;
+      gen->position = (gen->position + (gen->config.pattern == seq_pattern ? 4 : gen->config.stride)) %
+                      gen->config.footprint;
+      break;
+    case uniform_pattern:
+      offset = gen_below(gen, gen->config.footprint) & ~3u;
+      break;
+    case zipf_pattern: {
+      double u = (splitmix64(&gen->rng) >> 11) * 0x1.0p-53;
+      uint32_t low = 0, high = gen->num_blocks - 1;
+      while (low < high) {
+        uint32_t mid = (low + high) / 2;
+        if (gen->zipf_cdf[mid] < u) low = mid + 1; else high = mid;
+      }
+      // An odd multiplier permutes the blocks, spreading the popular ones
+      uint32_t block = (low * 0x9E3779B1u) & (gen->num_blocks - 1);
+      offset = block * BLOCK_SIZE + (gen_below(gen, BLOCK_SIZE) & ~3u);
+      break;
+    }
+    case chase_pattern:
+      gen->position = gen->next_block[gen->position];
+      offset = (uint32_t)gen->position * BLOCK_SIZE;
+      break;
+  }
+  return offset;
+}
+
+static inline mem_access_t next_generated_access(trace_gen_t* gen) {
+  mem_access_t access;
+  access.write = 0;
+  if (gen_below(gen, 100) < gen->config.data_percent) {
+    access.accesstype = data;
+    access.address = GEN_DATA_BASE + next_data_offset(gen);
+    // Draw only for stores, so traces without them stay as they were
+    if (gen->config.write_percent > 0) {
+      access.write = gen_below(gen, 100) < gen->config.write_percent;
+    }
+  } else {
+    access.accesstype = instruction;
+    access.address = GEN_CODE_BASE + gen->pc;
+    gen->pc = (gen->pc + 4) % GEN_CODE_BYTES;
+  }
+  return access;
+}
+
+#ifndef CACHE_SIM_LIBRARY
+static int parse_trace_pattern(const char* arg, trace_pattern_t* pattern) {
+  for (int i = 0; i <= chase_pattern; i++) {
+    if (strcmp(arg, pattern_names[i]) == 0) {
+      *pattern = (trace_pattern_t)i;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Parses a generator option into config, returns 0 if arg is not one */
+static int parse_trace_gen_option(const char* arg, trace_gen_config_t* config) {
+  if (strncmp(arg, "--footprint=", 12) == 0) {
+    config->footprint = strtoul(arg + 12, NULL, 0);
+  } else if (strncmp(arg, "--stride=", 9) == 0) {
+    config->stride = strtoul(arg + 9, NULL, 0);
+  } else if (strncmp(arg, "--skew=", 7) == 0) {
+    config->skew = atof(arg + 7);
+  } else if (strncmp(arg, "--data=", 7) == 0) {
+    config->data_percent = atoi(arg + 7);
+  } else if (strncmp(arg, "--seed=", 7) == 0) {
+    config->seed = strtoull(arg + 7, NULL, 0);
+  } else if (strncmp(arg, "--writes=", 9) == 0) {
+    config->write_percent = atoi(arg + 9);
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+static const trace_gen_config_t default_trace_gen_config = {seq_pattern, 1 << 20, 64, 0.99,
+                                                            35, 1, 0};
+
+/* Writes a synthetic text trace:
+ * ./cache_sim gen [pattern] [accesses] [trace file] [--footprint=BYTES] [--stride=BYTES]
+ *                 [--skew=S] [--data=PERCENT] [--writes=PERCENT] [--seed=N]
+ */
+static void generate_trace(int argc, char** argv) {
+  trace_gen_config_t config = default_trace_gen_config;
+  if (argc < 5 || !parse_trace_pattern(argv[2], &config.pattern)) {
+    printf("Usage: ./cache_sim gen [seq|stride|uniform|zipf|chase] [accesses] [trace file] [options]\n");
+    exit(0);
+  }
+  uint64_t num_accesses = strtoull(argv[3], NULL, 0);
+  for (int i = 5; i < argc; i++) {
+    if (!parse_trace_gen_option(argv[i], &config)) {
+      printf("Unknown option %s\n", argv[i]);
+      exit(0);
+    }
+  }
+  if (config.data_percent > 100 || config.write_percent > 100 || config.footprint == 0 ||
+      config.footprint > (1u << 30)) {
+    printf("The data and store shares must be at most 100%% and the footprint 1 to 2^30 bytes\n");
+    exit(0);
+  }
+
+  FILE* out = fopen(argv[4], "w");
+  if (!out) {
+    printf("Unable to open the output file\n");
+    exit(1);
+  }
+
+  trace_gen_t gen;
+  init_trace_gen(&gen, &config);
+
+  // Format the lines by hand, printf would take most of the time
+  static const char hex_digits[] = "0123456789abcdef";
+  char buffer[1 << 16];
+  size_t used = 0;
+  for (uint64_t i = 0; i < num_accesses; i++) {
+    if (used > sizeof(buffer) - 16) {
+      fwrite(buffer, 1, used, out);
+      used = 0;
+    }
+    mem_access_t access = next_generated_access(&gen);
+    buffer[used++] = access.accesstype == instruction ? 'I' : access.write ? 'W' : 'D';
+    buffer[used++] = ' ';
+    for (int shift = 28; shift >= 0; shift -= 4) {
+      buffer[used++] = hex_digits[(access.address >> shift) & 0xf];
+    }
+    buffer[used++] = '\n';
+  }
+  fwrite(buffer, 1, used, out);
+  fclose(out);
+  free_trace_gen(&gen);
+
+  printf("Generated %" PRIu64 " %s accesses\n", num_accesses, pattern_names[config.pattern]);
+}
+
+
+/* Measures the simulator on synthetic traces: every pattern against every
+ * mapping, organization and policy, each simulation timed as the best of
+ * --repeat runs on a decoded trace, so decoding is not included.
+ * ./cache_sim bench [accesses] [--size=N] [--repeat=N] [generator options]
+ */
+static void run_benchmark(int argc, char** argv) {
+  trace_gen_config_t config = default_trace_gen_config;
+  uint64_t num_accesses = 1 << 20;
+  uint32_t size = 4096;
+  uint32_t repeat = 3;
+
+  for (int i = 2; i < argc; i++) {
+    if (strncmp(argv[i], "--size=", 7) == 0) {
+      size = atoi(argv[i] + 7);
+    } else if (strncmp(argv[i], "--repeat=", 9) == 0) {
+      repeat = atoi(argv[i] + 9);
+    } else if (parse_trace_gen_option(argv[i], &config)) {
+      continue;
+    } else if (strncmp(argv[i], "--", 2) != 0) {
+      num_accesses = strtoull(argv[i], NULL, 0);
+    } else {
+      printf("Unknown option %s\n", argv[i]);
+      exit(0);
+    }
+  }
+  if (repeat == 0) repeat = 1;
+  if (num_accesses == 0 || num_accesses >= UINT32_MAX || config.data_percent > 100 ||
+      config.write_percent > 100 || config.footprint == 0 || config.footprint > (1u << 30)) {
+    printf("Benchmark needs 1 to 2^32 - 2 accesses, data and store shares of at most 100%% and "
+           "a footprint of 1 to 2^30 bytes\n");
+    exit(0);
+  }
+
+  mem_access_t* accesses = (mem_access_t*)malloc(num_accesses * sizeof(mem_access_t));
+  double log_rate_sum = 0;
+  uint32_t num_runs = 0;
+
+  printf("\nCache Benchmark\n");
+  printf("---------------\n\n");
+  printf("%" PRIu64 " accesses per trace, %u byte caches, best of %u runs\n\n", num_accesses, size,
+         repeat);
+  printf("%-8s %-8s %-4s %-7s %-9s %-9s %s\n", "Pattern", "Mapping", "Org", "Policy", "Hit Rate",
+         "Macc/s", "ns/access");
+
+  for (int pattern = 0; pattern <= chase_pattern; pattern++) {
+    config.pattern = (trace_pattern_t)pattern;
+    trace_gen_t gen;
+    init_trace_gen(&gen, &config);
+    for (uint64_t i = 0; i < num_accesses; i++) accesses[i] = next_generated_access(&gen);
+    free_trace_gen(&gen);
+
+    for (int mapping = dm; mapping <= sa; mapping++) {
+      for (int org = uc; org <= sc; org++) {
+        // A direct mapped cache has nothing to replace
+        int last_policy = mapping == dm ? fifo : opt;
+        for (int policy = fifo; policy <= last_policy; policy++) {
+          cache_config_t cache = {.size = size, .mapping = (cache_map_t)mapping,
+                                  .org = (cache_org_t)org, .ways = 4,
+                                  .policy = (cache_policy_t)policy};
+          const char* error = check_cache_config(&cache);
+          if (error) {
+            fprintf(stderr, "Skipping %s %s %s: %s\n", mapping_names[mapping], org_names[org],
+                    policy_names[policy], error);
+            continue;
+          }
+
+          cache_stat_t stats = {0, 0};
+          double best = 0;
+          for (uint32_t run = 0; run < repeat; run++) {
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            if (policy == opt) {
+              stats = cache_sim_opt(&cache, accesses, num_accesses, NULL);
+            } else {
+              cache_sim_t* sim = cache_sim_create();
+              cache_sim_configure(sim, &cache);
+              cache_sim_feed(sim, accesses, num_accesses);
+              stats = cache_sim_stats(sim);
+              cache_sim_destroy(sim);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+            if (run == 0 || seconds < best) best = seconds;
+          }
+
+          double rate = num_accesses / best * 1e-6;
+          log_rate_sum += log(rate);
+          num_runs++;
+          printf("%-8s %-8s %-4s %-7s %-9.4f %-9.2f %.2f\n", pattern_names[pattern],
+                 mapping_names[mapping], org_names[org], policy_names[policy],
+                 (double)stats.hits / stats.accesses, rate, best * 1e9 / num_accesses);
+        }
+      }
+    }
+  }
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("\nGeometric mean: %.2f Macc/s over %u simulations\n", exp(log_rate_sum / num_runs), num_runs);
+  printf("Peak RSS:       %ld KiB\n", usage.ru_maxrss);
+  free(accesses);
+}
+
+
+static void read_params_and_init(int argc, char** argv){
+  /* Read command-line parameters and initialize:
+   * cache_size, cache_mapping and cache_org variables
+   */
+  /* IMPORTANT: THE TRACE FILE, THE --OPTIONS AND THE MODES (convert, sweep,
+   * serve, ...) ARE ALL OPTIONAL ADDITIONS. THE BINARY MUST STILL RUN WITH
+   * ONLY THE PARAMETERS OF THE UNMODIFIED FILE (cache_size, cache_mapping
+   * and cache_org), READING mem_trace.txt, AND THEN WRITE NOTHING TO STDOUT
+   * BUT THE UNCHANGED print_statistics() OUTPUT. ANY PARAMETER ADDED LATER
+   * GOES AFTER THESE THREE, WITH A DEFAULT THAT KEEPS BOTH TRUE.
+   */
+  if (argc < 4) { /* argc should be at least 4 for correct execution */
+    printf(
+        "Usage: ./cache_sim [cache size: 128-4096] [cache mapping: dm|fa|sa] "
+        "[cache organization: uc|sc] [trace file: mem_trace.txt] [options]\n"
+        "       ./cache_sim [cache size] [cache mapping] [cache organization] [trace file per core]... "
+        "[options]\n"
+        "       ./cache_sim convert [text trace] [binary trace]\n"
+        "       ./cache_sim curve [trace file]\n"
+        "       ./cache_sim sweep [trace file] [sizes] [mappings] [organizations] [policies] "
+        "[--threads=N]\n"
+        "       ./cache_sim gen [seq|stride|uniform|zipf|chase] [accesses] [trace file] "
+        "[generator options]\n"
+        "       ./cache_sim bench [accesses] [--size=N] [--repeat=N] [generator options]\n"
+        "       ./cache_sim serve [socket: cache_sim.sock] [--threads=N] [--max-results=N: 4096]\n"
+        "                 answers a request line of [cache size] [mapping] [organization] "
+        "[trace file] [options] with a JSON line\n"
+        "A trace file of - is stdin, which like a pipe is read as a stream, text or binary\n"
+        "Options:\n"
+        "  --ways=N              ways per set for sa mapping (default 4)\n"
+        "  --policy=NAME         replacement policy, fifo|lru|plru|srrip|brrip|nru|random|opt "
+        "(default fifo)\n"
+        "  --seed=N              seed of the random policy (default 0)\n"
+        "  --write=wb|wt         L1 store hits mark the line dirty (write-back) or go down "
+        "(write-through, default wb)\n"
+        "  --write-miss=wa|nwa   L1 store misses fill the block (write-allocate) or only go down "
+        "(default wa)\n"
+        "  --prefetch=KIND[:N]   L1 prefetcher, next|stride|stream, requesting N blocks at a time "
+        "(default 1, 2 and 4)\n"
+        "  --classify            sort misses into compulsory, capacity and conflict\n"
+        "  --sample=N            simulate about one set in N and estimate the hit rate\n"
+        "  --threads=N           simulate the sets on N threads, sharded by set index, or with\n"
+        "                        several cores, every core on a thread of its own\n"
+        "  --coherence=mesi|moesi\n"
+        "                        protocol keeping the L1 caches of the cores coherent (default mesi)\n"
+        "  --interleave=N        accesses of each core per turn of the round robin (default 1)\n"
+        "  --set-histogram       count the misses of every set, for the reports\n"
+        "  --itlb=SPEC, --dtlb=SPEC, --l2tlb=SPEC\n"
+        "                        instruction, data and shared second level TLB, SPEC is "
+        "entries[:ways|fa] (default 4 ways)\n"
+        "  --page=4k|2m          page size of the TLBs (default 4k)\n"
+        "  --latency=L1[:L2[:L3]]\n"
+        "                        lookup cycles of each level, turns on the timing model "
+        "(default 4:12:40)\n"
+        "  --memory-latency=N    cycles memory takes for a block (default 200)\n"
+        "  --bandwidth=N         memory bytes per cycle (default unlimited)\n"
+        "  --mshrs=N             data misses in flight at once, 0 blocks on every miss (default 0)\n"
+        "                        any of these turns on the timing model\n"
+        "  --window=N            print the statistics of every N accesses as CSV and detect "
+        "phases\n"
+        "  --window-csv=FILE     where the rows of --window go (default -, stdout)\n"
+        "  --json=FILE, --csv=FILE\n"
+        "                        also write the statistics, timing and memory use, - is stdout\n"
+        "  --l2=SPEC, --l3=SPEC  unified lower level, SPEC is "
+        "size[:ways|fa[:policy[:inclusive|exclusive|nine]]]\n"
+        "Generator options:\n"
+        "  --footprint=BYTES     data bytes touched, rounded up to a power of two blocks "
+        "(default 1 MiB)\n"
+        "  --stride=BYTES        step of the stride pattern (default 64)\n"
+        "  --skew=S              exponent of the zipf pattern (default 0.99)\n"
+        "  --data=PERCENT        share of data accesses, the rest are instructions (default 35)\n"
+        "  --writes=PERCENT      share of the data accesses that are stores (default 0)\n"
+        "  --seed=N              seed of the random patterns (default 1)\n");
+    exit(0);
+  } else {
+    /* argv[0] is program name, parameters start with argv[1] */
+
+    /* Set cache size */
+    if (!parse_cache_size(argv[1], &cache_config)) {
+      printf("Unknown cache size\n");
+      exit(0);
+    }
+
+    /* Set Cache Mapping */
+    if (!parse_cache_mapping(argv[2], &cache_config)) {
+      printf("Unknown cache mapping\n");
+      exit(0);
+    }
+
+    /* Set Cache Organization */
+    if (!parse_cache_org(argv[3], &cache_config)) {
+      printf("Unknown cache organization\n");
+      exit(0);
+    }
+
+    /* Set trace file, defaults to mem_trace.txt, and optional parameters */
+    for (int i = 4; i < argc; i++) {
+      char error[256];
+      int parsed = parse_config_option(argv[i], &cache_config, error, sizeof(error));
+      if (parsed < 0) {
+        printf("%s\n", error);
+        exit(0);
+      } else if (parsed) {
+        continue;
+      } else if (strncmp(argv[i], "--sample=", 9) == 0) {
+        sample_rate = atoi(argv[i] + 9);
+        if (sample_rate == 0) {
+          printf("The sample rate must be at least 1\n");
+          exit(0);
+        }
+      } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+        num_sim_threads = atoi(argv[i] + 10);
+        if (num_sim_threads == 0) num_sim_threads = 1;
+      } else if (strncmp(argv[i], "--window=", 9) == 0) {
+        window_size = strtoull(argv[i] + 9, NULL, 0);
+        if (window_size == 0) {
+          printf("The window must hold at least one access\n");
+          exit(0);
+        }
+      } else if (strncmp(argv[i], "--window-csv=", 13) == 0) {
+        window_file_name = argv[i] + 13;
+      } else if (strncmp(argv[i], "--json=", 7) == 0) {
+        json_file_name = argv[i] + 7;
+      } else if (strncmp(argv[i], "--csv=", 6) == 0) {
+        csv_file_name = argv[i] + 6;
+      } else if (strncmp(argv[i], "--coherence=", 12) == 0) {
+        if (strcmp(argv[i] + 12, "mesi") == 0) {
+          coherence_protocol = mesi;
+        } else if (strcmp(argv[i] + 12, "moesi") == 0) {
+          coherence_protocol = moesi;
+        } else {
+          printf("Unknown coherence protocol\n");
+          exit(0);
+        }
+        multi_core_mode = 1;
+      } else if (strncmp(argv[i], "--interleave=", 13) == 0) {
+        core_interleave = atoi(argv[i] + 13);
+        if (core_interleave == 0) core_interleave = 1;
+      } else if (strncmp(argv[i], "--", 2) == 0) {
+        printf("Unknown option %s\n", argv[i]);
+        exit(0);
+      } else {
+        if (num_trace_files == MAX_CORES) {
+          printf("At most %d trace files, one per core\n", MAX_CORES);
+          exit(0);
+        }
+        trace_file_names[num_trace_files++] = argv[i];
+        trace_file_name = trace_file_names[0];
+      }
+    }
+    if (num_trace_files > 1) {
+      multi_core_mode = 1;
+    }
+    if (num_trace_files == 0) {
+      trace_file_names[num_trace_files++] = trace_file_name;
+    }
+
+    const char* error = check_cache_config(&cache_config);
+    if (error) {
+      printf("%s\n", error);
+      exit(0);
+    }
+    // Prefetches cross sets, so they cannot be sampled or sharded by set
+    int prefetch = cache_config.prefetcher != no_prefetch;
+    int tlb = cache_config.itlb.entries > 0 || cache_config.dtlb.entries > 0;
+    if (multi_core_mode &&
+        (cache_config.l2.size > 0 || cache_config.policy == opt || cache_config.classify_misses ||
+         cache_config.set_histogram || sample_rate > 1 || prefetch || tlb ||
+         cache_config.write_policy != write_back || cache_config.write_miss_policy != write_allocate)) {
+      printf("Several cores are only supported with write-back, write-allocate L1 caches, without "
+             "lower levels, OPT replacement, miss classification, set histograms, sampling, "
+             "prefetching or TLBs\n");
+      exit(0);
+    }
+    // Sampled sets see only some pages, the TLBs would miss the rest
+    if (sample_rate > 1 &&
+        (cache_config.policy == opt || cache_config.classify_misses || prefetch || tlb)) {
+      printf("Set sampling is not supported with OPT replacement, miss classification, "
+             "prefetching or TLBs\n");
+      exit(0);
+    }
+    if (window_size > 0 && (multi_core_mode || cache_config.policy == opt || sample_rate > 1 ||
+                            num_sim_threads > 1)) {
+      printf("Windows are not supported with several cores, OPT replacement, sampling or "
+             "threads\n");
+      exit(0);
+    }
+    if (num_sim_threads > 1 && (cache_config.policy == opt || cache_config.classify_misses ||
+                                sample_rate > 1 || prefetch)) {
+      printf("Threads are not supported with OPT replacement, miss classification, sampling or "
+             "prefetching\n");
+      exit(0);
+    }
+    // The clock runs through the accesses in trace order
+    if (cache_config.timing.hit_latency[0] > 0 &&
+        (multi_core_mode || sample_rate > 1 || num_sim_threads > 1)) {
+      printf("The timing model is not supported with several cores, sampling or threads\n");
+      exit(0);
+    }
+  }
+}
+
+/* Parses one option of the simulated configuration, as given on the command
+ * line. Returns 1 for such an option, 0 for any other, and -1 with why in
+ * error for a value that cannot be parsed.
+ */
+static int parse_config_option(const char* option, cache_config_t* config, char* error,
+                               size_t error_size) {
+  const char* value = strchr(option, '=') ? strchr(option, '=') + 1 : "";
+  if (strncmp(option, "--ways=", 7) == 0) {
+    if (!parse_count(value, &config->ways)) {
+      snprintf(error, error_size, "The number of ways must be a positive number");
+      return -1;
+    }
+  } else if (strncmp(option, "--policy=", 9) == 0) {
+    if (!parse_cache_policy(value, config)) {
+      snprintf(error, error_size, "Unknown replacement policy");
+      return -1;
+    }
+  } else if (strcmp(option, "--classify") == 0) {
+    config->classify_misses = 1;
+  } else if (strcmp(option, "--set-histogram") == 0) {
+    config->set_histogram = 1;
+  } else if (strncmp(option, "--itlb=", 7) == 0 || strncmp(option, "--dtlb=", 7) == 0 ||
+             strncmp(option, "--l2tlb=", 8) == 0) {
+    tlb_config_t* tlb = option[2] == 'i' ? &config->itlb
+                        : option[2] == 'd' ? &config->dtlb
+                                           : &config->l2_tlb;
+    if (!parse_tlb_config(value, tlb)) {
+      snprintf(error, error_size, "Unknown TLB %s", option);
+      return -1;
+    }
+  } else if (strncmp(option, "--page=", 7) == 0) {
+    if (strcmp(value, "4k") == 0) {
+      config->page_bits = 12;
+    } else if (strcmp(value, "2m") == 0) {
+      config->page_bits = 21;
+    } else {
+      snprintf(error, error_size, "Unknown page size");
+      return -1;
+    }
+  } else if (strncmp(option, "--latency=", 10) == 0) {
+    enable_timing(&config->timing);
+    if (!parse_latencies(value, &config->timing)) {
+      snprintf(error, error_size, "Unknown latencies %s", value);
+      return -1;
+    }
+  } else if (strncmp(option, "--memory-latency=", 17) == 0) {
+    enable_timing(&config->timing);
+    config->timing.memory_latency = atoi(value);
+  } else if (strncmp(option, "--bandwidth=", 12) == 0) {
+    enable_timing(&config->timing);
+    config->timing.bytes_per_cycle = atoi(value);
+  } else if (strncmp(option, "--mshrs=", 8) == 0) {
+    enable_timing(&config->timing);
+    config->timing.mshrs = atoi(value);
+  } else if (strncmp(option, "--seed=", 7) == 0) {
+    config->seed = strtoul(value, NULL, 0);
+  } else if (strncmp(option, "--write=", 8) == 0) {
+    if (!parse_write_policy(value, config)) {
+      snprintf(error, error_size, "Unknown write policy");
+      return -1;
+    }
+  } else if (strncmp(option, "--write-miss=", 13) == 0) {
+    if (!parse_write_miss_policy(value, config)) {
+      snprintf(error, error_size, "Unknown write miss policy");
+      return -1;
+    }
+  } else if (strncmp(option, "--prefetch=", 11) == 0) {
+    if (!parse_prefetcher(value, config)) {
+      snprintf(error, error_size, "Unknown prefetcher");
+      return -1;
+    }
+  } else if (strncmp(option, "--l2=", 5) == 0 || strncmp(option, "--l3=", 5) == 0) {
+    if (!parse_level_config(value, option[3] == '2' ? &config->l2 : &config->l3)) {
+      snprintf(error, error_size, "Unknown cache level %s", option);
+      return -1;
+    }
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+/* The parsers below return 0 for an unknown value. The sa mapping may carry
+ * its number of ways, as in sa8.
+ */
+static int parse_cache_size(const char* arg, cache_config_t* config) {
+  char* end;
+  errno = 0;
+  unsigned long size = strtoul(arg, &end, 10);
+  if (*arg < '0' || *arg > '9' || *end != '\0' || errno != 0 || size > UINT32_MAX) {
+    return 0;
+  }
+  config->size = size;
+  return 1;
+}
+
+// Positive decimal numbers only, such as thread counts and ways
+static int parse_count(const char* arg, uint32_t* count) {
+  char* end;
+  errno = 0;
+  unsigned long value = strtoul(arg, &end, 10);
+  if (*arg < '0' || *arg > '9' || *end != '\0' || errno != 0 || value == 0 || value > UINT32_MAX) {
+    return 0;
+  }
+  *count = value;
+  return 1;
+}
+
+static int parse_cache_mapping(const char* arg, cache_config_t* config) {
+  if (strcmp(arg, "dm") == 0) {
+    config->mapping = dm;
+  } else if (strcmp(arg, "fa") == 0) {
+    config->mapping = fa;
+  } else if (strncmp(arg, "sa", 2) == 0) {
+    config->mapping = sa;
+    if (arg[2] != '\0' && !parse_count(arg + 2, &config->ways)) {
+      return 0;
+    }
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+static int parse_cache_org(const char* arg, cache_config_t* config) {
+  if (strcmp(arg, "uc") == 0) {
+    config->org = uc;
+  } else if (strcmp(arg, "sc") == 0) {
+    config->org = sc;
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+static int parse_cache_policy(const char* arg, cache_config_t* config) {
+  if (strcmp(arg, "fifo") == 0) {
+    config->policy = fifo;
+  } else if (strcmp(arg, "lru") == 0) {
+    config->policy = lru;
+  } else if (strcmp(arg, "plru") == 0) {
+    config->policy = plru;
+  } else if (strcmp(arg, "srrip") == 0) {
+    config->policy = srrip;
+  } else if (strcmp(arg, "brrip") == 0) {
+    config->policy = brrip;
+  } else if (strcmp(arg, "nru") == 0) {
+    config->policy = nru;
+  } else if (strcmp(arg, "random") == 0) {
+    config->policy = rnd;
+  } else if (strcmp(arg, "opt") == 0) {
+    config->policy = opt;
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+static int parse_write_policy(const char* arg, cache_config_t* config) {
+  if (strcmp(arg, "wb") == 0) {
+    config->write_policy = write_back;
+  } else if (strcmp(arg, "wt") == 0) {
+    config->write_policy = write_through;
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+static int parse_write_miss_policy(const char* arg, cache_config_t* config) {
+  if (strcmp(arg, "wa") == 0) {
+    config->write_miss_policy = write_allocate;
+  } else if (strcmp(arg, "nwa") == 0) {
+    config->write_miss_policy = no_write_allocate;
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+// Parses kind[:degree], for example stream:8
+static int parse_prefetcher(const char* arg, cache_config_t* config) {
+  size_t length = strcspn(arg, ":");
+  prefetcher_t prefetcher;
+  for (prefetcher = next_line_prefetch; prefetcher <= stream_prefetch; prefetcher++) {
+    if (strlen(prefetcher_names[prefetcher]) == length &&
+        strncmp(arg, prefetcher_names[prefetcher], length) == 0) {
+      break;
+    }
+  }
+  if (prefetcher > stream_prefetch) {
+    return 0;
+  }
+  config->prefetcher = prefetcher;
+  config->prefetch_degree = arg[length] == ':' ? atoi(arg + length + 1) : 0;
+  return 1;
+}
+
+/* Parses a TLB given as entries[:ways|fa], ways default to 4 */
+static int parse_tlb_config(const char* arg, tlb_config_t* tlb) {
+  char* end;
+  tlb->entries = strtoul(arg, &end, 0);
+  tlb->ways = 4;
+  if (tlb->entries == 0 || (*end && *end != ':')) {
+    return 0;
+  }
+  if (*end == ':' && strcmp(end + 1, "fa") == 0) {
+    tlb->ways = 0;
+  } else if (*end == ':' && !parse_count(end + 1, &tlb->ways)) {
+    return 0;
+  }
+  return 1;
+}
+
+// Default latencies of the timing model, once any of its options is given
+static void enable_timing(timing_config_t* timing) {
+  if (timing->hit_latency[0] == 0) {
+    timing_config_t defaults = {.hit_latency = {4, 12, 40}, .memory_latency = 200};
+    *timing = defaults;
+  }
+}
+
+/* Parses the lookup latencies L1[:L2[:L3]], the levels left out keep theirs */
+static int parse_latencies(const char* arg, timing_config_t* timing) {
+  char* end = (char*)arg;
+  for (int level = 0; level < MAX_CACHE_LEVELS && *end; level++) {
+    timing->hit_latency[level] = strtoul(end, &end, 0);
+    if (timing->hit_latency[level] == 0 || (*end && *end != ':')) return 0;
+    if (*end == ':') end++;
+  }
+  return *end == '\0';
+}
+
+/* Parses a lower cache level given as size[:ways|fa[:policy[:inclusion]]],
+ * for example 262144:8:fifo:inclusive. Ways default to 8 and the inclusion
+ * policy to NINE.
+ */
+static int parse_level_config(const char* arg, level_config_t* level) {
+  char buffer[128];
+  snprintf(buffer, sizeof(buffer), "%s", arg);
+
+  level->ways = 8;
+  level->policy = fifo;
+  level->inclusion = nine;
+
+  char* saved;
+  char* size = strtok_r(buffer, ":", &saved);
+  char* ways = strtok_r(NULL, ":", &saved);
+  char* policy = strtok_r(NULL, ":", &saved);
+  char* inclusion = strtok_r(NULL, ":", &saved);
+  if (!size || !parse_count(size, &level->size)) {
+    return 0;
+  }
+  if (ways && strcmp(ways, "fa") == 0) {
+    level->ways = 0;
+  } else if (ways && !parse_count(ways, &level->ways)) {
+    return 0;
+  }
+  if (policy) {
+    cache_config_t policy_config;
+    if (!parse_cache_policy(policy, &policy_config)) return 0;
+    level->policy = policy_config.policy;
+  }
+  if (inclusion) {
+    if (strcmp(inclusion, "inclusive") == 0) {
+      level->inclusion = inclusive;
+    } else if (strcmp(inclusion, "exclusive") == 0) {
+      level->inclusion = exclusive;
+    } else if (strcmp(inclusion, "nine") == 0) {
+      level->inclusion = nine;
+    } else {
+      return 0;
+    }
+  }
+  return 1;
+}
+#endif
+
+/* Ways per set of each cache in the configuration, each cache of a split
+ * organization gets half the lines
+ */
+static uint32_t cache_config_ways(const cache_config_t* config) {
+  uint32_t num_of_cache_lines = (config->org == sc ? config->size / 2 : config->size) / BLOCK_SIZE;
+  if (config->mapping == dm) {
+    return 1;
+  } else if (config->mapping == fa) {
+    return num_of_cache_lines;
+  }
+  return config->ways;
+}
+
+/* Returns NULL if the configuration can be simulated, otherwise why not */
+static const char* check_cache_config(const cache_config_t* config) {
+  uint32_t num_of_cache_lines = (config->org == sc ? config->size / 2 : config->size) / BLOCK_SIZE;
+  uint32_t ways = cache_config_ways(config);
+
+  if (num_of_cache_lines == 0 || (num_of_cache_lines & (num_of_cache_lines - 1)) != 0) {
+    return "Cache size must be a power of two of at least one line per cache";
+  }
+  if (ways == 0 || (ways & (ways - 1)) != 0 || ways > num_of_cache_lines) {
+    return "Ways must be a power of two no larger than the number of lines";
+  }
+
+  const level_config_t* lower[] = {&config->l2, &config->l3};
+  if (config->l3.size > 0 && config->l2.size == 0) {
+    return "An L3 needs an L2";
+  }
+  if ((config->policy == opt && config->l2.size > 0) ||
+      (config->l2.size > 0 && config->l2.policy == opt) ||
+      (config->l3.size > 0 && config->l3.policy == opt)) {
+    return "OPT replacement is only supported for a single cache level";
+  }
+  if (config->policy == opt && config->classify_misses) {
+    return "Miss classification is not supported with OPT replacement";
+  }
+  if (config->policy == opt && config->prefetcher != no_prefetch) {
+    return "Prefetching is not supported with OPT replacement";
+  }
+  if (config->prefetch_degree > PREFETCH_MAX_DEGREE) {
+    return "The prefetch degree must be at most 64";
+  }
+  for (int i = 0; i < 2 && lower[i]->size > 0; i++) {
+    uint32_t lines = lower[i]->size / BLOCK_SIZE;
+    uint32_t level_ways = lower[i]->ways ? lower[i]->ways : lines;
+    if (lines == 0 || (lines & (lines - 1)) != 0) {
+      return "Lower level sizes must be a power of two of at least one line";
+    }
+    if ((level_ways & (level_ways - 1)) != 0 || level_ways > lines) {
+      return "Lower level ways must be a power of two no larger than the number of lines";
+    }
+  }
+
+  const tlb_config_t* tlbs[] = {&config->itlb, &config->dtlb, &config->l2_tlb};
+  for (int i = 0; i < 3; i++) {
+    uint32_t entries = tlbs[i]->entries;
+    uint32_t tlb_ways = tlbs[i]->ways ? tlbs[i]->ways : entries;
+    if (entries == 0) continue;
+    if ((entries & (entries - 1)) != 0 || (tlb_ways & (tlb_ways - 1)) != 0 || tlb_ways > entries) {
+      return "TLB entries and ways must be powers of two, no more ways than entries";
+    }
+  }
+  if (config->l2_tlb.entries > 0 && (config->itlb.entries == 0 || config->dtlb.entries == 0)) {
+    return "An L2 TLB needs an instruction and a data TLB";
+  }
+  if (config->page_bits != 0 && (config->page_bits < BLOCK_OFFSET_NUM_OF_BITS ||
+                                 config->page_bits >= ADDRESS_SIZE)) {
+    return "Pages must be at least a block and smaller than the address space";
+  }
+  if (config->policy == opt && (config->itlb.entries > 0 || config->dtlb.entries > 0)) {
+    return "TLBs are not supported with OPT replacement";
+  }
+  if (config->timing.hit_latency[0] > 0 && config->policy == opt) {
+    return "The timing model is not supported with OPT replacement";
+  }
+  if (config->timing.mshrs > MAX_MSHRS) {
+    return "The timing model has at most 64 MSHRs";
+  }
+  return NULL;
+}
+
+static cache_t* create_cache(uint32_t size, uint32_t ways, cache_policy_t policy, uint32_t seed) {
+  uint32_t num_of_cache_lines = size / BLOCK_SIZE;
+  cache_t* cache = (cache_t*)calloc(1, sizeof(cache_t));
+  cache->num_ways = ways;
+  cache->num_sets = num_of_cache_lines / ways;
+  cache->set_mask = cache->num_sets - 1;
+  cache->valid_words = (ways + 63) / 64;
+
+  // Allocate memory for cache valid bit and tag storage
+  size_t tag_bytes = ((size_t)num_of_cache_lines * sizeof(uint32_t) + 63) & ~(size_t)63;
+  cache->tags = (uint32_t*)aligned_alloc(64, tag_bytes);
+  memset(cache->tags, 0, tag_bytes);
+  cache->valid = (uint64_t*)calloc((size_t)cache->num_sets * cache->valid_words, sizeof(uint64_t));
+  cache->policy = policy;
+  cache->policy_words = (policy_state_bits(policy, ways) + 63) / 64;
+  if (cache->policy_words == 0) cache->policy_words = 1;
+  cache->policy_state =
+      (uint64_t*)calloc((size_t)cache->num_sets * cache->policy_words, sizeof(uint64_t));
+  init_policy_state(cache, seed);
+  cache->write_allocate = 1;
+
+  // Fully associative FIFO and LRU caches look up tags through a hash index
+  // instead of scanning every way, sized to stay at most an eighth full so
+  // probe sequences and backward shifts stay short. The other policies scan
+  // their single set like any set associative cache.
+  if (cache->num_sets == 1 && ways > 1 && (policy == fifo || policy == lru)) {
+    uint32_t index_bits = 1;
+    while ((1u << index_bits) < 8 * ways) index_bits++;
+    cache->fa_index = (uint64_t*)calloc((size_t)1 << index_bits, sizeof(uint64_t));
+    cache->fa_index_mask = (1u << index_bits) - 1;
+    cache->fa_index_shift = 32 - index_bits;
+    cache->fa_slot = (uint32_t*)malloc(ways * sizeof(uint32_t));
+    cache->fa_prev = (uint32_t*)malloc(ways * sizeof(uint32_t));
+    cache->fa_next = (uint32_t*)malloc(ways * sizeof(uint32_t));
+    cache->fa_free = (uint32_t*)malloc(ways * sizeof(uint32_t));
+    cache->fa_head = cache->fa_tail = FA_LIST_END;
+  }
+  return cache;
+}
+
+/* A new cache is write-through and write-allocate. Write-back gives it a
+ * dirty bit per line, packed like the valid bits so even the largest caches
+ * only spend a bit on it.
+ */
+static void set_write_policy(cache_t* cache, write_policy_t policy, write_miss_policy_t miss_policy) {
+  free(cache->dirty);
+  cache->dirty = NULL;
+  if (policy == write_back) {
+    cache->dirty = (uint64_t*)calloc((size_t)cache->num_sets * cache->valid_words, sizeof(uint64_t));
+  }
+  cache->write_allocate = miss_policy == write_allocate;
+}
+
+
+static void free_cache(cache_t* cache) {
+  free(cache->tags);
+  free(cache->valid);
+  free(cache->dirty);
+  free(cache->policy_state);
+  free(cache->fa_index);
+  free(cache->fa_slot);
+  free(cache->fa_prev);
+  free(cache->fa_next);
+  free(cache->fa_free);
+  free(cache->set_misses);
+  free(cache);
+}
+
+
+/* A unified cache serves both access types from one instance, a split cache
+ * gives each access type its own instance of half the size
+ */
+static void create_caches(const cache_config_t* config, cache_t* caches[2]) {
+  uint32_t ways = cache_config_ways(config);
+  if (config->org == uc) {
+    caches[instruction] = caches[data] =
+        create_cache(config->size, ways, config->policy, config->seed);
+  } else {
+    caches[instruction] = create_cache(config->size / 2, ways, config->policy, config->seed);
+    caches[data] = create_cache(config->size / 2, ways, config->policy, config->seed);
+    set_write_policy(caches[data], config->write_policy, config->write_miss_policy);
+  }
+  set_write_policy(caches[instruction], config->write_policy, config->write_miss_policy);
+}
+
+
+static void free_caches(cache_t* caches[2]) {
+  if (caches[data] != caches[instruction]) {
+    free_cache(caches[data]);
+  }
+  free_cache(caches[instruction]);
+}
+
+
+static cache_stat_t collect_statistics(cache_t* caches[2]) {
+  cache_stat_t stats = caches[instruction]->stats;
+  if (caches[data] != caches[instruction]) {
+    stats.accesses += caches[data]->stats.accesses;
+    stats.hits += caches[data]->stats.hits;
+  }
+  return stats;
+}
+
+
+// Takes the top bits of the product, the low ones repeat for strided blocks
+static inline uint32_t fa_hash(const cache_t* cache, uint32_t block) {
+  return (block * 0x9E3779B1u) >> cache->fa_index_shift;
+}
+
+/* Removes the index entry in slot, shifting back the entries of the probe
+ * sequence behind it so lookups never need tombstones.
+ */
+static void fa_index_remove(cache_t* cache, uint32_t slot) {
+  uint32_t mask = cache->fa_index_mask;
+  uint32_t hole = slot;
+  uint32_t next = slot;
+
+  while (1) {
+    next = (next + 1) & mask;
+    uint64_t entry = cache->fa_index[next];
+    if (entry == 0) break;
+
+    // Leave the entry if its home slot lies cyclically in (hole, next]
+    uint32_t home = fa_hash(cache, FA_ENTRY_BLOCK(entry));
+    if (hole <= next ? (hole < home && home <= next) : (hole < home || home <= next)) {
+      continue;
+    }
+    cache->fa_index[hole] = entry;
+    cache->fa_slot[FA_ENTRY_WAY(entry)] = hole;
+    hole = next;
+  }
+  cache->fa_index[hole] = 0;
+}
+
+static inline void fa_list_unlink(cache_t* cache, uint32_t way) {
+  uint32_t prev = cache->fa_prev[way];
+  uint32_t next = cache->fa_next[way];
+  if (prev != FA_LIST_END) cache->fa_next[prev] = next; else cache->fa_head = next;
+  if (next != FA_LIST_END) cache->fa_prev[next] = prev; else cache->fa_tail = prev;
+}
+
+static inline void fa_list_push_head(cache_t* cache, uint32_t way) {
+  cache->fa_prev[way] = FA_LIST_END;
+  cache->fa_next[way] = cache->fa_head;
+  if (cache->fa_head != FA_LIST_END) cache->fa_prev[cache->fa_head] = way; else cache->fa_tail = way;
+  cache->fa_head = way;
+}
+
+// Returns the index slot holding the block, or the empty slot ending its probe sequence
+static inline uint32_t fa_find_slot(const cache_t* cache, uint32_t block) {
+  uint32_t slot = fa_hash(cache, block);
+  uint64_t entry;
+  while ((entry = cache->fa_index[slot]) != 0 && FA_ENTRY_BLOCK(entry) != block) {
+    slot = (slot + 1) & cache->fa_index_mask;
+  }
+  return slot;
+}
+
+/* Index of the line in the valid and dirty bitmaps. Fully associative caches
+ * have a single set, their line index is the way.
+ */
+static inline size_t line_index(const cache_t* cache, uint32_t set, uint32_t way) {
+  return ((size_t)set * cache->valid_words << 6) + way;
+}
+
+/* Records a store to a line the cache holds: a write-back cache marks it
+ * dirty, a write-through one passes the store down. Returns 1 if it did.
+ */
+static inline int write_line(cache_t* cache, size_t line) {
+  if (cache->dirty) {
+    cache->dirty[line >> 6] |= 1ull << (line & 63);
+    return 0;
+  }
+  cache->stores++;
+  return 1;
+}
+
+// Clears the dirty bit of a line that goes away, returns 1 if it was set
+static inline int clean_line(cache_t* cache, size_t line) {
+  if (!cache->dirty) {
+    return 0;
+  }
+  uint64_t* word = cache->dirty + (line >> 6);
+  uint64_t bit = 1ull << (line & 63);
+  if (!(*word & bit)) {
+    return 0;
+  }
+  *word &= ~bit;
+  return 1;
+}
+
+// Updates the recency list for a hit on way
+static inline void fa_touch(cache_t* cache, uint32_t way) {
+  if (cache->policy == lru && cache->fa_head != way) {
+    fa_list_unlink(cache, way);
+    fa_list_push_head(cache, way);
+  }
+}
+
+/* Puts the block into a free line, or in place of the line at the tail of the
+ * list. slot is the empty slot fa_find_slot() returned for the block. Returns
+ * 1 and sets *victim when a valid line was evicted, 2 if it was also dirty.
+ */
+static inline int fa_fill(cache_t* cache, uint32_t block, uint32_t slot, uint32_t* victim) {
+  uint32_t way;
+  int evicted = 0;
+
+  if (cache->fa_free_count > 0 || cache->fa_fill < cache->num_ways) {
+    way = cache->fa_free_count > 0 ? cache->fa_free[--cache->fa_free_count] : cache->fa_fill++;
+    cache->valid[way >> 6] |= 1ull << (way & 63);
+    cache->cold_fills++;
+  } else {
+    way = cache->fa_tail;
+    fa_list_unlink(cache, way);
+    *victim = cache->tags[way];
+    evicted = 1;
+    if (clean_line(cache, way)) {
+      cache->writebacks++;
+      evicted = 2;
+    }
+
+    fa_index_remove(cache, cache->fa_slot[way]);
+
+    // The removal may have shifted entries into our probe sequence
+    slot = fa_find_slot(cache, block);
+  }
+
+  cache->tags[way] = block;
+  cache->fa_index[slot] = FA_ENTRY(block, way);
+  cache->fa_slot[way] = slot;
+  fa_list_push_head(cache, way);
+  cache->fills++;
+  return evicted;
+}
+
+/* Does a cache access for a fully associative cache and returns 1 on a hit.
+ * Hits, misses and evictions are all constant time: the hash index finds the
+ * way holding the block and the recency list gives the victim at its tail.
+ * With FIFO the list is in fill order, with LRU hits move to the head.
+ */
+static inline int access_fa(cache_t* cache, uint32_t block) {
+  // Repeated accesses to the newest block skip the index
+  if (cache->fa_head != FA_LIST_END && cache->tags[cache->fa_head] == block) {
+    return 1;
+  }
+  uint32_t slot = fa_find_slot(cache, block);
+  uint64_t entry = cache->fa_index[slot];
+
+  if (entry != 0) {
+    // Hit!
+    fa_touch(cache, FA_ENTRY_WAY(entry));
+    return 1;
+  }
+
+  // No hit
+  if (cache->set_misses) cache->set_misses[0]++;
+  uint32_t victim;
+  fa_fill(cache, block, slot, &victim);
+  return 0;
+}
+
+
+/* Tag compare kernels: bit w of the result is set when tags[w] == block and
+ * bit w of valid is set, for up to 64 ways. The vector kernels compare 4, 8
+ * or 16 ways per instruction and need ways to be a multiple of that, the
+ * scalar one stops at the first hit.
+ */
+static inline __attribute__((always_inline))
+uint64_t match_tags_scalar(const uint32_t* tags, uint32_t block, uint32_t ways, uint64_t valid) {
+  for (uint32_t way = 0; way < ways; way++) {
+    if (tags[way] == block && ((valid >> way) & 1)) {
+      return 1ull << way;
+    }
+  }
+  return 0;
+}
+
+#ifdef CACHE_SIM_X86
+static inline __attribute__((always_inline, target("sse2")))
+uint64_t match_tags_sse2(const uint32_t* tags, uint32_t block, uint32_t ways, uint64_t valid) {
+  __m128i key = _mm_set1_epi32(block);
+  uint64_t mask = 0;
+  for (uint32_t way = 0; way < ways; way += 4) {
+    __m128i cmp = _mm_cmpeq_epi32(_mm_load_si128((const __m128i*)(tags + way)), key);
+    mask |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(cmp)) << way;
+  }
+  return mask & valid;
+}
+
+static inline __attribute__((always_inline, target("avx2")))
+uint64_t match_tags_avx2(const uint32_t* tags, uint32_t block, uint32_t ways, uint64_t valid) {
+  __m256i key = _mm256_set1_epi32(block);
+  uint64_t mask = 0;
+  for (uint32_t way = 0; way < ways; way += 8) {
+    __m256i cmp = _mm256_cmpeq_epi32(_mm256_load_si256((const __m256i*)(tags + way)), key);
+    mask |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(cmp)) << way;
+  }
+  return mask & valid;
+}
+
+static inline __attribute__((always_inline, target("avx512f")))
+uint64_t match_tags_avx512(const uint32_t* tags, uint32_t block, uint32_t ways, uint64_t valid) {
+  __m512i key = _mm512_set1_epi32(block);
+  uint64_t mask = 0;
+  for (uint32_t way = 0; way < ways; way += 16) {
+    mask |= (uint64_t)_mm512_cmpeq_epi32_mask(_mm512_load_si512(tags + way), key) << way;
+  }
+  return mask & valid;
+}
+#endif
+
+/* Replacement state of a set associative cache, packed into policy_words
+ * 64-bit words per set so it stays small next to the tags:
+ * - fifo: log2(ways) bit pointer to the next way to replace
+ * - lru: log2(ways) bit recency rank per way, 0 is the most recent
+ * - plru: ways - 1 tree bits, node n at bit n - 1, each pointing at the half
+ *   to replace from next (0 left, 1 right)
+ * - srrip, brrip: 2-bit re-reference prediction value per way, 3 is distant
+ * - nru: used bit per way
+ * - rnd: 32-bit xorshift state
+ * The policy is fixed per cache, so the switches below always take the same
+ * branch and need no call through a pointer.
+ */
+#define RRPV_DISTANT 3
+#define RRPV_LONG 2
+#define BRRIP_LONG_BITS 5   // one block in 32 is inserted with a long interval
+
+static inline __attribute__((always_inline)) uint32_t way_bits(uint32_t ways) {
+  return ways > 1 ? (uint32_t)__builtin_ctz(ways) : 0;
+}
+
+// Reads the width bit field at bit of the packed words, width < 32
+static inline uint32_t get_bits(const uint64_t* words, uint32_t bit, uint32_t width) {
+  uint32_t shift = bit & 63;
+  uint64_t value = words[bit >> 6] >> shift;
+  if (shift + width > 64) {
+    value |= words[(bit >> 6) + 1] << (64 - shift);
+  }
+  return (uint32_t)(value & ((1ull << width) - 1));
+}
+
+static inline void set_bits(uint64_t* words, uint32_t bit, uint32_t width, uint32_t value) {
+  uint32_t shift = bit & 63;
+  uint64_t mask = (1ull << width) - 1;
+  words[bit >> 6] = (words[bit >> 6] & ~(mask << shift)) | ((uint64_t)value << shift);
+  if (shift + width > 64) {
+    uint32_t low = 64 - shift;
+    words[(bit >> 6) + 1] = (words[(bit >> 6) + 1] & ~(mask >> low)) | ((uint64_t)value >> low);
+  }
+}
+
+static uint32_t policy_state_bits(cache_policy_t policy, uint32_t ways) {
+  switch (policy) {
+    case fifo: return way_bits(ways);
+    case lru: return ways * way_bits(ways);
+    case plru: return ways - 1;
+    case srrip:
+    case brrip: return 2 * ways;
+    case nru: return ways;
+    case rnd: return 32;
+    case opt: return 0;
+  }
+  return 0;
+}
+
+/* LRU ranks start out as a permutation, which every update keeps. The rnd
+ * generators of the sets start from different states derived from the seed.
+ */
+static void init_policy_state(cache_t* cache, uint32_t seed) {
+  uint32_t bits = way_bits(cache->num_ways);
+  for (uint32_t set = 0; set < cache->num_sets; set++) {
+    uint64_t* state = cache->policy_state + (size_t)set * cache->policy_words;
+    if (cache->policy == lru) {
+      for (uint32_t way = 0; way < cache->num_ways; way++) {
+        set_bits(state, way * bits, bits, way);
+      }
+    } else if (cache->policy == rnd) {
+      uint32_t x = (seed ^ (set * 0x9E3779B1u)) * 0x85EBCA6Bu;
+      state[0] = (x ^ (x >> 16)) | 1;
+    }
+  }
+}
+
+// Updates the replacement state for a use of the way, by a hit or a fill
+static inline __attribute__((always_inline))
+void touch_line(cache_t* cache, uint32_t set, uint32_t way, uint32_t ways) {
+  if (__builtin_expect(cache->policy == fifo, 1)) {
+    return;
+  }
+  uint64_t* state = cache->policy_state + (size_t)set * cache->policy_words;
+  switch (cache->policy) {
+    case lru: {
+      uint32_t bits = way_bits(ways);
+      uint32_t rank = get_bits(state, way * bits, bits);
+      for (uint32_t other = 0; other < ways; other++) {
+        uint32_t other_rank = get_bits(state, other * bits, bits);
+        if (other_rank < rank) {
+          set_bits(state, other * bits, bits, other_rank + 1);
+        }
+      }
+      set_bits(state, way * bits, bits, 0);
+      break;
+    }
+    case plru:
+      // Point every node on the path at the other half
+      for (uint32_t node = way + ways; node > 1; node >>= 1) {
+        set_bits(state, (node >> 1) - 1, 1, ~node & 1);
+      }
+      break;
+    case srrip:
+    case brrip:
+      set_bits(state, 2 * way, 2, 0);
+      break;
+    case nru: {
+      set_bits(state, way, 1, 1);
+      // Once every line is used, start over with only this one
+      uint32_t words = (ways + 63) / 64;
+      uint64_t all = ways >= 64 ? ~0ull : (1ull << ways) - 1;
+      uint32_t word = 0;
+      while (word < words && state[word] == all) word++;
+      if (word == words) {
+        memset(state, 0, words * sizeof(uint64_t));
+        set_bits(state, way, 1, 1);
+      }
+      break;
+    }
+    case fifo:
+    case rnd:
+    case opt:
+      break;
+  }
+}
+
+// Picks the way to evict from a set without invalid lines
+static inline __attribute__((always_inline))
+uint32_t victim_line(cache_t* cache, uint32_t set, uint32_t ways) {
+  uint64_t* state = cache->policy_state + (size_t)set * cache->policy_words;
+  uint32_t way = 0;
+  switch (cache->policy) {
+    case fifo: {
+      uint32_t bits = way_bits(ways);
+      way = get_bits(state, 0, bits);
+      set_bits(state, 0, bits, (way + 1) & (ways - 1));
+      break;
+    }
+    case lru: {
+      uint32_t bits = way_bits(ways);
+      while (get_bits(state, way * bits, bits) != ways - 1) way++;
+      break;
+    }
+    case plru: {
+      uint32_t node = 1;
+      while (node < ways) node = 2 * node + get_bits(state, node - 1, 1);
+      way = node - ways;
+      break;
+    }
+    case srrip:
+    case brrip: {
+      // Age every line until one is predicted distant
+      uint32_t oldest = 0;
+      for (uint32_t other = 0; other < ways; other++) {
+        uint32_t rrpv = get_bits(state, 2 * other, 2);
+        if (rrpv > oldest) {
+          oldest = rrpv;
+          way = other;
+        }
+      }
+      if (oldest < RRPV_DISTANT) {
+        for (uint32_t other = 0; other < ways; other++) {
+          set_bits(state, 2 * other, 2, get_bits(state, 2 * other, 2) + RRPV_DISTANT - oldest);
+        }
+      }
+      break;
+    }
+    case nru:
+      while (get_bits(state, way, 1)) way++;
+      break;
+    case rnd: {
+      uint32_t x = (uint32_t)state[0];
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      state[0] = x;
+      way = x & (ways - 1);
+      break;
+    }
+    case opt:
+      // OPT caches are simulated by cache_sim_opt(), never through here
+      break;
+  }
+  return way;
+}
+
+/* Sets the replacement state of a newly filled way. SRRIP predicts a long
+ * re-reference interval for new lines, BRRIP a distant one except for one
+ * block in 2^BRRIP_LONG_BITS, chosen by a hash of the block so the result
+ * does not depend on the order the sets are simulated in.
+ */
+static inline __attribute__((always_inline))
+void insert_line(cache_t* cache, uint32_t set, uint32_t way, uint32_t block, uint32_t ways) {
+  if (cache->policy == srrip || cache->policy == brrip) {
+    uint64_t* state = cache->policy_state + (size_t)set * cache->policy_words;
+    uint32_t rrpv = RRPV_LONG;
+    if (cache->policy == brrip && ((block * 0x9E3779B1u) >> (32 - BRRIP_LONG_BITS)) != 0) {
+      rrpv = RRPV_DISTANT;
+    }
+    set_bits(state, 2 * way, 2, rrpv);
+  } else {
+    touch_line(cache, set, way, ways);
+  }
+}
+
+/* Puts the block into the set, in an invalid line if there is one and
+ * otherwise in place of the victim of the replacement policy. Returns 1 and
+ * sets *victim when a valid line was evicted, 2 if it was also dirty. With
+ * FIFO the lines fill up in way order before the pointer first moves, so
+ * this evicts in the same order as a plain round robin.
+ */
+static inline __attribute__((always_inline))
+int replace_line(cache_t* cache, uint32_t set, uint32_t block, uint32_t ways, uint32_t* victim) {
+  uint32_t* tags = cache->tags + (size_t)set * ways;
+  uint64_t* valid = cache->valid + (size_t)set * cache->valid_words;
+  uint32_t way = 0;
+  int evicted = 1;
+
+  for (uint32_t base = 0; base < ways; base += 64) {
+    uint32_t chunk = ways - base < 64 ? ways - base : 64;
+    uint64_t invalid = ~valid[base >> 6] & (chunk == 64 ? ~0ull : (1ull << chunk) - 1);
+    if (invalid) {
+      way = base + __builtin_ctzll(invalid);
+      evicted = 0;
+      cache->cold_fills++;
+      break;
+    }
+  }
+  if (evicted) {
+    way = ways > 1 ? victim_line(cache, set, ways) : 0;
+    *victim = tags[way];
+    if (clean_line(cache, line_index(cache, set, way))) {
+      cache->writebacks++;
+      evicted = 2;
+    }
+  }
+
+  tags[way] = block;
+  valid[way >> 6] |= 1ull << (way & 63);
+  if (ways > 1) {
+    insert_line(cache, set, way, block, ways);
+  }
+  cache->fills++;
+  return evicted;
+}
+
+/* Defines NAME(cache, block, ways), a cache access for the block address
+ * that returns 1 on a hit, using the MATCH kernel on the tags of the set 64
+ * ways at a time. Inlined with a constant number of ways into the runners
+ * below, so the way loop is unrolled and carries no geometry checks. Loads
+ * only, stores take the generic path, see access_generic().
+ */
+#define DEFINE_CACHE_ACCESS(NAME, MATCH, ...)                                           \
+  static inline __attribute__((always_inline)) __VA_ARGS__                             \
+  int NAME(cache_t* cache, uint32_t block, uint32_t ways) {                            \
+    uint32_t set = block & cache->set_mask;                                            \
+    const uint32_t* tags = cache->tags + (size_t)set * ways;                           \
+    const uint64_t* valid = cache->valid + (size_t)set * cache->valid_words;           \
+    for (uint32_t base = 0; base < ways; base += 64) {                                 \
+      uint32_t chunk = ways - base < 64 ? ways - base : 64;                            \
+      uint64_t match = MATCH(tags + base, block, chunk, valid[base >> 6]);             \
+      if (match) {                                                                     \
+        touch_line(cache, set, base + __builtin_ctzll(match), ways);                   \
+        return 1;                                                                      \
+      }                                                                                \
+    }                                                                                  \
+    if (cache->set_misses) cache->set_misses[set]++;                                   \
+    uint32_t victim;                                                                   \
+    replace_line(cache, set, block, ways, &victim);                                    \
+    return 0;                                                                          \
+  }
+
+DEFINE_CACHE_ACCESS(access_cache, match_tags_scalar)
+#ifdef CACHE_SIM_X86
+DEFINE_CACHE_ACCESS(access_cache_sse2, match_tags_sse2, __attribute__((target("sse2"))))
+DEFINE_CACHE_ACCESS(access_cache_avx2, match_tags_avx2, __attribute__((target("avx2"))))
+DEFINE_CACHE_ACCESS(access_cache_avx512, match_tags_avx512, __attribute__((target("avx512f"))))
+#endif
+
+
+/* Generic cache operations for the paths that need more than hit or miss,
+ * such as the levels below L1. They handle any geometry at run time.
+ */
+
+// Returns the way holding the block, or -1, without touching the replacement state
+static int32_t cache_find(const cache_t* cache, uint32_t block) {
+  if (cache->fa_index) {
+    uint64_t entry = cache->fa_index[fa_find_slot(cache, block)];
+    return entry ? (int32_t)FA_ENTRY_WAY(entry) : -1;
+  }
+  uint32_t set = block & cache->set_mask;
+  const uint32_t* tags = cache->tags + (size_t)set * cache->num_ways;
+  const uint64_t* valid = cache->valid + (size_t)set * cache->valid_words;
+  for (uint32_t way = 0; way < cache->num_ways; way++) {
+    if (tags[way] == block && ((valid[way >> 6] >> (way & 63)) & 1)) {
+      return way;
+    }
+  }
+  return -1;
+}
+
+// Updates the replacement state for a hit on the way holding the block
+static void cache_touch(cache_t* cache, uint32_t block, uint32_t way) {
+  if (cache->fa_index) {
+    fa_touch(cache, way);
+  } else {
+    touch_line(cache, block & cache->set_mask, way, cache->num_ways);
+  }
+}
+
+// Returns 1 on a hit, updating the replacement state, without filling on a miss
+static int cache_lookup(cache_t* cache, uint32_t block) {
+  int32_t way = cache_find(cache, block);
+  if (way < 0) {
+    if (cache->set_misses) cache->set_misses[block & cache->set_mask]++;
+    return 0;
+  }
+  cache_touch(cache, block, way);
+  return 1;
+}
+
+/* Puts a block that is not in the cache into it, preferring invalid lines.
+ * Returns 1 and sets *victim when a valid line was evicted, 2 if it was also
+ * dirty.
+ */
+static int cache_fill(cache_t* cache, uint32_t block, uint32_t* victim) {
+  if (cache->fa_index) {
+    return fa_fill(cache, block, fa_find_slot(cache, block), victim);
+  }
+
+  return replace_line(cache, block & cache->set_mask, block, cache->num_ways, victim);
+}
+
+/* Stores to a block the cache holds, returns 1 if the store is passed down,
+ * see write_line()
+ */
+static int cache_write(cache_t* cache, uint32_t block) {
+  int32_t way = cache_find(cache, block);
+  assert(way >= 0);
+  return write_line(cache, line_index(cache, block & cache->set_mask, way));
+}
+
+// Drops the block if it is in the cache, returns 1 if it was, 2 if it was also dirty
+static int cache_invalidate(cache_t* cache, uint32_t block) {
+  int32_t way = cache_find(cache, block);
+  if (way < 0) {
+    return 0;
+  }
+  int dirty = clean_line(cache, line_index(cache, block & cache->set_mask, way));
+  if (cache->fa_index) {
+    fa_index_remove(cache, cache->fa_slot[way]);
+    fa_list_unlink(cache, way);
+    cache->fa_free[cache->fa_free_count++] = way;
+    cache->valid[way >> 6] &= ~(1ull << (way & 63));
+  } else {
+    uint32_t set = block & cache->set_mask;
+    cache->valid[(size_t)set * cache->valid_words + (way >> 6)] &= ~(1ull << (way & 63));
+  }
+  return 1 + dirty;
+}
+
+
+static void fill_level(cache_sim_t* sim, uint32_t level, uint32_t block);
+
+/* Writes the block from the level above into level. The first level that
+ * holds the block marks it dirty, the ones before it pass the write on and
+ * count it as written below, the last of them to memory. whole_block tells a
+ * writeback from a store.
+ */
+static void write_level(cache_sim_t* sim, uint32_t level, uint32_t block, int whole_block) {
+  for (; level < sim->num_levels; level++) {
+    cache_t* cache = sim->levels[level];
+    if (cache_find(cache, block) >= 0) {
+      cache_write(cache, block);
+      return;
+    }
+    if (whole_block) {
+      cache->writebacks++;
+    } else {
+      cache->stores++;
+    }
+  }
+}
+
+// Back-invalidates the victim of level in cache, returns 1 if the dropped copy was dirty
+static int back_invalidate(cache_sim_t* sim, uint32_t level, cache_t* cache, uint32_t victim) {
+  int state = cache_invalidate(cache, victim);
+  sim->back_invalidations[level] += state != 0;
+  return state == 2;
+}
+
+/* Deals with a block evicted from a level: an inclusive level removes it
+ * from every level above, and an exclusive level below receives it. A dirty
+ * victim, or one with a dirty copy above, is written to the level below.
+ */
+static void handle_victim(cache_sim_t* sim, uint32_t level, uint32_t victim, int dirty) {
+  if (level > 0 && sim->inclusion[level] == inclusive) {
+    int dirty_above = 0;
+    for (uint32_t above = 0; above < level; above++) {
+      if (above == 0) {
+        dirty_above |= back_invalidate(sim, level, sim->caches[instruction], victim);
+        if (sim->caches[data] != sim->caches[instruction]) {
+          dirty_above |= back_invalidate(sim, level, sim->caches[data], victim);
+        }
+      } else {
+        dirty_above |= back_invalidate(sim, level, sim->levels[above], victim);
+      }
+    }
+    if (dirty_above && !dirty) {
+      sim->levels[level]->writebacks++;
+      dirty = 1;
+    }
+  }
+
+  uint32_t below = level + 1;
+  if (below < sim->num_levels && sim->inclusion[below] == exclusive) {
+    // With a split L1 the other half may still hold the block
+    if (cache_find(sim->levels[below], victim) < 0) {
+      sim->blocks_out[level]++;
+      fill_level(sim, below, victim);
+    }
+  }
+  if (dirty) {
+    write_level(sim, below, victim, 1);
+  }
+}
+
+static void fill_level(cache_sim_t* sim, uint32_t level, uint32_t block) {
+  uint32_t victim;
+  int evicted = cache_fill(sim->levels[level], block, &victim);
+  if (evicted) {
+    handle_victim(sim, level, victim, evicted == 2);
+  }
+}
+
+/* Serves an L1 miss from the levels below and fills the block into L1, the
+ * cache that missed. Exclusive levels hand a hit block up and are not filled
+ * on the way back, the others are filled from the level that had it. A dirty
+ * block handed up stays dirty in L1, or is written straight back down if L1
+ * is write-through. Returns what cache_fill() returned for L1.
+ */
+static int handle_l1_miss(cache_sim_t* sim, cache_t* cache, uint32_t block, uint32_t* victim) {
+  uint32_t source = 1;
+  int dirty = 0;
+  for (; source < sim->num_levels; source++) {
+    cache_t* lower = sim->levels[source];
+    lower->stats.accesses++;
+    if (cache_lookup(lower, block)) {
+      lower->stats.hits++;
+      if (sim->inclusion[source] == exclusive) {
+        dirty = cache_invalidate(lower, block) == 2;
+      }
+      break;
+    }
+  }
+  sim->fill_source = source;
+
+  for (uint32_t level = source - 1; level >= 1; level--) {
+    sim->blocks_in[level]++;
+    if (sim->inclusion[level] != exclusive) {
+      fill_level(sim, level, block);
+    }
+  }
+
+  sim->blocks_in[0]++;
+  int evicted = cache_fill(cache, block, victim);
+  if (evicted) {
+    handle_victim(sim, 0, *victim, evicted == 2);
+  }
+  if (dirty) {
+    if (cache->dirty) {
+      cache_write(cache, block);
+    } else {
+      cache->writebacks++;
+      write_level(sim, 1, block, 1);
+    }
+  }
+  return evicted;
+}
+
+/* Stores that L1 passes down, write-through or not allocated, go on into
+ * the levels below
+ */
+static inline int access_hierarchy(cache_sim_t* sim, cache_t* cache, uint32_t block, int write) {
+  int hit = cache_lookup(cache, block);
+  if (!hit) {
+    if (write && !cache->write_allocate) {
+      cache->stores++;
+      write_level(sim, 1, block, 0);
+      return 0;
+    }
+    uint32_t victim;
+    handle_l1_miss(sim, cache, block, &victim);
+  }
+  if (write && cache_write(cache, block)) {
+    write_level(sim, 1, block, 0);
+  }
+  return hit;
+}
+
+
+/* Prefetches fill L1 through the same path as a demand miss, the levels
+ * below included, but leave the access and hit counts of L1 alone. Their
+ * fills into empty lines go to prefetch_cold_fills, so the cold fills the
+ * runners see belong to demand accesses only.
+ */
+static inline int test_and_clear_bit(uint64_t* bits, uint32_t block) {
+  uint64_t* word = bits + (block >> 6);
+  uint64_t bit = 1ull << (block & 63);
+  int set = (*word & bit) != 0;
+  *word &= ~bit;
+  return set;
+}
+
+// Requests the block for the L1 cache of the access type, unless L1 holds it already
+static void prefetch_block(cache_sim_t* sim, cache_t* cache, access_t type, int64_t block) {
+  if (block < 0 || block >= (int64_t)1 << (ADDRESS_SIZE - BLOCK_OFFSET_NUM_OF_BITS)) {
+    return;
+  }
+  cache_prefetch_stat_t* stats = &sim->prefetches[type];
+  stats->issued++;
+  if (cache_find(cache, block) >= 0) {
+    return;
+  }
+
+  uint64_t cold = cache->cold_fills;
+  uint32_t victim;
+  int evicted = sim->num_levels > 1 ? handle_l1_miss(sim, cache, block, &victim)
+                                    : cache_fill(cache, block, &victim);
+  cache->prefetch_cold_fills += cache->cold_fills - cold;
+  cache->cold_fills = cold;
+  stats->fills++;
+
+  uint64_t* prefetched = sim->prefetched[type];
+  uint64_t* polluted = sim->polluted[type];
+  test_and_clear_bit(polluted, block);
+  prefetched[block >> 6] |= 1ull << (block & 63);
+  if (evicted && !((prefetched[victim >> 6] >> (victim & 63)) & 1)) {
+    stats->evicted_lines++;
+    polluted[victim >> 6] |= 1ull << (victim & 63);
+  }
+  size_t line = line_index(cache, block & cache->set_mask, cache_find(cache, block));
+  sim->prefetch_stamps[type][line] = sim->prefetch_clock << 1 | type;
+}
+
+/* Trains the prefetcher of the access type on a demand access to the block
+ * and requests what it predicts. trigger is set for a miss or the first hit
+ * to a prefetched line.
+ */
+static void issue_prefetches(cache_sim_t* sim, cache_t* cache, access_t type, uint32_t block,
+                             int trigger) {
+  prefetcher_state_t* state = &sim->prefetchers[type];
+  uint32_t degree = sim->config.prefetch_degree;
+
+  switch (sim->config.prefetcher) {
+    case next_line_prefetch:
+      if (trigger) {
+        for (uint32_t i = 1; i <= degree; i++) {
+          prefetch_block(sim, cache, type, (int64_t)block + i);
+        }
+      }
+      break;
+
+    case stride_prefetch: {
+      // Accesses within a block carry no stride
+      if (block == state->last_block) break;
+      int32_t stride = (int32_t)(block - state->last_block);
+      state->last_block = block;
+      if (stride == state->stride) {
+        if (state->confidence < 3) state->confidence++;
+      } else if (state->confidence > 0) {
+        state->confidence--;
+      } else {
+        state->stride = stride;
+      }
+      if (state->confidence >= 1) {
+        for (uint32_t i = 1; i <= degree; i++) {
+          prefetch_block(sim, cache, type, (int64_t)block + (int64_t)i * state->stride);
+        }
+      }
+      break;
+    }
+
+    case stream_prefetch: {
+      if (!trigger) break;
+      prefetch_stream_t* found = NULL;
+      prefetch_stream_t* oldest = &state->streams[0];
+      for (int i = 0; i < PREFETCH_STREAMS; i++) {
+        prefetch_stream_t* stream = &state->streams[i];
+        if (stream->last_used != 0) {
+          int64_t ahead = ((int64_t)block - stream->block) * stream->direction;
+          // A confirmed stream takes blocks up to its degree ahead of the one it expects
+          if (stream->direction != 0 ? (ahead >= 0 && ahead <= degree)
+                                     : (block == stream->block + 1 || block + 1 == stream->block)) {
+            found = stream;
+            break;
+          }
+        }
+        if (stream->last_used < oldest->last_used) oldest = stream;
+      }
+      if (!found) {
+        oldest->block = block;
+        oldest->direction = 0;
+        oldest->last_used = sim->prefetch_clock;
+        break;
+      }
+      if (found->direction == 0) {
+        found->direction = block > found->block ? 1 : -1;
+      }
+      found->block = block + found->direction;
+      found->last_used = sim->prefetch_clock;
+      for (uint32_t i = 1; i <= degree; i++) {
+        prefetch_block(sim, cache, type, (int64_t)block + (int64_t)i * found->direction);
+      }
+      break;
+    }
+
+    case no_prefetch:
+      break;
+  }
+}
+
+/* Accounts a demand access that hit or missed L1 for the prefetches, then
+ * lets the prefetcher of the access type see it
+ */
+static void prefetch_access(cache_sim_t* sim, cache_t* cache, access_t type, uint32_t block, int hit) {
+  sim->prefetch_clock++;
+  int trigger = !hit;
+  if (test_and_clear_bit(sim->prefetched[type], block) && hit) {
+    size_t line = line_index(cache, block & cache->set_mask, cache_find(cache, block));
+    uint64_t stamp = sim->prefetch_stamps[type][line];
+    uint64_t distance = sim->prefetch_clock - (stamp >> 1);
+    cache_prefetch_stat_t* stats = &sim->prefetches[stamp & 1];
+    stats->useful++;
+    stats->use_distance += distance;
+    stats->late += distance <= PREFETCH_LATE_ACCESSES;
+    trigger = 1;
+  }
+  if (!hit && test_and_clear_bit(sim->polluted[type], block)) {
+    sim->prefetches[type].polluting_misses++;
+  }
+  issue_prefetches(sim, cache, type, block, trigger);
+}
+
+
+/* Sorts an L1 access that hit or missed by cause. The shadow cache sees every
+ * access, the seen bitmap only needs to learn new blocks when the shadow
+ * misses, since a block the shadow holds was seen.
+ */
+static inline __attribute__((always_inline))
+int classify_access(cache_sim_t* sim, access_t type, uint32_t block, int hit) {
+  cache_t* shadow = sim->shadows[type];
+  int shadow_hit = shadow->fa_index ? access_fa(shadow, block) : access_cache(shadow, block, 1);
+  if (shadow_hit) {
+    sim->misses[type].conflict += !hit;
+    return hit;
+  }
+
+  uint64_t* seen = sim->seen[type] + (block >> 6);
+  uint64_t bit = 1ull << (block & 63);
+  if (!hit) {
+    if (*seen & bit) {
+      sim->misses[type].capacity++;
+    } else {
+      sim->misses[type].compulsory++;
+    }
+  }
+  *seen |= bit;
+  return hit;
+}
+
+
+/* True once every line of a single level L1 has been filled. Nothing
+ * invalidates lines without levels below, so from then on every miss evicts.
+ * Prefetching needs every access on the generic path, like the hierarchy.
+ */
+static inline int cache_warm(const cache_t* cache) {
+  return cache->cold_fills == (uint64_t)cache->num_sets * cache->num_ways;
+}
+
+static inline int runner_warm(const cache_sim_t* sim) {
+  return sim->num_levels == 1 && sim->config.prefetcher == no_prefetch &&
+         cache_warm(sim->caches[instruction]) && cache_warm(sim->caches[data]);
+}
+
+static inline int access_levels(cache_sim_t* sim, cache_t* cache, uint32_t block, int write) {
+  if (sim->num_levels > 1) {
+    return access_hierarchy(sim, cache, block, write);
+  }
+  int hit = cache_lookup(cache, block);
+  if (!hit && write && !cache->write_allocate) {
+    cache->stores++;
+  } else {
+    if (!hit) {
+      uint32_t victim;
+      cache_fill(cache, block, &victim);
+    }
+    if (write) {
+      cache_write(cache, block);
+    }
+  }
+  return hit;
+}
+
+/* Access with the generic operations, for stores, for batches that need the
+ * cold fills of each access type and for prefetching. A nonzero write makes
+ * it a store. Kept out of line so the specialized loops stay small enough
+ * for their replacement code to be inlined.
+ */
+static __attribute__((noinline)) int access_generic(cache_sim_t* sim, cache_t* cache, access_t type,
+                                                    uint32_t block, int write) {
+  int hit = access_levels(sim, cache, block, write);
+  if (sim->config.prefetcher != no_prefetch) {
+    prefetch_access(sim, cache, type, block, hit);
+  }
+  return hit;
+}
+
+/* Access like access_generic() and account its cycles. A store that
+ * misses a no-write-allocate L1 goes to a write buffer and costs no more
+ * than a hit, writebacks are buffered the same way. A miss waits for a free
+ * MSHR first if it has to, then pays the lookups down to the level that had
+ * the block, and for memory the wait for the channel and the memory latency.
+ * Prefetch fills are not timed. The runners only get here with the timing
+ * model on, the others never look at the clock.
+ */
+static __attribute__((noinline)) int access_timed(cache_sim_t* sim, cache_t* cache, access_t type,
+                                                  uint32_t block, int write) {
+  const timing_config_t* config = &sim->config.timing;
+  cache_timing_stat_t* stats = &sim->timing;
+  int hit = access_levels(sim, cache, block, write);
+  uint32_t source = hit || (write && !cache->write_allocate) ? 0
+                    : sim->num_levels > 1                    ? sim->fill_source
+                                                             : 1;
+  int blocking = type == instruction || config->mshrs == 0;
+  uint64_t issue = sim->clock;
+  uint64_t now = issue;
+  uint32_t mshr = 0;
+
+  if (source > 0 && !blocking) {
+    for (uint32_t i = 1; i < config->mshrs; i++) {
+      if (sim->mshr_ready[i] < sim->mshr_ready[mshr]) mshr = i;
+    }
+    if (sim->mshr_ready[mshr] > now) {
+      stats->mshr_cycles += sim->mshr_ready[mshr] - now;
+      stats->stall_cycles += sim->mshr_ready[mshr] - now;
+      now = sim->mshr_ready[mshr];
+    }
+  }
+
+  uint64_t arrival = now;
+  uint32_t lookups = source < sim->num_levels ? source : sim->num_levels - 1;
+  for (uint32_t level = 0; level <= lookups; level++) {
+    arrival += config->hit_latency[level];
+    stats->level_cycles[level] += config->hit_latency[level];
+  }
+  if (source == sim->num_levels) {
+    if (config->bytes_per_cycle > 0) {
+      uint64_t start = arrival > sim->channel_free ? arrival : sim->channel_free;
+      stats->bandwidth_cycles += start - arrival;
+      sim->channel_free = start + (BLOCK_SIZE + config->bytes_per_cycle - 1) / config->bytes_per_cycle;
+      arrival = start;
+    }
+    arrival += config->memory_latency;
+    stats->level_cycles[MAX_CACHE_LEVELS] += config->memory_latency;
+  }
+
+  if (source == 0 && !blocking) {
+    // A hit on a block an MSHR is still fetching waits for it, without stalling the core
+    for (uint32_t i = 0; i < config->mshrs; i++) {
+      if (sim->mshr_blocks[i] == block && sim->mshr_ready[i] > arrival) {
+        arrival = sim->mshr_ready[i];
+      }
+    }
+  }
+  if (source > 0 && blocking) {
+    uint64_t stall = arrival - now - config->hit_latency[0];
+    stats->stall_cycles += stall;
+    now += stall;
+  } else if (source > 0) {
+    sim->mshr_ready[mshr] = arrival;
+    sim->mshr_blocks[mshr] = block;
+  }
+  sim->clock = now + 1;
+  if (arrival > sim->last_arrival) sim->last_arrival = arrival;
+
+  uint64_t latency = arrival - issue;
+  stats->accesses[type]++;
+  stats->latency[type] += latency;
+  uint32_t bucket = latency ? 63 - __builtin_clzll(latency) : 0;
+  stats->histogram[bucket < CACHE_SIM_LATENCY_BUCKETS ? bucket : CACHE_SIM_LATENCY_BUCKETS - 1]++;
+
+  if (sim->config.prefetcher != no_prefetch) {
+    prefetch_access(sim, cache, type, block, hit);
+  }
+  return hit;
+}
+
+/* The runners feed a batch of accesses to the cache serving each access
+ * type, with a unified cache both entries point to the same instance. Hits
+ * and stores are counted per access type and added to the caches and streams
+ * once per batch. Until the caches are warm the accesses go through
+ * GENERIC_ACCESS instead of ACCESS, looking at the cache after every access
+ * for the type a cold fill belongs to. The hierarchy never counts as warm.
+ * Stores always go through GENERIC_ACCESS, which keeps ACCESS as fast as it
+ * is for a trace without them. ACCESS is the load expression for cache and
+ * block, GENERIC_ACCESS also gets write, the optional arguments are function
+ * attributes such as the target instruction set.
+ * DEFINE_CACHE_RUNNERS also defines NAME_classified, which sorts the misses
+ * by cause, see classify_access().
+ */
+#define DEFINE_CACHE_RUNNER(NAME, ACCESS, GENERIC_ACCESS, ...)                         \
+  static __VA_ARGS__                                                                   \
+  void NAME(cache_sim_t* sim, const mem_access_t* batch, size_t batch_size) {          \
+    cache_t** caches = sim->caches;                                                    \
+    uint64_t accesses[2] = {0, 0};                                                     \
+    uint64_t hits[2] = {0, 0};                                                         \
+    uint64_t cold_fills[2] = {0, 0};                                                   \
+    uint64_t writes[2] = {0, 0};                                                       \
+    uint64_t write_hits[2] = {0, 0};                                                   \
+    size_t i = 0;                                                                      \
+    if (!runner_warm(sim)) {                                                           \
+      for (; i < batch_size; i++) {                                                    \
+        access_t type = batch[i].accesstype;                                           \
+        cache_t* cache = caches[type];                                                 \
+        accesses[type]++;                                                              \
+        uint32_t block = batch[i].address >> BLOCK_OFFSET_NUM_OF_BITS;                 \
+        int write = batch[i].write;                                                    \
+        uint64_t cold = cache->cold_fills;                                             \
+        int hit = GENERIC_ACCESS;                                                      \
+        hits[type] += hit;                                                             \
+        if (write) {                                                                   \
+          writes[type]++;                                                              \
+          write_hits[type] += hit;                                                     \
+        }                                                                              \
+        if (cache->cold_fills != cold) {                                               \
+          cold_fills[type]++;                                                          \
+          if (runner_warm(sim)) {                                                      \
+            i++;                                                                       \
+            break;                                                                     \
+          }                                                                            \
+        }                                                                              \
+      }                                                                                \
+    }                                                                                  \
+    for (; i < batch_size; i++) {                                                      \
+      access_t type = batch[i].accesstype;                                             \
+      cache_t* cache = caches[type];                                                   \
+      accesses[type]++;                                                                \
+      uint32_t block = batch[i].address >> BLOCK_OFFSET_NUM_OF_BITS;                   \
+      int write = batch[i].write;                                                      \
+      if (write) {                                                                     \
+        int hit = GENERIC_ACCESS;                                                      \
+        hits[type] += hit;                                                             \
+        writes[type]++;                                                                \
+        write_hits[type] += hit;                                                       \
+      } else {                                                                         \
+        hits[type] += ACCESS;                                                          \
+      }                                                                                \
+    }                                                                                  \
+    for (int type = instruction; type <= data; type++) {                               \
+      caches[type]->stats.accesses += accesses[type];                                  \
+      caches[type]->stats.hits += hits[type];                                          \
+      sim->streams[type].accesses += accesses[type];                                   \
+      sim->streams[type].hits += hits[type];                                           \
+      sim->streams[type].cold_fills += cold_fills[type];                               \
+      sim->streams[type].writes += writes[type];                                       \
+      sim->streams[type].write_misses += writes[type] - write_hits[type];              \
+    }                                                                                  \
+  }
+
+#define DEFINE_CACHE_RUNNERS(NAME, ACCESS, ...)                                        \
+  DEFINE_CACHE_RUNNER(NAME, ACCESS, access_generic(sim, cache, type, block, write),    \
+                      __VA_ARGS__)                                                     \
+  DEFINE_CACHE_RUNNER(NAME##_classified, classify_access(sim, type, block, ACCESS),    \
+                      classify_access(sim, type, block,                                \
+                                      access_generic(sim, cache, type, block, write)), \
+                      __VA_ARGS__)
+
+DEFINE_CACHE_RUNNERS(run_cache_1_way, access_cache(cache, block, 1))
+DEFINE_CACHE_RUNNERS(run_cache_2_way, access_cache(cache, block, 2))
+DEFINE_CACHE_RUNNERS(run_cache_4_way, access_cache(cache, block, 4))
+DEFINE_CACHE_RUNNERS(run_cache_8_way, access_cache(cache, block, 8))
+DEFINE_CACHE_RUNNERS(run_cache_16_way, access_cache(cache, block, 16))
+DEFINE_CACHE_RUNNERS(run_cache_n_way, access_cache(cache, block, cache->num_ways))
+DEFINE_CACHE_RUNNERS(run_cache_fa, access_fa(cache, block))
+DEFINE_CACHE_RUNNERS(run_hierarchy, access_hierarchy(sim, cache, block, 0))
+// Every access of the timing model goes through access_timed(), loads too
+DEFINE_CACHE_RUNNER(run_timed, access_timed(sim, cache, type, block, write),
+                    access_timed(sim, cache, type, block, write))
+DEFINE_CACHE_RUNNER(run_timed_classified,
+                    classify_access(sim, type, block, access_timed(sim, cache, type, block, write)),
+                    classify_access(sim, type, block, access_timed(sim, cache, type, block, write)))
+
+#ifdef CACHE_SIM_X86
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
+#define AVX512 __attribute__((target("avx512f")))
+DEFINE_CACHE_RUNNERS(run_cache_8_way_sse2, access_cache_sse2(cache, block, 8), SSE2)
+DEFINE_CACHE_RUNNERS(run_cache_16_way_sse2, access_cache_sse2(cache, block, 16), SSE2)
+DEFINE_CACHE_RUNNERS(run_cache_n_way_sse2, access_cache_sse2(cache, block, cache->num_ways), SSE2)
+DEFINE_CACHE_RUNNERS(run_cache_8_way_avx2, access_cache_avx2(cache, block, 8), AVX2)
+DEFINE_CACHE_RUNNERS(run_cache_16_way_avx2, access_cache_avx2(cache, block, 16), AVX2)
+DEFINE_CACHE_RUNNERS(run_cache_n_way_avx2, access_cache_avx2(cache, block, cache->num_ways), AVX2)
+DEFINE_CACHE_RUNNERS(run_cache_16_way_avx512, access_cache_avx512(cache, block, 16), AVX512)
+DEFINE_CACHE_RUNNERS(run_cache_n_way_avx512, access_cache_avx512(cache, block, cache->num_ways), AVX512)
+#undef SSE2
+#undef AVX2
+#undef AVX512
+#endif
+
+
+/* Widest tag compare kernel the CPU supports. CACHE_SIM_SIMD=scalar|sse2|avx2
+ * in the environment caps it, for comparing the kernels.
+ */
+static simd_level_t detected_simd_level;
+static pthread_once_t simd_level_once = PTHREAD_ONCE_INIT;
+
+static void detect_simd_level(void) {
+  simd_level_t level = simd_scalar;
+#ifdef CACHE_SIM_X86
+  __builtin_cpu_init();
+  level = simd_sse2;
+  if (__builtin_cpu_supports("avx2")) level = simd_avx2;
+  if (__builtin_cpu_supports("avx512f")) level = simd_avx512;
+#endif
+  const char* limit = getenv("CACHE_SIM_SIMD");
+  if (limit) {
+    simd_level_t cap = strcmp(limit, "scalar") == 0 ? simd_scalar
+                       : strcmp(limit, "sse2") == 0 ? simd_sse2
+                       : strcmp(limit, "avx2") == 0 ? simd_avx2
+                                                    : simd_avx512;
+    if (cap < level) level = cap;
+  }
+  detected_simd_level = level;
+}
+
+
+/* Picks the runner for the cache geometry. Associative sets of 8 ways or more
+ * use the widest vector kernel that fits the ways, smaller sets compare a
+ * few tags in scalar code. With classify the runner also sorts the misses.
+ */
+#define RUNNER(NAME) (classify ? NAME##_classified : NAME)
+
+static cache_runner_t select_cache_runner(cache_t* cache, int classify) {
+  if (cache->fa_index) {
+    return RUNNER(run_cache_fa);
+  }
+  pthread_once(&simd_level_once, detect_simd_level);
+  simd_level_t level = detected_simd_level;
+  (void)level;
+
+  switch (cache->num_ways) {
+    case 1: return RUNNER(run_cache_1_way);
+    case 2: return RUNNER(run_cache_2_way);
+    case 4: return RUNNER(run_cache_4_way);
+#ifdef CACHE_SIM_X86
+    case 8:
+      return level >= simd_avx2 ? RUNNER(run_cache_8_way_avx2)
+             : level == simd_sse2 ? RUNNER(run_cache_8_way_sse2)
+                                  : RUNNER(run_cache_8_way);
+    case 16:
+      return level == simd_avx512 ? RUNNER(run_cache_16_way_avx512)
+             : level == simd_avx2 ? RUNNER(run_cache_16_way_avx2)
+             : level == simd_sse2 ? RUNNER(run_cache_16_way_sse2)
+                                  : RUNNER(run_cache_16_way);
+    default:
+      return level == simd_avx512 ? RUNNER(run_cache_n_way_avx512)
+             : level == simd_avx2 ? RUNNER(run_cache_n_way_avx2)
+             : level == simd_sse2 ? RUNNER(run_cache_n_way_sse2)
+                                  : RUNNER(run_cache_n_way);
+#else
+    case 8: return RUNNER(run_cache_8_way);
+    case 16: return RUNNER(run_cache_16_way);
+    default: return RUNNER(run_cache_n_way);
+#endif
+  }
+}
+
+#undef RUNNER
+
+
+cache_sim_t* cache_sim_create(void) {
+  cache_sim_t* sim = (cache_sim_t*)calloc(1, sizeof(cache_sim_t));
+  cache_config_t config = {.size = 1024, .mapping = dm, .org = uc, .ways = 4, .policy = fifo};
+  cache_sim_configure(sim, &config);
+  return sim;
+}
+
+
+// Builds the caches of every level for sim->config with cleared statistics
+static void create_sim_caches(cache_sim_t* sim) {
+  const level_config_t* lower[] = {&sim->config.l2, &sim->config.l3};
+
+  create_caches(&sim->config, sim->caches);
+  sim->num_levels = 1;
+  for (int i = 0; i < 2 && lower[i]->size > 0; i++) {
+    uint32_t ways = lower[i]->ways ? lower[i]->ways : lower[i]->size / BLOCK_SIZE;
+    sim->levels[sim->num_levels] =
+        create_cache(lower[i]->size, ways, lower[i]->policy, sim->config.seed);
+    set_write_policy(sim->levels[sim->num_levels], write_back, write_allocate);
+    sim->inclusion[sim->num_levels] = lower[i]->inclusion;
+    sim->num_levels++;
+  }
+
+  memset(sim->blocks_in, 0, sizeof(sim->blocks_in));
+  memset(sim->blocks_out, 0, sizeof(sim->blocks_out));
+  memset(sim->back_invalidations, 0, sizeof(sim->back_invalidations));
+  memset(sim->misses, 0, sizeof(sim->misses));
+  memset(sim->streams, 0, sizeof(sim->streams));
+  if (sim->config.set_histogram) {
+    sim->caches[instruction]->set_misses =
+        (uint64_t*)calloc(sim->caches[instruction]->num_sets, sizeof(uint64_t));
+    if (sim->caches[data] != sim->caches[instruction]) {
+      sim->caches[data]->set_misses = (uint64_t*)calloc(sim->caches[data]->num_sets, sizeof(uint64_t));
+    }
+    for (uint32_t level = 1; level < sim->num_levels; level++) {
+      sim->levels[level]->set_misses = (uint64_t*)calloc(sim->levels[level]->num_sets, sizeof(uint64_t));
+    }
+  }
+  int classify = sim->config.classify_misses;
+  if (sim->config.timing.hit_latency[0] > 0) {
+    sim->runner = classify ? run_timed_classified : run_timed;
+  } else if (sim->num_levels > 1) {
+    sim->runner = classify ? run_hierarchy_classified : run_hierarchy;
+  } else {
+    sim->runner = select_cache_runner(sim->caches[instruction], classify);
+  }
+
+  const tlb_config_t* tlbs[] = {&sim->config.itlb, &sim->config.dtlb, &sim->config.l2_tlb};
+  cache_t** tlb_caches[] = {&sim->tlbs[instruction], &sim->tlbs[data], &sim->l2_tlb};
+  for (int i = 0; i < 3; i++) {
+    *tlb_caches[i] = NULL;
+    if (tlbs[i]->entries > 0) {
+      uint32_t ways = tlbs[i]->ways ? tlbs[i]->ways : tlbs[i]->entries;
+      *tlb_caches[i] = create_cache(tlbs[i]->entries * BLOCK_SIZE, ways, lru, 0);
+    }
+  }
+  if (sim->config.page_bits == 0) {
+    sim->config.page_bits = 12;
+  }
+  memset(sim->translations, 0, sizeof(sim->translations));
+
+  sim->fill_source = 0;
+  sim->clock = 0;
+  sim->channel_free = 0;
+  sim->last_arrival = 0;
+  memset(sim->mshr_ready, 0, sizeof(sim->mshr_ready));
+  memset(sim->mshr_blocks, 0xff, sizeof(sim->mshr_blocks));
+  memset(&sim->timing, 0, sizeof(sim->timing));
+
+  memset(sim->prefetchers, 0, sizeof(sim->prefetchers));
+  memset(sim->prefetches, 0, sizeof(sim->prefetches));
+  sim->prefetch_clock = 0;
+  if (sim->config.prefetcher != no_prefetch) {
+    if (sim->config.prefetch_degree == 0) {
+      sim->config.prefetch_degree = prefetch_default_degree[sim->config.prefetcher];
+    }
+    // Like the seen bitmaps below, only the pages of touched blocks are backed
+    size_t block_words = ((size_t)1 << (ADDRESS_SIZE - BLOCK_OFFSET_NUM_OF_BITS)) / 64;
+    for (int type = instruction; type <= data; type++) {
+      if (type == data && sim->caches[data] == sim->caches[instruction]) {
+        sim->prefetched[data] = sim->prefetched[instruction];
+        sim->polluted[data] = sim->polluted[instruction];
+        sim->prefetch_stamps[data] = sim->prefetch_stamps[instruction];
+        break;
+      }
+      const cache_t* cache = sim->caches[type];
+      sim->prefetched[type] = (uint64_t*)calloc(block_words, sizeof(uint64_t));
+      sim->polluted[type] = (uint64_t*)calloc(block_words, sizeof(uint64_t));
+      sim->prefetch_stamps[type] =
+          (uint64_t*)calloc((size_t)cache->num_sets * cache->valid_words * 64, sizeof(uint64_t));
+    }
+  }
+
+  if (sim->config.classify_misses) {
+    // Untouched pages of the seen bitmaps are never backed by memory
+    size_t seen_words = ((size_t)1 << (ADDRESS_SIZE - BLOCK_OFFSET_NUM_OF_BITS)) / 64;
+    for (int type = instruction; type <= data; type++) {
+      if (type == data && sim->caches[data] == sim->caches[instruction]) {
+        sim->shadows[data] = sim->shadows[instruction];
+        sim->seen[data] = sim->seen[instruction];
+        break;
+      }
+      uint32_t size = sim->caches[type]->num_sets * sim->caches[type]->num_ways * BLOCK_SIZE;
+      sim->shadows[type] = create_cache(size, size / BLOCK_SIZE, lru, 0);
+      sim->seen[type] = (uint64_t*)calloc(seen_words, sizeof(uint64_t));
+    }
+  }
+}
+
+static void free_sim_caches(cache_sim_t* sim) {
+  if (sim->config.prefetcher != no_prefetch) {
+    for (int type = instruction; type <= data; type++) {
+      if (type == data && sim->caches[data] == sim->caches[instruction]) break;
+      free(sim->prefetched[type]);
+      free(sim->polluted[type]);
+      free(sim->prefetch_stamps[type]);
+    }
+  }
+  if (sim->config.classify_misses) {
+    free_caches(sim->shadows);
+    if (sim->seen[data] != sim->seen[instruction]) {
+      free(sim->seen[data]);
+    }
+    free(sim->seen[instruction]);
+  }
+  free_caches(sim->caches);
+  for (uint32_t level = 1; level < sim->num_levels; level++) {
+    free_cache(sim->levels[level]);
+  }
+  cache_t* tlbs[] = {sim->tlbs[instruction], sim->tlbs[data], sim->l2_tlb};
+  for (int i = 0; i < 3; i++) {
+    if (tlbs[i]) free_cache(tlbs[i]);
+  }
+}
+
+
+const char* cache_sim_configure(cache_sim_t* sim, const cache_config_t* config) {
+  const char* error = check_cache_config(config);
+  if (error) {
+    return error;
+  }
+  if (config->policy == opt) {
+    return "OPT replacement needs the whole trace in advance, see cache_sim_opt()";
+  }
+  if (sim->caches[instruction]) {
+    free_sim_caches(sim);
+  }
+  sim->config = *config;
+  create_sim_caches(sim);
+  return NULL;
+}
+
+
+static inline int access_tlb(cache_t* tlb, uint32_t page) {
+  return tlb->fa_index ? access_fa(tlb, page) : access_cache(tlb, page, tlb->num_ways);
+}
+
+/* Looks up the page of every access in the TLBs. Translation changes nothing
+ * the caches see, so it is a pass of its own ahead of the runner, on the
+ * same lookups the caches use.
+ */
+static void translate_batch(cache_sim_t* sim, const mem_access_t* batch, size_t batch_size) {
+  const uint32_t page_bits = sim->config.page_bits;
+  cache_t* l2_tlb = sim->l2_tlb;
+  uint64_t accesses[2] = {0, 0};
+  uint64_t hits[2] = {0, 0};
+  uint64_t l2_hits[2] = {0, 0};
+  for (size_t i = 0; i < batch_size; i++) {
+    access_t type = batch[i].accesstype;
+    cache_t* tlb = sim->tlbs[type];
+    if (!tlb) continue;
+    uint32_t page = batch[i].address >> page_bits;
+    accesses[type]++;
+    if (access_tlb(tlb, page)) {
+      hits[type]++;
+    } else if (l2_tlb) {
+      l2_hits[type] += access_tlb(l2_tlb, page);
+    }
+  }
+  for (int type = instruction; type <= data; type++) {
+    sim->translations[type].accesses += accesses[type];
+    sim->translations[type].hits += hits[type];
+    sim->translations[type].l2_hits += l2_hits[type];
+    sim->translations[type].walks += accesses[type] - hits[type] - l2_hits[type];
+  }
+}
+
+
+void cache_sim_feed(cache_sim_t* sim, const mem_access_t* batch, size_t batch_size) {
+  if (sim->tlbs[instruction] || sim->tlbs[data]) {
+    translate_batch(sim, batch, batch_size);
+  }
+  sim->runner(sim, batch, batch_size);
+}
+
+
+cache_stat_t cache_sim_stats(const cache_sim_t* sim) {
+  return collect_statistics((cache_t**)sim->caches);
+}
+
+
+static uint64_t count_dirty_lines(const cache_t* cache) {
+  uint64_t lines = 0;
+  if (cache->dirty) {
+    for (size_t word = 0; word < (size_t)cache->num_sets * cache->valid_words; word++) {
+      lines += __builtin_popcountll(cache->dirty[word]);
+    }
+  }
+  return lines;
+}
+
+// Fills that replaced a valid line, on demand or for a prefetch
+static uint64_t cache_evictions(const cache_t* cache) {
+  return cache->fills - cache->cold_fills - cache->prefetch_cold_fills;
+}
+
+// Adds the line and write counters of one cache of a level to stats
+static void add_level_stats(cache_level_stat_t* stats, const cache_t* cache) {
+  stats->evictions += cache_evictions(cache);
+  stats->cold_fills += cache->cold_fills + cache->prefetch_cold_fills;
+  stats->writebacks += cache->writebacks;
+  stats->bytes_written += cache->writebacks * BLOCK_SIZE + cache->stores * STORE_BYTES;
+  stats->dirty_lines += count_dirty_lines(cache);
+}
+
+cache_level_stat_t cache_sim_level_stats(const cache_sim_t* sim, int level) {
+  cache_level_stat_t stats;
+  memset(&stats, 0, sizeof(stats));
+  if (level < 1 || (uint32_t)level > sim->num_levels) {
+    return stats;
+  }
+
+  if (level == 1) {
+    cache_stat_t l1 = collect_statistics((cache_t**)sim->caches);
+    stats.accesses = l1.accesses;
+    stats.hits = l1.hits;
+    for (int type = instruction; type <= data; type++) {
+      if (type == data && sim->caches[data] == sim->caches[instruction]) break;
+      add_level_stats(&stats, sim->caches[type]);
+      // Every L1 fill reads the block, also without levels below
+      stats.bytes_read += sim->caches[type]->fills * BLOCK_SIZE;
+    }
+  } else {
+    const cache_t* cache = sim->levels[level - 1];
+    stats.accesses = cache->stats.accesses;
+    stats.hits = cache->stats.hits;
+    add_level_stats(&stats, cache);
+    stats.bytes_read = sim->blocks_in[level - 1] * BLOCK_SIZE;
+  }
+  stats.blocks_in = sim->blocks_in[level - 1];
+  stats.blocks_out = sim->blocks_out[level - 1];
+  stats.back_invalidations = sim->back_invalidations[level - 1];
+  return stats;
+}
+
+
+cache_stream_stat_t cache_sim_stream_stats(const cache_sim_t* sim, access_t type) {
+  cache_stream_stat_t stats = sim->streams[type];
+  stats.misses = stats.accesses - stats.hits;
+  stats.evictions = stats.misses - stats.cold_fills;
+  if (sim->config.write_miss_policy == no_write_allocate) {
+    stats.evictions -= stats.write_misses;
+  }
+  return stats;
+}
+
+
+const uint64_t* cache_sim_set_misses(const cache_sim_t* sim, int level, access_t type,
+                                     uint32_t* num_sets) {
+  if (level < 1 || (uint32_t)level > sim->num_levels) {
+    return NULL;
+  }
+  const cache_t* cache = level == 1 ? sim->caches[type] : sim->levels[level - 1];
+  *num_sets = cache->num_sets;
+  return cache->set_misses;
+}
+
+
+cache_miss_stat_t cache_sim_miss_stats(const cache_sim_t* sim, access_t type) {
+  return sim->misses[type];
+}
+
+
+/* Prefetched lines still in L1 and not used are pending, the other fills
+ * that were never used are unused
+ */
+cache_prefetch_stat_t cache_sim_prefetch_stats(const cache_sim_t* sim, access_t type) {
+  cache_prefetch_stat_t stats = sim->prefetches[type];
+  if (sim->config.prefetcher == no_prefetch) {
+    return stats;
+  }
+  const cache_t* cache = sim->caches[type];
+  for (uint32_t set = 0; set < cache->num_sets; set++) {
+    for (uint32_t way = 0; way < cache->num_ways; way++) {
+      size_t line = line_index(cache, set, way);
+      uint32_t block = cache->tags[(size_t)set * cache->num_ways + way];
+      if (((cache->valid[line >> 6] >> (line & 63)) & 1) &&
+          ((sim->prefetched[type][block >> 6] >> (block & 63)) & 1) &&
+          (sim->prefetch_stamps[type][line] & 1) == (uint64_t)type) {
+        stats.pending++;
+      }
+    }
+  }
+  stats.unused = stats.fills - stats.useful - stats.pending;
+  return stats;
+}
+
+
+cache_tlb_stat_t cache_sim_tlb_stats(const cache_sim_t* sim, access_t type) {
+  return sim->translations[type];
+}
+
+
+cache_timing_stat_t cache_sim_timing_stats(const cache_sim_t* sim) {
+  cache_timing_stat_t stats = sim->timing;
+  stats.cycles = sim->last_arrival > sim->clock ? sim->last_arrival : sim->clock;
+  return stats;
+}
+
+
+void cache_sim_reset(cache_sim_t* sim) {
+  free_sim_caches(sim);
+  create_sim_caches(sim);
+}
+
+
+void cache_sim_destroy(cache_sim_t* sim) {
+  free_sim_caches(sim);
+  free(sim);
+}
+
+
+#define NO_BLOCK UINT32_MAX  // above every block of a 32 bit address
+
+#ifndef CACHE_SIM_LIBRARY
+/* Collapses the batch in place, between decoding and the runners: a load of
+ * the block the last access of its type left in L1 is a hit that changes
+ * nothing under any replacement policy, so it is dropped and counted in
+ * repeats instead. RRIP inserts a line distant and only its first hit
+ * promotes it, so there a run keeps its first two accesses. A store is
+ * always kept, it may write through or dirty the line. In a unified cache,
+ * or with levels below that could take the line away, an access of the
+ * other type to a different block ends the run. Prefetchers train on every
+ * access, so nothing is dropped with one, nor with the timing model, where
+ * every access takes a cycle. The TLB of the type last saw the
+ * same page, so a repeat is an LRU hit there too. Returns the number of
+ * accesses left.
+ */
+static size_t coalesce_batch(const cache_sim_t* sim, mem_access_t* batch, size_t batch_size,
+                             uint64_t repeats[2]) {
+  if (sim->config.prefetcher != no_prefetch || sim->config.timing.hit_latency[0] > 0) {
+    return batch_size;
+  }
+  int shared = sim->caches[data] == sim->caches[instruction] || sim->num_levels > 1;
+  int allocate = sim->caches[data]->write_allocate;
+  int promote = sim->config.policy == srrip || sim->config.policy == brrip;
+  uint32_t last[2] = {NO_BLOCK, NO_BLOCK};      // block of the last kept access of each type
+  uint32_t resident[2] = {NO_BLOCK, NO_BLOCK};  // and whether its loads may be dropped
+  size_t n = 0;
+  // Without branches on the data, repeats come and go too irregularly to predict
+  for (size_t i = 0; i < batch_size; i++) {
+    mem_access_t access = batch[i];
+    uint32_t type = access.accesstype;
+    uint32_t block = access.address >> BLOCK_OFFSET_NUM_OF_BITS;
+    uint32_t repeat = !access.write & (block == resident[type]);
+    batch[n] = access;
+    n += !repeat;
+    repeats[type] += repeat;
+    // A repeat is a hit on the block already there, the updates leave it as it is
+    uint32_t other = type ^ 1;
+    if (shared & !repeat & (block != last[other])) {
+      last[other] = resident[other] = NO_BLOCK;
+    }
+    uint32_t dropped = access.write & !allocate;
+    resident[type] = dropped || (promote && block != last[type]) ? NO_BLOCK : block;
+    last[type] = dropped ? NO_BLOCK : block;
+  }
+  return n;
+}
+
+// Counts the repeats coalesce_batch() dropped as the hits they are
+static void add_repeats(cache_sim_t* sim, uint64_t repeats[2]) {
+  for (int type = instruction; type <= data; type++) {
+    sim->caches[type]->stats.accesses += repeats[type];
+    sim->caches[type]->stats.hits += repeats[type];
+    sim->streams[type].accesses += repeats[type];
+    sim->streams[type].hits += repeats[type];
+    if (sim->tlbs[type]) {
+      sim->translations[type].accesses += repeats[type];
+      sim->translations[type].hits += repeats[type];
+    }
+    sim->coalesced += repeats[type];
+    repeats[type] = 0;
+  }
+}
+
+static void simulate_trace(cache_sim_t* sim, trace_reader_t* trace) {
+  mem_access_t batch[TRACE_BATCH_SIZE];
+  size_t batch_size;
+  uint64_t repeats[2] = {0, 0};
+
+  /* Loop until whole trace file has been read */
+  while ((batch_size = read_transactions(trace, batch, TRACE_BATCH_SIZE)) > 0) {
+    cache_sim_feed(sim, batch, coalesce_batch(sim, batch, batch_size, repeats));
+  }
+  add_repeats(sim, repeats);
+}
+
+
+static void init_phase_detector(phase_detector_t* phases, uint64_t window, FILE* out) {
+  memset(phases, 0, sizeof(*phases));
+  phases->window = window;
+  phases->out = out;
+  fprintf(out, "window,start,accesses,hits,misses,hit_rate,instruction_misses,data_misses,phase,"
+          "boundary\n");
+}
+
+static void free_phase_detector(phase_detector_t* phases) {
+  free(phases->windows);
+  free(phases->signatures);
+}
+
+static void add_phase_signature(phase_detector_t* phases, const mem_access_t* batch, size_t batch_size) {
+  uint32_t* counts = phases->counts;
+  uint32_t prev = phases->prev_data_block;
+  for (size_t i = 0; i < batch_size; i++) {
+    uint32_t block = batch[i].address >> BLOCK_OFFSET_NUM_OF_BITS;
+    if (batch[i].accesstype == instruction) {
+      counts[sample_hash(block) % PHASE_CODE_BUCKETS]++;
+      continue;
+    }
+    // Data counts twice, once for its region and once for its stride
+    uint32_t stride = block > prev ? block - prev : prev - block;
+    uint32_t stride_class = stride ? 32 - __builtin_clz(stride) : 0;
+    if (stride_class >= PHASE_STRIDE_CLASSES) stride_class = PHASE_STRIDE_CLASSES - 1;
+    counts[PHASE_CODE_BUCKETS + sample_hash(block >> PHASE_REGION_BITS) % PHASE_REGION_BUCKETS]++;
+    counts[PHASE_CODE_BUCKETS + PHASE_REGION_BUCKETS + stride_class]++;
+    prev = block;
+  }
+  phases->prev_data_block = prev;
+}
+
+static double phase_distance(const float* signature, const double* centroid, uint64_t members) {
+  double distance = 0.0;
+  for (int bucket = 0; bucket < PHASE_BUCKETS; bucket++) {
+    distance += fabs(signature[bucket] - centroid[bucket] / members);
+  }
+  return distance;
+}
+
+// Closes the current window: its statistics, its phase and its CSV row
+static void end_window(phase_detector_t* phases, const cache_sim_t* sim) {
+  if (phases->num_windows == phases->capacity) {
+    phases->capacity = phases->capacity ? 2 * phases->capacity : 256;
+    phases->windows = (window_stat_t*)realloc(phases->windows, phases->capacity * sizeof(window_stat_t));
+    phases->signatures = (float*)realloc(phases->signatures,
+                                         phases->capacity * PHASE_BUCKETS * sizeof(float));
+  }
+  uint64_t index = phases->num_windows++;
+  window_stat_t* window = &phases->windows[index];
+  float* signature = phases->signatures + index * PHASE_BUCKETS;
+
+  cache_stat_t stats = cache_sim_stats(sim);
+  window->accesses = stats.accesses - phases->last.accesses;
+  window->hits = stats.hits - phases->last.hits;
+  for (int type = instruction; type <= data; type++) {
+    cache_stream_stat_t stream = cache_sim_stream_stats(sim, type);
+    window->misses[type] = stream.misses - phases->last_misses[type];
+    phases->last_misses[type] = stream.misses;
+  }
+  phases->last = stats;
+
+  uint64_t weight = 0;
+  for (int bucket = 0; bucket < PHASE_BUCKETS; bucket++) {
+    weight += phases->counts[bucket];
+  }
+  for (int bucket = 0; bucket < PHASE_BUCKETS; bucket++) {
+    signature[bucket] = weight ? (float)phases->counts[bucket] / weight : 0.0f;
+  }
+  memset(phases->counts, 0, sizeof(phases->counts));
+
+  uint32_t nearest = 0;
+  double nearest_distance = INFINITY;
+  for (uint32_t phase = 0; phase < phases->num_phases; phase++) {
+    double distance = phase_distance(signature, phases->centroids[phase], phases->members[phase]);
+    if (distance < nearest_distance) {
+      nearest = phase;
+      nearest_distance = distance;
+    }
+  }
+  if (nearest_distance > PHASE_THRESHOLD && phases->num_phases < MAX_PHASES) {
+    nearest = phases->num_phases++;
+  }
+  window->phase = nearest;
+  for (int bucket = 0; bucket < PHASE_BUCKETS; bucket++) {
+    phases->centroids[nearest][bucket] += signature[bucket];
+  }
+  phases->members[nearest]++;
+
+  int boundary = index > 0 && phases->windows[index - 1].phase != nearest;
+  fprintf(phases->out, "%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.6f,%" PRIu64
+          ",%" PRIu64 ",%" PRIu32 ",%d\n", index, index * phases->window, window->accesses,
+          window->hits, window->accesses - window->hits,
+          window->accesses ? (double)window->hits / window->accesses : 0.0, window->misses[instruction],
+          window->misses[data], nearest, boundary);
+  // Rows are for whoever reads them as they come
+  fflush(phases->out);
+}
+
+/* simulate_trace() cut into windows of phases->window accesses, the last
+ * one may be shorter
+ */
+static void simulate_windowed_trace(cache_sim_t* sim, trace_reader_t* trace, phase_detector_t* phases) {
+  mem_access_t batch[TRACE_BATCH_SIZE];
+  size_t batch_size;
+  uint64_t repeats[2] = {0, 0};
+  uint64_t left = phases->window;
+
+  while ((batch_size = read_transactions(trace, batch, TRACE_BATCH_SIZE)) > 0) {
+    for (size_t start = 0; start < batch_size;) {
+      size_t size = batch_size - start < left ? batch_size - start : left;
+      add_phase_signature(phases, batch + start, size);
+      cache_sim_feed(sim, batch + start, coalesce_batch(sim, batch + start, size, repeats));
+      start += size;
+      left -= size;
+      if (left == 0) {
+        add_repeats(sim, repeats);
+        end_window(phases, sim);
+        left = phases->window;
+      }
+    }
+  }
+  if (left < phases->window) {
+    add_repeats(sim, repeats);
+    end_window(phases, sim);
+  }
+}
+
+// The member window of a phase nearest its centroid
+static uint64_t phase_representative(const phase_detector_t* phases, uint32_t phase) {
+  uint64_t representative = 0;
+  double nearest = INFINITY;
+  for (uint64_t index = 0; index < phases->num_windows; index++) {
+    if (phases->windows[index].phase != phase) continue;
+    double distance = phase_distance(phases->signatures + index * PHASE_BUCKETS,
+                                     phases->centroids[phase], phases->members[phase]);
+    if (distance < nearest) {
+      representative = index;
+      nearest = distance;
+    }
+  }
+  return representative;
+}
+
+
+/* Set index bits every cache level indexes with, those of the level with the
+ * fewest sets. Blocks that differ in them never meet in a set of any level.
+ */
+static uint32_t shared_set_mask(const cache_sim_t* sim) {
+  uint32_t set_mask = sim->caches[instruction]->set_mask;
+  for (uint32_t level = 1; level < sim->num_levels; level++) {
+    set_mask &= sim->levels[level]->set_mask;
+  }
+  return set_mask;
+}
+#endif
+
+/* Set sharded simulation: the decoding thread routes every access by set
+ * index to one of the workers, each owning a contiguous range of sets. Sets
+ * do not interact and each worker sees the accesses of its sets in trace
+ * order, so the results are exactly those of simulate_trace().
+ */
+#define SHARD_BATCH_SIZE 1024
+#define SHARD_QUEUE_BATCHES 64  // power of two
+
+typedef struct {
+  mem_access_t accesses[SHARD_BATCH_SIZE];
+  uint32_t size;
+} shard_batch_t;
+
+/* Single producer single consumer ring of batches. Only the producer writes
+ * tail and only the consumer writes head, each after it is done with the
+ * batch, so the ring needs no lock. The producer fills batches in place.
+ */
+typedef struct {
+  _Alignas(64) atomic_size_t head;  // next batch to simulate
+  _Alignas(64) atomic_size_t tail;  // next batch to fill
+  atomic_int done;                  // no batches after tail
+  shard_batch_t* batches;
+} spsc_queue_t;
+
+/* A worker simulates on shallow copies of the caches, which share the line
+ * storage with the original caches but keep their own statistics.
+ */
+typedef struct {
+  pthread_t thread;
+  spsc_queue_t queue;
+  cache_sim_t sim;
+  cache_t caches[2];
+  cache_t levels[MAX_CACHE_LEVELS];
+  uint64_t cold_base[2];  // cold_fills of the L1 copies at the start
+} shard_worker_t;
+
+// Busy waits a little, then gives the CPU away
+static inline void spin_wait(uint32_t* spins) {
+  if (++*spins < 64) {
+#ifdef CACHE_SIM_X86
+    _mm_pause();
+#endif
+  } else {
+    sched_yield();
+  }
+}
+
+#ifndef CACHE_SIM_LIBRARY
+static void* shard_worker(void* arg) {
+  shard_worker_t* worker = (shard_worker_t*)arg;
+  spsc_queue_t* queue = &worker->queue;
+  size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  uint32_t spins = 0;
+
+  while (1) {
+    if (head == atomic_load_explicit(&queue->tail, memory_order_acquire)) {
+      // Check done before tail again, the last batch may come with it
+      if (atomic_load_explicit(&queue->done, memory_order_acquire) &&
+          head == atomic_load_explicit(&queue->tail, memory_order_acquire)) {
+        break;
+      }
+      spin_wait(&spins);
+      continue;
+    }
+    spins = 0;
+    shard_batch_t* batch = &queue->batches[head & (SHARD_QUEUE_BATCHES - 1)];
+    worker->sim.runner(&worker->sim, batch->accesses, batch->size);
+    atomic_store_explicit(&queue->head, ++head, memory_order_release);
+  }
+  return NULL;
+}
+
+// Returns the batch at the tail of the queue to fill, waiting while the ring is full
+static shard_batch_t* shard_batch_to_fill(spsc_queue_t* queue) {
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  uint32_t spins = 0;
+  while (tail - atomic_load_explicit(&queue->head, memory_order_acquire) == SHARD_QUEUE_BATCHES) {
+    spin_wait(&spins);
+  }
+  shard_batch_t* batch = &queue->batches[tail & (SHARD_QUEUE_BATCHES - 1)];
+  batch->size = 0;
+  return batch;
+}
+
+static void shard_publish(spsc_queue_t* queue) {
+  atomic_fetch_add_explicit(&queue->tail, 1, memory_order_release);
+}
+
+static uint64_t count_valid_lines(const cache_t* cache, uint32_t first_set, uint32_t end_set) {
+  uint64_t lines = 0;
+  for (size_t word = (size_t)first_set * cache->valid_words; word < (size_t)end_set * cache->valid_words;
+       word++) {
+    lines += __builtin_popcountll(cache->valid[word]);
+  }
+  return lines;
+}
+
+static void clear_cache_counters(cache_t* cache) {
+  memset(&cache->stats, 0, sizeof(cache_stat_t));
+  cache->fills = 0;
+  cache->cold_fills = 0;
+  cache->prefetch_cold_fills = 0;
+  cache->writebacks = 0;
+  cache->stores = 0;
+}
+
+static void merge_cache_counters(cache_t* cache, const cache_t* copy) {
+  cache->stats.accesses += copy->stats.accesses;
+  cache->stats.hits += copy->stats.hits;
+  cache->fills += copy->fills;
+  cache->cold_fills += copy->cold_fills;
+  cache->prefetch_cold_fills += copy->prefetch_cold_fills;
+  cache->writebacks += copy->writebacks;
+  cache->stores += copy->stores;
+}
+
+/* Sets up the copies of a worker owning the sets from first_set to end_set.
+ * A single level L1 copy counts the lines of the other sets as filled, so it
+ * is warm once its own sets are, see cache_warm().
+ */
+static void init_shard_worker(shard_worker_t* worker, const cache_sim_t* sim, uint32_t first_set,
+                              uint32_t end_set) {
+  worker->sim = *sim;
+  for (int type = instruction; type <= data; type++) {
+    if (type == data && sim->caches[data] == sim->caches[instruction]) {
+      worker->sim.caches[data] = worker->sim.caches[instruction];
+      break;
+    }
+    cache_t* cache = &worker->caches[type];
+    *cache = *sim->caches[type];
+    clear_cache_counters(cache);
+    if (sim->num_levels == 1) {
+      cache->cold_fills = (uint64_t)(cache->num_sets - (end_set - first_set)) * cache->num_ways +
+                          count_valid_lines(cache, first_set, end_set);
+    }
+    worker->cold_base[type] = cache->cold_fills;
+    worker->sim.caches[type] = cache;
+  }
+  for (uint32_t level = 1; level < sim->num_levels; level++) {
+    worker->levels[level] = *sim->levels[level];
+    clear_cache_counters(&worker->levels[level]);
+    worker->sim.levels[level] = &worker->levels[level];
+  }
+  memset(worker->sim.blocks_in, 0, sizeof(worker->sim.blocks_in));
+  memset(worker->sim.blocks_out, 0, sizeof(worker->sim.blocks_out));
+  memset(worker->sim.back_invalidations, 0, sizeof(worker->sim.back_invalidations));
+  memset(worker->sim.streams, 0, sizeof(worker->sim.streams));
+
+  atomic_init(&worker->queue.head, 0);
+  atomic_init(&worker->queue.tail, 0);
+  atomic_init(&worker->queue.done, 0);
+  worker->queue.batches = (shard_batch_t*)malloc(SHARD_QUEUE_BATCHES * sizeof(shard_batch_t));
+}
+
+static void merge_shard_worker(cache_sim_t* sim, shard_worker_t* worker) {
+  for (int type = instruction; type <= data; type++) {
+    if (type == data && sim->caches[data] == sim->caches[instruction]) break;
+    worker->caches[type].cold_fills -= worker->cold_base[type];
+    merge_cache_counters(sim->caches[type], &worker->caches[type]);
+  }
+  for (uint32_t level = 1; level < sim->num_levels; level++) {
+    merge_cache_counters(sim->levels[level], &worker->levels[level]);
+  }
+  for (int type = instruction; type <= data; type++) {
+    sim->streams[type].accesses += worker->sim.streams[type].accesses;
+    sim->streams[type].hits += worker->sim.streams[type].hits;
+    sim->streams[type].cold_fills += worker->sim.streams[type].cold_fills;
+    sim->streams[type].writes += worker->sim.streams[type].writes;
+    sim->streams[type].write_misses += worker->sim.streams[type].write_misses;
+  }
+  for (uint32_t level = 0; level < sim->num_levels; level++) {
+    sim->blocks_in[level] += worker->sim.blocks_in[level];
+    sim->blocks_out[level] += worker->sim.blocks_out[level];
+    sim->back_invalidations[level] += worker->sim.back_invalidations[level];
+  }
+  free(worker->queue.batches);
+}
+
+/* Simulates the trace on num_threads workers besides the decoding thread.
+ * Needs every cache level to have more than one set, and no miss
+ * classification, whose shadow caches are fully associative.
+ */
+static void simulate_trace_sharded(cache_sim_t* sim, trace_reader_t* trace, uint32_t num_threads) {
+  uint32_t set_mask = shared_set_mask(sim);
+  if (set_mask == 0) {
+    printf("Threads need more than one set in every cache level\n");
+    exit(0);
+  }
+  uint32_t set_bits = 0;
+  while ((1u << set_bits) <= set_mask) set_bits++;
+  if (num_threads > set_mask + 1ull) num_threads = set_mask + 1;
+
+  shard_worker_t* workers = (shard_worker_t*)aligned_alloc(64, num_threads * sizeof(shard_worker_t));
+  shard_batch_t** filling = (shard_batch_t**)malloc(num_threads * sizeof(shard_batch_t*));
+  for (uint32_t i = 0; i < num_threads; i++) {
+    // Worker i owns the sets whose (set * num_threads) >> set_bits is i
+    uint32_t first_set = (uint32_t)((((uint64_t)i << set_bits) + num_threads - 1) / num_threads);
+    uint32_t end_set = (uint32_t)((((uint64_t)(i + 1) << set_bits) + num_threads - 1) / num_threads);
+    init_shard_worker(&workers[i], sim, first_set, end_set);
+    filling[i] = shard_batch_to_fill(&workers[i].queue);
+    pthread_create(&workers[i].thread, NULL, shard_worker, &workers[i]);
+  }
+
+  mem_access_t batch[TRACE_BATCH_SIZE];
+  size_t batch_size;
+  uint64_t repeats[2] = {0, 0};
+  while ((batch_size = read_transactions(trace, batch, TRACE_BATCH_SIZE)) > 0) {
+    batch_size = coalesce_batch(sim, batch, batch_size, repeats);
+    // The workers run the runners directly, the TLBs are not sharded by set
+    if (sim->tlbs[instruction] || sim->tlbs[data]) {
+      translate_batch(sim, batch, batch_size);
+    }
+    for (size_t i = 0; i < batch_size; i++) {
+      uint32_t set = (batch[i].address >> BLOCK_OFFSET_NUM_OF_BITS) & set_mask;
+      uint32_t owner = (uint32_t)(((uint64_t)set * num_threads) >> set_bits);
+      shard_batch_t* shard = filling[owner];
+      shard->accesses[shard->size++] = batch[i];
+      if (shard->size == SHARD_BATCH_SIZE) {
+        shard_publish(&workers[owner].queue);
+        filling[owner] = shard_batch_to_fill(&workers[owner].queue);
+      }
+    }
+  }
+
+  for (uint32_t i = 0; i < num_threads; i++) {
+    if (filling[i]->size > 0) {
+      shard_publish(&workers[i].queue);
+    }
+    atomic_store_explicit(&workers[i].queue.done, 1, memory_order_release);
+  }
+  for (uint32_t i = 0; i < num_threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    merge_shard_worker(sim, &workers[i]);
+  }
+  add_repeats(sim, repeats);
+  free(filling);
+  free(workers);
+}
+
+
+/* Sets up the trace to drop the accesses outside the sample. The sample is
+ * drawn on the set index bits all levels share, see shared_set_mask(), so
+ * each set of every level is either wholly in the sample or wholly out of it.
+ */
+static void init_set_sampling(set_sampling_t* sampling, const cache_sim_t* sim, trace_reader_t* trace) {
+  uint32_t set_mask = shared_set_mask(sim);
+  if (set_mask == 0) {
+    printf("Set sampling needs more than one set in every cache level\n");
+    exit(0);
+  }
+
+  uint32_t threshold = (uint32_t)(((uint64_t)1 << 32) / sampling->rate);
+  sampling->total_sets = (uint64_t)set_mask + 1;
+  sampling->sampled_sets = 0;
+  for (uint64_t set = 0; set <= set_mask; set++) {
+    sampling->sampled_sets += sample_hash(set) < threshold;
+  }
+  if (sampling->sampled_sets == 0) {
+    printf("No set is sampled out of %" PRIu64 ", use a smaller sample rate\n", sampling->total_sets);
+    exit(0);
+  }
+  memset(sampling->groups, 0, sizeof(sampling->groups));
+
+  trace->sample_mask = set_mask;
+  trace->sample_threshold = threshold;
+}
+
+/* Simulates the sampled accesses of the trace and returns the statistics
+ * extrapolated to the whole trace. Each batch is fed one sample group at a
+ * time. Sets do not interact, and every set belongs to one group, so this
+ * keeps the order of the accesses within each set and the results exact.
+ */
+static cache_stat_t simulate_sampled_trace(cache_sim_t* sim, trace_reader_t* trace, set_sampling_t* sampling) {
+  mem_access_t batch[TRACE_BATCH_SIZE];
+  mem_access_t grouped[TRACE_BATCH_SIZE];
+  uint8_t group_of[TRACE_BATCH_SIZE];
+  size_t batch_size;
+
+  while ((batch_size = read_transactions(trace, batch, TRACE_BATCH_SIZE)) > 0) {
+    size_t start[SAMPLE_GROUPS + 1] = {0};
+    for (size_t i = 0; i < batch_size; i++) {
+      uint32_t set = (batch[i].address >> BLOCK_OFFSET_NUM_OF_BITS) & trace->sample_mask;
+      group_of[i] = sample_hash(set) % SAMPLE_GROUPS;
+      start[group_of[i] + 1]++;
+    }
+    for (int group = 0; group < SAMPLE_GROUPS; group++) {
+      start[group + 1] += start[group];
+    }
+    size_t next[SAMPLE_GROUPS];
+    memcpy(next, start, sizeof(next));
+    for (size_t i = 0; i < batch_size; i++) {
+      grouped[next[group_of[i]]++] = batch[i];
+    }
+
+    // Sets of different groups never meet, so a run may span the other groups
+    for (int group = 0; group < SAMPLE_GROUPS; group++) {
+      if (start[group + 1] == start[group]) continue;
+      cache_stat_t before = cache_sim_stats(sim);
+      uint64_t repeats[2] = {0, 0};
+      cache_sim_feed(sim, grouped + start[group],
+                     coalesce_batch(sim, grouped + start[group], start[group + 1] - start[group],
+                                    repeats));
+      add_repeats(sim, repeats);
+      cache_stat_t after = cache_sim_stats(sim);
+      sampling->groups[group].accesses += after.accesses - before.accesses;
+      sampling->groups[group].hits += after.hits - before.hits;
+    }
+  }
+  sampling->skipped_accesses = trace->skipped_accesses;
+
+  cache_stat_t sampled = cache_sim_stats(sim);
+  cache_stat_t stats;
+  stats.accesses = sampled.accesses + sampling->skipped_accesses;
+  stats.hits = sampled.accesses ? llround((double)sampled.hits / sampled.accesses * stats.accesses) : 0;
+  return stats;
+}
+#endif
+
+
+static inline void spin_lock(multi_core_t* mc, atomic_flag* lock) {
+  uint32_t spins = 0;
+  if (!mc->threaded) return;
+  while (atomic_flag_test_and_set_explicit(lock, memory_order_acquire)) {
+    spin_wait(&spins);
+  }
+}
+
+static inline void spin_unlock(multi_core_t* mc, atomic_flag* lock) {
+  if (mc->threaded) atomic_flag_clear_explicit(lock, memory_order_release);
+}
+
+static inline atomic_flag* directory_stripe(multi_core_t* mc, uint32_t block) {
+  return &mc->stripes[(block * 0x9E3779B1u) >> (32 - DIRECTORY_STRIPE_BITS)];
+}
+
+#ifndef CACHE_SIM_LIBRARY
+// Entry of the block, allocating its page on first use. Read and write it under its stripe.
+static directory_entry_t* directory_entry(multi_core_t* mc, uint32_t block) {
+  directory_entry_t* _Atomic* slot = &mc->directory[block >> DIRECTORY_PAGE_BITS];
+  directory_entry_t* page = atomic_load_explicit(slot, memory_order_acquire);
+  if (!page) {
+    directory_entry_t* fresh =
+        (directory_entry_t*)calloc((size_t)1 << DIRECTORY_PAGE_BITS, sizeof(directory_entry_t));
+    if (atomic_compare_exchange_strong(slot, &page, fresh)) {
+      page = fresh;
+    } else {
+      free(fresh);
+    }
+  }
+  return &page[block & (((uint32_t)1 << DIRECTORY_PAGE_BITS) - 1)];
+}
+#endif
+
+static inline size_t agent_line(const cache_t* cache, uint32_t block, int32_t way) {
+  return line_index(cache, block & cache->set_mask, way);
+}
+
+#ifndef CACHE_SIM_LIBRARY
+/* Another agent's request reached the agent holding the block. A read
+ * leaves it a shared copy: with MESI a dirty one is written back first,
+ * with MOESI it keeps it dirty as the owner. A write takes the copy away,
+ * the requester gets its dirty data. Returns 1 if the agent still held the
+ * block, which the threaded driver may have evicted meanwhile, and sets
+ * *dirty if it held it dirty.
+ */
+static int snoop_agent(multi_core_t* mc, coherent_cache_t* agent, uint32_t block, int write,
+                       int* dirty) {
+  spin_lock(mc, &agent->lock);
+  cache_t* cache = agent->cache;
+  int32_t way = cache_find(cache, block);
+  *dirty = 0;
+  if (way >= 0) {
+    size_t line = agent_line(cache, block, way);
+    agent->exclusive[line >> 6] &= ~(1ull << (line & 63));
+    if (write) {
+      *dirty = cache_invalidate(cache, block) == 2;
+      agent->stats.invalidations++;
+    } else if ((cache->dirty[line >> 6] >> (line & 63)) & 1) {
+      *dirty = 1;
+      if (mc->protocol == mesi) {
+        clean_line(cache, line);
+        cache->writebacks++;
+      }
+    }
+  }
+  spin_unlock(mc, &agent->lock);
+  return way >= 0;
+}
+
+// Removes an agent's victim from the directory, a dirty victim was written back on eviction
+static void evict_from_directory(multi_core_t* mc, uint32_t id, uint32_t victim) {
+  atomic_flag* stripe = directory_stripe(mc, victim);
+  spin_lock(mc, stripe);
+  directory_entry_t* entry = directory_entry(mc, victim);
+  entry->sharers &= ~(1ull << id);
+  if (entry->owned && entry->owner == id) entry->owned = 0;
+  if (entry->sharers == 0) entry->exclusive = 0;
+  spin_unlock(mc, stripe);
+}
+
+/* An access of agent id that its own copy cannot serve: a miss, or a write
+ * to a shared copy. Asks the directory and the agents it names under the
+ * stripe lock of the block, then fills or upgrades the line.
+ */
+static void coherent_request(multi_core_t* mc, uint32_t id, uint32_t block, int write) {
+  coherent_cache_t* agent = &mc->agents[id];
+  cache_t* cache = agent->cache;
+  atomic_flag* stripe = directory_stripe(mc, block);
+  uint64_t self = 1ull << id;
+  uint32_t victim = 0;
+  int evicted = 0;
+
+  spin_lock(mc, stripe);
+  directory_entry_t* entry = directory_entry(mc, block);
+  // The threaded driver may have lost a shared copy since the lookup
+  spin_lock(mc, &agent->lock);
+  int present = cache_find(cache, block) >= 0;
+  spin_unlock(mc, &agent->lock);
+
+  if (!present) {
+    if (write) {
+      agent->stats.bus_read_exclusives++;
+    } else {
+      agent->stats.bus_reads++;
+    }
+    if (entry->invalidated & self) {
+      agent->stats.coherence_misses++;
+    }
+  } else {
+    agent->stats.upgrades++;
+  }
+  entry->invalidated &= ~self;
+
+  int supplied = 0;
+  uint64_t others = entry->sharers & ~self;
+  if (write) {
+    // Every other copy goes, the exclusive or owning one hands over its data
+    for (uint64_t bits = others; bits; bits &= bits - 1) {
+      uint32_t other = __builtin_ctzll(bits);
+      int dirty;
+      if (snoop_agent(mc, &mc->agents[other], block, 1, &dirty)) {
+        entry->invalidated |= 1ull << other;
+        supplied |= entry->exclusive || (entry->owned && entry->owner == other);
+      }
+    }
+    entry->sharers = self;
+    entry->exclusive = 1;
+    entry->owned = 0;
+  } else {
+    if (entry->exclusive && others) {
+      // The exclusive copy becomes a shared one, dirty data stays with it under MOESI
+      uint32_t other = __builtin_ctzll(others);
+      int dirty;
+      supplied = snoop_agent(mc, &mc->agents[other], block, 0, &dirty);
+      if (supplied && dirty && mc->protocol == moesi) {
+        entry->owned = 1;
+        entry->owner = other;
+      }
+    } else if (entry->owned) {
+      supplied = 1;
+    }
+    entry->exclusive = others == 0;
+    entry->sharers |= self;
+  }
+  if (!present) {
+    agent->stats.transfers += supplied;
+  }
+
+  spin_lock(mc, &agent->lock);
+  if (!present) {
+    evicted = cache_fill(cache, block, &victim);
+  }
+  size_t line = agent_line(cache, block, cache_find(cache, block));
+  if (entry->exclusive) {
+    agent->exclusive[line >> 6] |= 1ull << (line & 63);
+  } else {
+    agent->exclusive[line >> 6] &= ~(1ull << (line & 63));
+  }
+  if (write) {
+    cache_write(cache, block);
+  }
+  spin_unlock(mc, &agent->lock);
+  spin_unlock(mc, stripe);
+
+  if (evicted) {
+    evict_from_directory(mc, id, victim);
+  }
+}
+
+/* One access of agent id, returns 1 on a hit. Reads of any copy and writes
+ * to an exclusive one are served by the agent's own cache, under its own
+ * lock only. The rest goes to the directory.
+ */
+static int coherent_access(multi_core_t* mc, uint32_t id, uint32_t block, int write) {
+  coherent_cache_t* agent = &mc->agents[id];
+  cache_t* cache = agent->cache;
+
+  spin_lock(mc, &agent->lock);
+  cache->stats.accesses++;
+  int32_t way = cache_find(cache, block);
+  int hit = way >= 0;
+  if (hit) {
+    cache->stats.hits++;
+    cache_touch(cache, block, way);
+    size_t line = agent_line(cache, block, way);
+    if (!write || ((agent->exclusive[line >> 6] >> (line & 63)) & 1)) {
+      if (write) write_line(cache, line);
+      spin_unlock(mc, &agent->lock);
+      return 1;
+    }
+  }
+  spin_unlock(mc, &agent->lock);
+
+  coherent_request(mc, id, block, write);
+  return hit;
+}
+#endif
+
+static inline uint32_t access_agent(const multi_core_t* mc, uint32_t core, const mem_access_t* access) {
+  return core * mc->agents_per_core + (mc->agents_per_core == 2 && access->accesstype == data);
+}
+
+#ifndef CACHE_SIM_LIBRARY
+/* Builds the caches of every core for the configuration, with a split L1 a
+ * core has an instruction and a data agent
+ */
+static void init_multi_core(multi_core_t* mc, const cache_config_t* config, coherence_t protocol,
+                     trace_reader_t** traces, uint32_t num_cores) {
+  memset(mc, 0, sizeof(*mc));
+  mc->protocol = protocol;
+  mc->num_cores = num_cores;
+  mc->traces = traces;
+  mc->agents_per_core = config->org == sc ? 2 : 1;
+  mc->num_agents = num_cores * mc->agents_per_core;
+  mc->agents = (coherent_cache_t*)calloc(mc->num_agents, sizeof(coherent_cache_t));
+  for (uint32_t core = 0; core < num_cores; core++) {
+    cache_t* caches[2];
+    create_caches(config, caches);
+    for (uint32_t i = 0; i < mc->agents_per_core; i++) {
+      coherent_cache_t* agent = &mc->agents[core * mc->agents_per_core + i];
+      agent->cache = caches[i];
+      agent->exclusive = (uint64_t*)calloc((size_t)caches[i]->num_sets * caches[i]->valid_words,
+                                           sizeof(uint64_t));
+      atomic_flag_clear(&agent->lock);
+    }
+  }
+  mc->directory_pages = ((uint64_t)1 << (ADDRESS_SIZE - BLOCK_OFFSET_NUM_OF_BITS)) >> DIRECTORY_PAGE_BITS;
+  mc->directory = (directory_entry_t* _Atomic*)calloc(mc->directory_pages, sizeof(*mc->directory));
+  for (int i = 0; i < 1 << DIRECTORY_STRIPE_BITS; i++) {
+    atomic_flag_clear(&mc->stripes[i]);
+  }
+}
+
+static void free_multi_core(multi_core_t* mc) {
+  for (uint32_t id = 0; id < mc->num_agents; id++) {
+    free_cache(mc->agents[id].cache);
+    free(mc->agents[id].exclusive);
+  }
+  for (uint64_t page = 0; page < mc->directory_pages; page++) {
+    free(mc->directory[page]);
+  }
+  free(mc->directory);
+  free(mc->agents);
+}
+
+/* Runs the traces round robin, interleave accesses of each core per turn,
+ * until all of them end. Deterministic, the reference the threaded driver
+ * approximates.
+ */
+static void simulate_multi_core(multi_core_t* mc) {
+  mem_access_t (*batches)[TRACE_BATCH_SIZE] =
+      (mem_access_t(*)[TRACE_BATCH_SIZE])malloc(mc->num_cores * sizeof(*batches));
+  size_t* sizes = (size_t*)calloc(mc->num_cores, sizeof(size_t));
+  size_t* next = (size_t*)calloc(mc->num_cores, sizeof(size_t));
+  uint32_t running = mc->num_cores;
+  uint8_t* done = (uint8_t*)calloc(mc->num_cores, 1);
+
+  while (running > 0) {
+    for (uint32_t core = 0; core < mc->num_cores; core++) {
+      for (uint32_t turn = 0; turn < mc->interleave && !done[core]; turn++) {
+        if (next[core] == sizes[core]) {
+          sizes[core] = read_transactions(mc->traces[core], batches[core], TRACE_BATCH_SIZE);
+          next[core] = 0;
+          if (sizes[core] == 0) {
+            done[core] = 1;
+            running--;
+            break;
+          }
+        }
+        const mem_access_t* access = &batches[core][next[core]++];
+        coherent_access(mc, access_agent(mc, core, access),
+                        access->address >> BLOCK_OFFSET_NUM_OF_BITS, access->write);
+      }
+    }
+  }
+  free(done);
+  free(next);
+  free(sizes);
+  free(batches);
+}
+#endif
+
+typedef struct {
+  pthread_t thread;
+  multi_core_t* mc;
+  uint32_t core;
+} core_worker_t;
+
+#ifndef CACHE_SIM_LIBRARY
+// Waits while the core is more than MC_DRIFT accesses ahead of the slowest other running one
+static void pace_core(multi_core_t* mc, uint32_t core, uint64_t done) {
+  uint32_t spins = 0;
+  while (1) {
+    uint64_t slowest = UINT64_MAX;
+    for (uint32_t other = 0; other < mc->num_cores; other++) {
+      if (other == core) continue;
+      uint64_t progress = atomic_load_explicit(&mc->progress[other], memory_order_relaxed);
+      if (progress < slowest) slowest = progress;
+    }
+    if (slowest == UINT64_MAX || done <= slowest + MC_DRIFT) return;
+    spin_wait(&spins);
+  }
+}
+
+static void* core_worker(void* arg) {
+  core_worker_t* worker = (core_worker_t*)arg;
+  multi_core_t* mc = worker->mc;
+  uint32_t core = worker->core;
+  mem_access_t batch[TRACE_BATCH_SIZE];
+  size_t batch_size;
+  uint64_t done = 0;
+
+  while ((batch_size = read_transactions(mc->traces[core], batch, TRACE_BATCH_SIZE)) > 0) {
+    for (size_t i = 0; i < batch_size; i++) {
+      coherent_access(mc, access_agent(mc, core, &batch[i]),
+                      batch[i].address >> BLOCK_OFFSET_NUM_OF_BITS, batch[i].write);
+      if ((++done & 255) == 0) {
+        atomic_store_explicit(&mc->progress[core], done, memory_order_relaxed);
+        pace_core(mc, core, done);
+      }
+    }
+  }
+  // A finished core holds back no one
+  atomic_store_explicit(&mc->progress[core], UINT64_MAX, memory_order_relaxed);
+  return NULL;
+}
+
+/* Runs every core on a thread of its own. The cores only synchronize on the
+ * lock of the directory stripe and the caches a request involves, and are
+ * kept within MC_DRIFT accesses of each other. Which core wins a race for a
+ * block depends on the thread schedule, so the results vary a little from
+ * run to run. The threads run long stretches of their traces between
+ * conflicts, so they come closer to simulate_multi_core() with a large
+ * interleave than with one access per turn.
+ */
+static void simulate_multi_core_threaded(multi_core_t* mc) {
+  core_worker_t* workers = (core_worker_t*)calloc(mc->num_cores, sizeof(core_worker_t));
+  mc->threaded = 1;
+  for (uint32_t core = 0; core < mc->num_cores; core++) {
+    atomic_init(&mc->progress[core], 0);
+  }
+  for (uint32_t core = 0; core < mc->num_cores; core++) {
+    workers[core].mc = mc;
+    workers[core].core = core;
+    pthread_create(&workers[core].thread, NULL, core_worker, &workers[core]);
+  }
+  for (uint32_t core = 0; core < mc->num_cores; core++) {
+    pthread_join(workers[core].thread, NULL);
+  }
+  mc->threaded = 0;
+  free(workers);
+}
+
+// Statistics of all L1 caches of all cores
+static cache_stat_t multi_core_stats(const multi_core_t* mc) {
+  cache_stat_t stats = {0, 0};
+  for (uint32_t id = 0; id < mc->num_agents; id++) {
+    stats.accesses += mc->agents[id].cache->stats.accesses;
+    stats.hits += mc->agents[id].cache->stats.hits;
+  }
+  return stats;
+}
+
+// Sums the caches of a core
+static core_stat_t core_stats(const multi_core_t* mc, uint32_t core) {
+  core_stat_t sum;
+  memset(&sum, 0, sizeof(sum));
+  for (uint32_t i = 0; i < mc->agents_per_core; i++) {
+    const coherent_cache_t* agent = &mc->agents[core * mc->agents_per_core + i];
+    sum.accesses += agent->cache->stats.accesses;
+    sum.hits += agent->cache->stats.hits;
+    sum.writebacks += agent->cache->writebacks;
+    sum.coherence.coherence_misses += agent->stats.coherence_misses;
+    sum.coherence.bus_reads += agent->stats.bus_reads;
+    sum.coherence.bus_read_exclusives += agent->stats.bus_read_exclusives;
+    sum.coherence.upgrades += agent->stats.upgrades;
+    sum.coherence.invalidations += agent->stats.invalidations;
+    sum.coherence.transfers += agent->stats.transfers;
+  }
+  return sum;
+}
+#endif
+
+
+/* Belady's OPT: a miss evicts the line whose block is used again farthest in
+ * the future, which gives the highest hit rate any replacement policy can
+ * reach with the same geometry. A backward pass over the whole trace finds
+ * the next access to the same block by the same cache for every access. Each
+ * set keeps its lines in a max-heap on that next use and a hash index maps
+ * resident blocks to their lines, so hits and misses cost O(log ways).
+ */
+#define OPT_NEVER UINT32_MAX  // next use of a block that is not accessed again
 
 typedef struct {
-  uint32_t address;
-  access_t accesstype;
-} mem_access_t;
+  uint32_t num_sets;
+  uint32_t num_ways;
+  uint32_t set_mask;
+  uint32_t* tags;         // block per line, line = set * num_ways + way
+  uint32_t* next_use;     // access index of the next use per line
+  uint32_t* heap;         // lines of each set, a max-heap on next_use
+  uint32_t* heap_pos;     // position of each line in the heap of its set
+  uint32_t* fill;         // lines in use per set, they fill up in order
+  uint32_t* index;        // open addressing block -> line + 1, 0 is an empty slot
+  uint32_t index_mask;
+  cache_stat_t stats;
+} opt_cache_t;
+
+static inline uint32_t next_use_hash(uint64_t key) {
+  return (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+/* Returns the next use of every access, OPT_NEVER for the last access to a
+ * block. With a split organization the two caches see separate streams, so
+ * the access type is part of the key. *peak_bytes is the most memory the
+ * result and the block map held at once.
+ */
+static uint32_t* build_next_use(const mem_access_t* trace, size_t num_accesses, int split,
+                                size_t* peak_bytes) {
+  uint32_t* next_use = (uint32_t*)malloc(num_accesses * sizeof(uint32_t));
+  uint32_t size = 1 << 16;
+  uint64_t* keys = (uint64_t*)calloc(size, sizeof(uint64_t));  // (block, cache) + 1, 0 is empty
+  uint32_t* latest = (uint32_t*)malloc(size * sizeof(uint32_t));
+  uint32_t count = 0;
+
+  for (size_t i = num_accesses; i-- > 0;) {
+    uint64_t block = trace[i].address >> BLOCK_OFFSET_NUM_OF_BITS;
+    uint64_t key = ((block << 1) | (split ? trace[i].accesstype : 0)) + 1;
+    uint32_t slot = next_use_hash(key) & (size - 1);
+    while (keys[slot] != 0 && keys[slot] != key) slot = (slot + 1) & (size - 1);
+
+    if (keys[slot] != 0) {
+      next_use[i] = latest[slot];
+    } else {
+      next_use[i] = OPT_NEVER;
+      keys[slot] = key;
+      count++;
+    }
+    latest[slot] = (uint32_t)i;
+
+    // Keep the map at most half full
+    if (2 * count > size) {
+      uint64_t* old_keys = keys;
+      uint32_t* old_latest = latest;
+      keys = (uint64_t*)calloc(2 * size, sizeof(uint64_t));
+      latest = (uint32_t*)malloc(2 * size * sizeof(uint32_t));
+      for (uint32_t old = 0; old < size; old++) {
+        if (old_keys[old] == 0) continue;
+        uint32_t moved = next_use_hash(old_keys[old]) & (2 * size - 1);
+        while (keys[moved] != 0) moved = (moved + 1) & (2 * size - 1);
+        keys[moved] = old_keys[old];
+        latest[moved] = old_latest[old];
+      }
+      free(old_keys);
+      free(old_latest);
+      size *= 2;
+    }
+  }
+
+  *peak_bytes = num_accesses * sizeof(uint32_t) + (size_t)size * (sizeof(uint64_t) + sizeof(uint32_t));
+  free(keys);
+  free(latest);
+  return next_use;
+}
+
+static opt_cache_t* create_opt_cache(uint32_t size, uint32_t ways) {
+  uint32_t num_of_cache_lines = size / BLOCK_SIZE;
+  opt_cache_t* cache = (opt_cache_t*)calloc(1, sizeof(opt_cache_t));
+  cache->num_ways = ways;
+  cache->num_sets = num_of_cache_lines / ways;
+  cache->set_mask = cache->num_sets - 1;
+  cache->tags = (uint32_t*)malloc(num_of_cache_lines * sizeof(uint32_t));
+  cache->next_use = (uint32_t*)malloc(num_of_cache_lines * sizeof(uint32_t));
+  cache->heap = (uint32_t*)malloc(num_of_cache_lines * sizeof(uint32_t));
+  cache->heap_pos = (uint32_t*)malloc(num_of_cache_lines * sizeof(uint32_t));
+  cache->fill = (uint32_t*)calloc(cache->num_sets, sizeof(uint32_t));
+
+  uint32_t index_size = 2;
+  while (index_size < 2 * num_of_cache_lines) index_size <<= 1;
+  cache->index = (uint32_t*)calloc(index_size, sizeof(uint32_t));
+  cache->index_mask = index_size - 1;
+  return cache;
+}
+
+static size_t opt_cache_bytes(const opt_cache_t* cache) {
+  size_t lines = (size_t)cache->num_sets * cache->num_ways;
+  return lines * 4 * sizeof(uint32_t) + cache->num_sets * sizeof(uint32_t) +
+         (cache->index_mask + 1ull) * sizeof(uint32_t);
+}
+
+static void free_opt_cache(opt_cache_t* cache) {
+  free(cache->tags);
+  free(cache->next_use);
+  free(cache->heap);
+  free(cache->heap_pos);
+  free(cache->fill);
+  free(cache->index);
+  free(cache);
+}
+
+static inline uint32_t opt_hash(const opt_cache_t* cache, uint32_t block) {
+  return (block * 0x9E3779B1u) & cache->index_mask;
+}
+
+// Returns the index slot holding the block, or the empty slot ending its probe sequence
+static inline uint32_t opt_find_slot(const opt_cache_t* cache, uint32_t block) {
+  uint32_t slot = opt_hash(cache, block);
+  uint32_t entry;
+  while ((entry = cache->index[slot]) != 0 && cache->tags[entry - 1] != block) {
+    slot = (slot + 1) & cache->index_mask;
+  }
+  return slot;
+}
+
+// Removes the entry in slot with backward shift deletion, as fa_index_remove()
+static void opt_index_remove(opt_cache_t* cache, uint32_t slot) {
+  uint32_t mask = cache->index_mask;
+  uint32_t hole = slot;
+  uint32_t next = slot;
+
+  while (1) {
+    next = (next + 1) & mask;
+    uint32_t entry = cache->index[next];
+    if (entry == 0) break;
+
+    uint32_t home = opt_hash(cache, cache->tags[entry - 1]);
+    if (hole <= next ? (hole < home && home <= next) : (hole < home || home <= next)) {
+      continue;
+    }
+    cache->index[hole] = entry;
+    hole = next;
+  }
+  cache->index[hole] = 0;
+}
+
+static inline void opt_heap_swap(opt_cache_t* cache, uint32_t* heap, uint32_t a, uint32_t b) {
+  uint32_t line = heap[a];
+  heap[a] = heap[b];
+  heap[b] = line;
+  cache->heap_pos[heap[a]] = a;
+  cache->heap_pos[heap[b]] = b;
+}
 
-typedef struct {
-  uint64_t accesses;
-  uint64_t hits;
-} cache_stat_t;
+static void opt_sift_up(opt_cache_t* cache, uint32_t* heap, uint32_t pos) {
+  while (pos > 0) {
+    uint32_t parent = (pos - 1) / 2;
+    if (cache->next_use[heap[parent]] >= cache->next_use[heap[pos]]) break;
+    opt_heap_swap(cache, heap, parent, pos);
+    pos = parent;
+  }
+}
 
-typedef struct {
-  uint8_t valid;
-  uint32_t tag;
-} cache_line_t;
+static void opt_sift_down(opt_cache_t* cache, uint32_t* heap, uint32_t count, uint32_t pos) {
+  while (1) {
+    uint32_t largest = pos;
+    uint32_t left = 2 * pos + 1;
+    uint32_t right = left + 1;
+    if (left < count && cache->next_use[heap[left]] > cache->next_use[heap[largest]]) largest = left;
+    if (right < count && cache->next_use[heap[right]] > cache->next_use[heap[largest]]) largest = right;
+    if (largest == pos) break;
+    opt_heap_swap(cache, heap, pos, largest);
+    pos = largest;
+  }
+}
 
-// DECLARE CACHES AND COUNTERS FOR THE STATS HERE
-uint32_t cache_size;
-const uint32_t BLOCK_SIZE = 64;
-const uint32_t ADDRESS_SIZE = 32;
-cache_map_t cache_mapping;
-cache_org_t cache_org;
+/* Does a cache access for the block, next being the index of the next access
+ * to it, and returns 1 on a hit. The line used is always the one with the
+ * nearest next use in its set, so a hit only ever moves its line up the heap
+ * and a fill at the root only ever moves it down.
+ */
+static int access_opt(opt_cache_t* cache, uint32_t block, uint32_t next) {
+  uint32_t slot = opt_find_slot(cache, block);
+  uint32_t entry = cache->index[slot];
+  uint32_t set = block & cache->set_mask;
+  uint32_t* heap = cache->heap + (size_t)set * cache->num_ways;
 
-// USE THIS FOR YOUR CACHE STATISTICS
-cache_stat_t cache_statistics;
+  if (entry != 0) {
+    // Hit!
+    uint32_t line = entry - 1;
+    cache->next_use[line] = next;
+    opt_sift_up(cache, heap, cache->heap_pos[line]);
+    return 1;
+  }
 
+  // No hit
+  uint32_t line;
+  if (cache->fill[set] < cache->num_ways) {
+    uint32_t pos = cache->fill[set]++;
+    line = set * cache->num_ways + pos;
+    heap[pos] = line;
+    cache->heap_pos[line] = pos;
+    cache->tags[line] = block;
+    cache->next_use[line] = next;
+    opt_sift_up(cache, heap, pos);
+  } else {
+    line = heap[0];
+    opt_index_remove(cache, opt_find_slot(cache, cache->tags[line]));
+    // The removal may have shifted entries into our probe sequence
+    slot = opt_find_slot(cache, block);
+    cache->tags[line] = block;
+    cache->next_use[line] = next;
+    opt_sift_down(cache, heap, cache->num_ways, 0);
+  }
+  cache->index[slot] = line + 1;
+  return 0;
+}
 
-void read_params_and_init(int argc, char** argv);
+cache_stat_t cache_sim_opt(const cache_config_t* config, const mem_access_t* trace,
+                           size_t num_accesses, size_t* peak_bytes) {
+  cache_stat_t stats = {0, 0};
+  if (num_accesses >= OPT_NEVER) {
+    return stats;
+  }
 
-FILE* read_access_from_file(char *file_name);
+  uint32_t ways = cache_config_ways(config);
+  size_t bytes;
+  uint32_t* next_use = build_next_use(trace, num_accesses, config->org == sc, &bytes);
 
-void dm_uc_cache(FILE* ptr_file);
+  opt_cache_t* caches[2];
+  if (config->org == uc) {
+    caches[instruction] = caches[data] = create_opt_cache(config->size, ways);
+  } else {
+    caches[instruction] = create_opt_cache(config->size / 2, ways);
+    caches[data] = create_opt_cache(config->size / 2, ways);
+  }
 
-void dm_sc_cache(FILE* ptr_file);
+  for (size_t i = 0; i < num_accesses; i++) {
+    uint32_t block = trace[i].address >> BLOCK_OFFSET_NUM_OF_BITS;
+    stats.hits += access_opt(caches[trace[i].accesstype], block, next_use[i]);
+  }
+  stats.accesses = num_accesses;
 
-void fa_uc_cache(FILE* ptr_file);
+  size_t cache_bytes = num_accesses * sizeof(uint32_t) + opt_cache_bytes(caches[instruction]);
+  if (caches[data] != caches[instruction]) {
+    cache_bytes += opt_cache_bytes(caches[data]);
+    free_opt_cache(caches[data]);
+  }
+  free_opt_cache(caches[instruction]);
+  free(next_use);
 
-void fa_sc_cache(FILE* ptr_file);
+  if (peak_bytes) {
+    *peak_bytes = bytes > cache_bytes ? bytes : cache_bytes;
+  }
+  return stats;
+}
 
-void access_dm(cache_line_t* cache, uint32_t access_tag, uint32_t access_index);
+#ifndef CACHE_SIM_LIBRARY
+/* Decodes the whole trace, since OPT needs the future, and simulates it with
+ * OPT replacement for cache_config. *peak_bytes gets the most memory the
+ * decoded trace and the OPT state held at once.
+ */
+static cache_stat_t simulate_opt_trace(trace_reader_t* trace, size_t* peak_bytes) {
+  size_t num_accesses;
+  mem_access_t* accesses = load_trace(trace, &num_accesses);
+  if (num_accesses >= OPT_NEVER) {
+    printf("OPT replacement supports at most %" PRIu32 " accesses\n", OPT_NEVER - 1);
+    exit(0);
+  }
 
-void access_fa(uint32_t* cache, uint32_t access_tag, uint32_t num_of_cache_lines, access_t access_type);
+  cache_stat_t stats = cache_sim_opt(&cache_config, accesses, num_accesses, peak_bytes);
+  *peak_bytes += num_accesses * sizeof(mem_access_t);
+  free(accesses);
+  return stats;
+}
 
-mem_access_t read_transaction(FILE* ptr_file);
 
-void print_statistics(cache_stat_t cache_statistics);
+static void init_stack_distance(stack_distance_t* sd) {
+  memset(sd, 0, sizeof(*sd));
+  sd->capacity = 1 << 16;
+  sd->tree = (uint32_t*)calloc(sd->capacity + 1, sizeof(uint32_t));
+  sd->block_at = (uint32_t*)malloc(sd->capacity * sizeof(uint32_t));
+  sd->map_mask = (1 << 16) - 1;
+  sd->map_blocks = (uint32_t*)calloc(sd->map_mask + 1, sizeof(uint32_t));
+  sd->map_times = (uint32_t*)calloc(sd->map_mask + 1, sizeof(uint32_t));
+}
 
+static void free_stack_distance(stack_distance_t* sd) {
+  free(sd->tree);
+  free(sd->block_at);
+  free(sd->map_blocks);
+  free(sd->map_times);
+}
+#endif
 
-void main(int argc, char** argv) {
-  // Reset statistics:
-  memset(&cache_statistics, 0, sizeof(cache_stat_t));
+static inline void fenwick_add(uint32_t* tree, uint32_t size, uint32_t time, int32_t value) {
+  for (uint32_t i = time + 1; i <= size; i += i & -i) tree[i] += value;
+}
 
-  read_params_and_init(argc, argv);
+// Number of marked times in [0, time)
+static inline uint32_t fenwick_prefix(const uint32_t* tree, uint32_t time) {
+  uint32_t sum = 0;
+  for (uint32_t i = time; i > 0; i &= i - 1) sum += tree[i];
+  return sum;
+}
+
+static inline uint32_t* stack_distance_slot(stack_distance_t* sd, uint32_t block) {
+  uint32_t slot = (block * 0x9E3779B1u) & sd->map_mask;
+  while (sd->map_times[slot] != 0 && sd->map_blocks[slot] != block) {
+    slot = (slot + 1) & sd->map_mask;
+  }
+  sd->map_blocks[slot] = block;
+  return &sd->map_times[slot];
+}
+
+#ifndef CACHE_SIM_LIBRARY
+static void grow_stack_distance_map(stack_distance_t* sd) {
+  uint32_t old_size = sd->map_mask + 1;
+  uint32_t* old_blocks = sd->map_blocks;
+  uint32_t* old_times = sd->map_times;
 
-  FILE* ptr_file = read_access_from_file("mem_trace2.txt");
+  sd->map_mask = 2 * old_size - 1;
+  sd->map_blocks = (uint32_t*)calloc(2 * old_size, sizeof(uint32_t));
+  sd->map_times = (uint32_t*)calloc(2 * old_size, sizeof(uint32_t));
+  for (uint32_t i = 0; i < old_size; i++) {
+    if (old_times[i] != 0) {
+      *stack_distance_slot(sd, old_blocks[i]) = old_times[i];
+    }
+  }
+  free(old_blocks);
+  free(old_times);
+}
 
-  // Branch to the respective cache function given the cache parameters
-  if (cache_mapping == dm && cache_org == uc) {
-    dm_uc_cache(ptr_file);
-  } else if (cache_mapping == dm && cache_org == sc) {
-    dm_sc_cache(ptr_file);
-  } else if (cache_mapping == fa && cache_org == uc) {
-    fa_uc_cache(ptr_file);
-  } else if (cache_mapping == fa && cache_org == sc) {
-    fa_sc_cache(ptr_file);
+/* Gives the live blocks the times 0..distinct-1 in their current order and
+ * makes room for at least as many new accesses.
+ */
+static void renumber_stack_distance(stack_distance_t* sd) {
+  uint32_t live = 0;
+  for (uint32_t time = 0; time < sd->time; time++) {
+    uint32_t* latest = stack_distance_slot(sd, sd->block_at[time]);
+    if (*latest == time + 1) {
+      sd->block_at[live] = sd->block_at[time];
+      *latest = ++live;
+    }
   }
 
-  print_statistics(cache_statistics);
+  if (2 * live > sd->capacity) {
+    sd->capacity *= 2;
+    sd->block_at = (uint32_t*)realloc(sd->block_at, sd->capacity * sizeof(uint32_t));
+    free(sd->tree);
+    sd->tree = (uint32_t*)malloc((sd->capacity + 1) * sizeof(uint32_t));
+  }
 
-  /* Close the trace file */
-  fclose(ptr_file);
+  // Linear time Fenwick build from all ones in [0, live)
+  memset(sd->tree, 0, (sd->capacity + 1) * sizeof(uint32_t));
+  for (uint32_t i = 1; i <= sd->capacity; i++) {
+    if (i <= live) sd->tree[i] += 1;
+    uint32_t parent = i + (i & -i);
+    if (parent <= sd->capacity) sd->tree[parent] += sd->tree[i];
+  }
+  sd->time = live;
+}
+
+static void record_stack_distance(stack_distance_t* sd, uint32_t block) {
+  if (sd->time == sd->capacity) {
+    renumber_stack_distance(sd);
+  }
+  if (2 * (sd->distinct + 1) > sd->map_mask + 1) {
+    grow_stack_distance_map(sd);
+  }
+
+  uint32_t* latest = stack_distance_slot(sd, block);
+  if (*latest == 0) {
+    sd->cold_misses++;
+    sd->distinct++;
+  } else {
+    uint32_t previous = *latest - 1;
+    uint32_t distance = sd->distinct - fenwick_prefix(sd->tree, previous + 1);
+    uint32_t bucket = distance == 0 ? 0 : 32 - __builtin_clz(distance);
+    sd->histogram[bucket]++;
+    fenwick_add(sd->tree, sd->capacity, previous, -1);
+  }
+
+  fenwick_add(sd->tree, sd->capacity, sd->time, 1);
+  sd->block_at[sd->time] = block;
+  *latest = ++sd->time;
+  sd->accesses++;
 }
 
+// Hits in a fully associative LRU cache of 2^log_lines lines
+static uint64_t stack_distance_hits(const stack_distance_t* sd, uint32_t log_lines) {
+  uint64_t hits = 0;
+  for (uint32_t bucket = 0; bucket <= log_lines && bucket < STACK_DISTANCE_BUCKETS; bucket++) {
+    hits += sd->histogram[bucket];
+  }
+  return hits;
+}
 
-/* Reads a memory access from the trace file and returns
- * 1) access type (instruction or data access
- * 2) memory address
+/* Prints the hit rate of unified and split fully associative LRU caches of
+ * every power of two size from one pass over the trace. The split caches get
+ * half the size each, like in the simulation.
  */
-mem_access_t read_transaction(FILE* ptr_file) {
-  char type;
-  mem_access_t access;
+static void print_hit_rate_curve(trace_reader_t* trace) {
+  stack_distance_t unified, split[2];
+  init_stack_distance(&unified);
+  init_stack_distance(&split[instruction]);
+  init_stack_distance(&split[data]);
 
-  if (fscanf(ptr_file, "%c %x\n", &type, &access.address) == 2) {
-    if (type != 'I' && type != 'D') {
-      printf("Unkown access type\n");
-      exit(0);
+  mem_access_t batch[TRACE_BATCH_SIZE];
+  size_t batch_size;
+  while ((batch_size = read_transactions(trace, batch, TRACE_BATCH_SIZE)) > 0) {
+    for (size_t i = 0; i < batch_size; i++) {
+      uint32_t block = batch[i].address >> BLOCK_OFFSET_NUM_OF_BITS;
+      record_stack_distance(&unified, block);
+      record_stack_distance(&split[batch[i].accesstype], block);
     }
-    access.accesstype = (type == 'I') ? instruction : data;
-    return access;
   }
 
-  /* If there are no more entries in the file,
-   * return an address 0 that will terminate the infinite loop in main
-   */
-  access.address = 0;
-  return access;
+  printf("\nHit Rate Curve (fully associative, LRU)\n");
+  printf("---------------------------------------\n\n");
+  printf("%-12s %-10s %-10s\n", "Size", "Unified", "Split");
+
+  // Stop once every distinct block fits in the cache, and not before 4096
+  for (uint32_t log_lines = 1; log_lines < STACK_DISTANCE_BUCKETS; log_lines++) {
+    uint64_t unified_hits = stack_distance_hits(&unified, log_lines);
+    uint64_t split_hits = stack_distance_hits(&split[instruction], log_lines - 1) +
+                          stack_distance_hits(&split[data], log_lines - 1);
+    printf("%-12" PRIu64 " %-10.4f %-10.4f\n", (uint64_t)BLOCK_SIZE << log_lines,
+           (double)unified_hits / unified.accesses, (double)split_hits / unified.accesses);
+    if ((BLOCK_SIZE << log_lines) >= 4096 && (1ull << (log_lines - 1)) >= unified.distinct) {
+      break;
+    }
+  }
+
+  free_stack_distance(&unified);
+  free_stack_distance(&split[instruction]);
+  free_stack_distance(&split[data]);
 }
 
-void read_params_and_init(int argc, char** argv){
-  /* Read command-line parameters and initialize:
-   * cache_size, cache_mapping and cache_org variables
-   */
-  /* IMPORTANT: *IF* YOU ADD COMMAND LINE PARAMETERS (you really don't need to),
-   * MAKE SURE TO ADD THEM IN THE END AND CHOOSE SENSIBLE DEFAULTS SUCH THAT WE
-   * CAN RUN THE RESULTING BINARY WITHOUT HAVING TO SUPPLY MORE PARAMETERS THAN
-   * SPECIFIED IN THE UNMODIFIED FILE (cache_size, cache_mapping and cache_org)
-   */
-  if (argc != 4) { /* argc should be 2 for correct execution */
-    printf(
-        "Usage: ./cache_sim [cache size: 128-4096] [cache mapping: dm|fa] "
-        "[cache organization: uc|sc]\n");
-    exit(0);
-  } else {
-    /* argv[0] is program name, parameters start with argv[1] */
 
-    /* Set cache size */
-    cache_size = atoi(argv[1]);
+static trace_reader_t* read_access_from_file(char *file_name){
+  char error[128];
+  trace_reader_t* trace = open_trace(file_name, error, sizeof(error));
+  if (!trace) {
+    printf("%s\n", error);
+    exit(1);
+  }
+  return trace;
+}
 
-    /* Set Cache Mapping */
-    if (strcmp(argv[2], "dm") == 0) {
-      cache_mapping = dm;
-    } else if (strcmp(argv[2], "fa") == 0) {
-      cache_mapping = fa;
-    } else {
-      printf("Unknown cache mapping\n");
-      exit(0);
+/* Opens the trace for decoding, NULL with why in error if it cannot be.
+ * A file is mapped into memory so it can be decoded without stdio, "-" is
+ * stdin, which like a pipe is streamed instead.
+ */
+static trace_reader_t* open_trace(const char* file_name, char* error, size_t error_size) {
+  trace_reader_t* trace = (trace_reader_t*)calloc(1, sizeof(trace_reader_t));
+  struct stat file_stat;
+
+  trace->fd = strcmp(file_name, "-") == 0 ? dup(STDIN_FILENO) : open(file_name, O_RDONLY);
+  if (trace->fd < 0 || fstat(trace->fd, &file_stat) != 0) {
+    snprintf(error, error_size, "Unable to open the trace file");
+    close_trace(trace);
+    return NULL;
+  }
+  pthread_once(&hex_table_once, init_hex_table);
+
+  if (!S_ISREG(file_stat.st_mode)) {
+    trace->format = text_trace;
+    trace->stream = (trace_stream_t*)calloc(1, sizeof(trace_stream_t));
+    pthread_mutex_init(&trace->stream->mutex, NULL);
+    pthread_cond_init(&trace->stream->filled, NULL);
+    pthread_cond_init(&trace->stream->drained, NULL);
+    return trace;
+  }
+
+  trace->size = file_stat.st_size;
+  if (trace->size > 0) {
+    void* data = mmap(NULL, trace->size, PROT_READ, MAP_PRIVATE, trace->fd, 0);
+    if (data == MAP_FAILED) {
+      snprintf(error, error_size, "Unable to map the trace file");
+      trace->size = 0;
+      close_trace(trace);
+      return NULL;
     }
+    // The trace is read front to back exactly once
+    madvise(data, trace->size, MADV_SEQUENTIAL);
+    trace->data = (const char*)data;
+  }
 
-    /* Set Cache Organization */
-    if (strcmp(argv[3], "uc") == 0) {
-      cache_org = uc;
-    } else if (strcmp(argv[3], "sc") == 0) {
-      cache_org = sc;
-    } else {
-      printf("Unknown cache organization\n");
-      exit(0);
+  // Pick the decoder from the magic bytes
+  binary_trace_header_t header;
+  if (trace->size >= sizeof(header) &&
+      memcmp(trace->data, BINARY_TRACE_MAGIC, sizeof(header.magic)) == 0) {
+    memcpy(&header, trace->data, sizeof(header));
+    if (!binary_header_supported(&header, trace->size)) {
+      snprintf(error, error_size, "Unsupported binary trace");
+      close_trace(trace);
+      return NULL;
     }
+    trace->format = binary_trace;
+    trace->pos = sizeof(header);
+    trace->end = header.index_offset;
+    trace->type_bits = header.version == 1 ? 1 : 2;
+    trace->chunk_accesses = header.chunk_accesses;
+  } else {
+    trace->format = text_trace;
   }
+  return trace;
 }
 
-void dm_uc_cache(FILE* ptr_file) {
-  mem_access_t access;
 
-  // Set cache size and cacheline structure
-  uint32_t num_of_cache_lines = cache_size / BLOCK_SIZE;
+/* Where the time of a streamed trace went, to stderr with the throughput.
+ * Whichever side waited less for the other held the pipeline back.
+ */
+static void print_stream_statistics(const trace_reader_t* trace) {
+  const trace_stream_t* stream = trace->stream;
+  if (!stream || !stream->started) return;
+  double decode_seconds = stream->reader_seconds - stream->read_seconds - stream->full_seconds;
+  const char* bottleneck = "the simulation";
+  if (stream->empty_seconds > stream->full_seconds) {
+    bottleneck = stream->read_seconds > decode_seconds ? "the producer" : "decoding";
+  }
+  fprintf(stderr,
+          "Streamed %.1f MiB: the reader waited %.3f s for the producer and %.3f s for the "
+          "simulation, decoded for %.3f s, and the simulation waited %.3f s for it; %s is the "
+          "bottleneck\n",
+          stream->bytes / (1024.0 * 1024.0), stream->read_seconds, stream->full_seconds,
+          decode_seconds, stream->empty_seconds, bottleneck);
+}
 
-  uint32_t index_num_of_bits = floor(log2(num_of_cache_lines));
-  const uint32_t BLOCK_OFFSET_NUM_OF_BITS = floor(log2(BLOCK_SIZE));  // 6 bits for indexing to 64B
-  uint32_t tag_num_of_bits = ADDRESS_SIZE - BLOCK_OFFSET_NUM_OF_BITS - index_num_of_bits;
 
-  // Allocate memory for cache valid bit and tag storage
-  cache_line_t* cache = (cache_line_t*)calloc(num_of_cache_lines, sizeof(cache_line_t));
-  
-  // Generate mask bits
-  uint32_t index_mask = ((1 << index_num_of_bits) - 1);
-  uint32_t tag_mask = ((1 << tag_num_of_bits) - 1);
-  
-  /* Loop until whole trace file has been read */
-  while (1) {
-    access = read_transaction(ptr_file);
-    // If no transactions left, break out of loop
-    if (access.address == 0) break;
-    
-    // Move the relevant bits for tag and index to the right and mask them
-    uint32_t access_tag = (access.address >> (BLOCK_OFFSET_NUM_OF_BITS + index_num_of_bits)) & tag_mask;
-    uint32_t access_index = (access.address >> BLOCK_OFFSET_NUM_OF_BITS) & index_mask;
+static void close_trace(trace_reader_t* trace) {
+  trace_stream_t* stream = trace->stream;
+  if (stream) {
+    if (stream->started) {
+      // A reader the caller stopped early waits for free slots, drain them
+      mem_access_t batch[TRACE_BATCH_SIZE];
+      while (read_stream_transactions(trace, batch, TRACE_BATCH_SIZE) > 0) {
+      }
+      pthread_join(stream->thread, NULL);
+    }
+    pthread_cond_destroy(&stream->drained);
+    pthread_cond_destroy(&stream->filled);
+    pthread_mutex_destroy(&stream->mutex);
+    free(stream);
+  }
+  if (trace->size > 0) {
+    munmap((void*)trace->data, trace->size);
+  }
+  close(trace->fd);
+  free(trace);
+}
+
+
+static void print_statistics(cache_stat_t cache_statistics){
+  /* Print the statistics */
+  // DO NOT CHANGE THE FOLLOWING LINES!
+  printf("\nCache Statistics\n");
+  printf("-----------------\n\n");
+  printf("Accesses: %ld\n", cache_statistics.accesses);
+  printf("Hits:     %ld\n", cache_statistics.hits);
+  printf("Hit Rate: %.4f\n",
+         (double)cache_statistics.hits / cache_statistics.accesses);
+}
+
 
-    /* Do a cache access */ 
-    access_dm(cache, access_tag, access_index);
+static void print_hierarchy_statistics(const cache_sim_t* sim) {
+  /* Print the statistics of every level and the traffic between them */
+  printf("\nHierarchy Statistics\n");
+  printf("--------------------\n\n");
+  printf("%-6s %-14s %-14s %-14s %-9s %-16s %-16s %s\n", "Level", "Accesses", "Hits", "Misses",
+         "Hit Rate", "Bytes In", "Bytes Out", "Back Inval");
+  for (int level = 1; level <= MAX_CACHE_LEVELS; level++) {
+    cache_level_stat_t stats = cache_sim_level_stats(sim, level);
+    if (level > 1 && stats.accesses == 0 && stats.blocks_in == 0) {
+      if ((level == 2 ? sim->config.l2.size : sim->config.l3.size) == 0) break;
+    }
+    printf("L%-5d %-14" PRIu64 " %-14" PRIu64 " %-14" PRIu64 " %-9.4f %-16" PRIu64 " %-16" PRIu64
+           " %" PRIu64 "\n", level, stats.accesses, stats.hits, stats.accesses - stats.hits,
+           stats.accesses ? (double)stats.hits / stats.accesses : 0.0, stats.blocks_in * BLOCK_SIZE,
+           stats.blocks_out * BLOCK_SIZE, stats.back_invalidations);
   }
-  free(cache);
 }
 
 
-void dm_sc_cache(FILE* ptr_file) {
-  mem_access_t access;
+static void print_miss_classification(const cache_sim_t* sim) {
+  /* Print the L1 misses of each access type by cause */
+  static const char* type_names[] = {"Instruction", "Data"};
+  cache_miss_stat_t total = {0, 0, 0};
 
-  // Set cache size
-  uint32_t split_cache_size = cache_size / 2;
-  uint32_t num_of_cache_lines = cache_size / BLOCK_SIZE;
-  
-  // Set cache line structure
-  uint32_t index_num_of_bits = floor(log2(num_of_cache_lines));
-  const uint32_t BLOCK_OFFSET_NUM_OF_BITS = floor(log2(BLOCK_SIZE));  // 6 bits for indexing to 64B
-  uint32_t tag_num_of_bits = ADDRESS_SIZE - BLOCK_OFFSET_NUM_OF_BITS - index_num_of_bits;
+  printf("\nMiss Classification\n");
+  printf("-------------------\n\n");
+  printf("%-12s %-14s %-14s %-14s %s\n", "Stream", "Misses", "Compulsory", "Capacity", "Conflict");
+  for (int type = instruction; type <= data; type++) {
+    cache_miss_stat_t misses = cache_sim_miss_stats(sim, type);
+    printf("%-12s %-14" PRIu64 " %-14" PRIu64 " %-14" PRIu64 " %" PRIu64 "\n", type_names[type],
+           misses.compulsory + misses.capacity + misses.conflict, misses.compulsory, misses.capacity,
+           misses.conflict);
+    total.compulsory += misses.compulsory;
+    total.capacity += misses.capacity;
+    total.conflict += misses.conflict;
+  }
+  printf("%-12s %-14" PRIu64 " %-14" PRIu64 " %-14" PRIu64 " %" PRIu64 "\n", "Total",
+         total.compulsory + total.capacity + total.conflict, total.compulsory, total.capacity,
+         total.conflict);
+}
 
-  // Allocate memory for cache valid bit and tag storage
-  cache_line_t* instruction_cache = (cache_line_t*)calloc(num_of_cache_lines, sizeof(cache_line_t));
-  cache_line_t* data_cache = (cache_line_t*)calloc(num_of_cache_lines, sizeof(cache_line_t));
-  
-  // Generate mask bits
-  uint32_t index_mask = ((1 << index_num_of_bits) - 1);
-  uint32_t tag_mask = ((1 << tag_num_of_bits) - 1);
-  
-  /* Loop until whole trace file has been read */
-  while (1) {
-    access = read_transaction(ptr_file);
-    // If no transactions left, break out of loop
-    if (access.address == 0) break;
-    
-    // Move the relevant bits for tag and index to the right and mask them
-    uint32_t access_tag = (access.address >> (BLOCK_OFFSET_NUM_OF_BITS + index_num_of_bits)) & tag_mask;
-    uint32_t access_index = (access.address >> BLOCK_OFFSET_NUM_OF_BITS) & index_mask;
 
-    /* Do a cache access */
-    if (access.accesstype == instruction) { 
-      access_dm(instruction_cache, access_tag, access_index);
-    } else if (access.accesstype == data) {
-      access_dm(data_cache, access_tag, access_index);
-    } 
+static void print_traffic_statistics(const cache_sim_t* sim) {
+  /* Print the stores and the bytes every level read from and wrote to the
+   * one below, the last level to memory. Lines still dirty at the end have
+   * not been written.
+   */
+  cache_stream_stat_t stores = cache_sim_stream_stats(sim, data);
+  printf("\nMemory Traffic\n");
+  printf("--------------\n\n");
+  printf("Write policy: %s, %s\n", write_policy_names[sim->config.write_policy],
+         write_miss_policy_names[sim->config.write_miss_policy]);
+  printf("Stores:       %" PRIu64 " of %" PRIu64 " data accesses, %" PRIu64 " missed L1\n\n",
+         stores.writes, stores.accesses, stores.write_misses);
+  printf("%-6s %-16s %-16s %-14s %s\n", "Level", "Bytes Read", "Bytes Written", "Writebacks",
+         "Dirty Lines");
+  for (uint32_t level = 1; level <= sim->num_levels; level++) {
+    cache_level_stat_t stats = cache_sim_level_stats(sim, level);
+    printf("L%-5u %-16" PRIu64 " %-16" PRIu64 " %-14" PRIu64 " %" PRIu64 "\n", level, stats.bytes_read,
+           stats.bytes_written, stats.writebacks, stats.dirty_lines);
   }
-  free(instruction_cache);
-  free(data_cache);
 }
 
 
-void fa_uc_cache(FILE* ptr_file) {
-  mem_access_t access;
+static void print_coherence_statistics(const multi_core_t* mc) {
+  /* Print the requests each core sent to the directory and what they did to
+   * the other cores. Coherence misses are misses on lines another core had
+   * invalidated, transfers are fills another cache supplied instead of memory.
+   */
+  printf("\nCoherence\n");
+  printf("---------\n\n");
+  printf("Protocol: %s, %" PRIu32 " cores, ", mc->protocol == moesi ? "MOESI" : "MESI",
+         mc->num_cores);
+  if (num_sim_threads > 1 && mc->num_cores > 1) {
+    printf("one thread per core\n\n");
+  } else {
+    printf("round robin, %" PRIu32 " accesses per core per turn\n\n", mc->interleave);
+  }
+  printf("%-6s %-12s %-12s %-9s %-12s %-12s %-12s %-12s %-12s %-12s %s\n", "Core", "Accesses",
+         "Hits", "Hit Rate", "Coherence", "Invalidated", "Bus Reads", "Bus RdX", "Upgrades",
+         "Writebacks", "Transfers");
+  core_stat_t total;
+  memset(&total, 0, sizeof(total));
+  for (uint32_t core = 0; core <= mc->num_cores; core++) {
+    core_stat_t stats = total;
+    char name[16] = "Total";
+    if (core < mc->num_cores) {
+      stats = core_stats(mc, core);
+      snprintf(name, sizeof(name), "%" PRIu32, core);
+      total.accesses += stats.accesses;
+      total.hits += stats.hits;
+      total.writebacks += stats.writebacks;
+      total.coherence.coherence_misses += stats.coherence.coherence_misses;
+      total.coherence.invalidations += stats.coherence.invalidations;
+      total.coherence.bus_reads += stats.coherence.bus_reads;
+      total.coherence.bus_read_exclusives += stats.coherence.bus_read_exclusives;
+      total.coherence.upgrades += stats.coherence.upgrades;
+      total.coherence.transfers += stats.coherence.transfers;
+    }
+    printf("%-6s %-12" PRIu64 " %-12" PRIu64 " %-9.4f %-12" PRIu64 " %-12" PRIu64 " %-12" PRIu64
+           " %-12" PRIu64 " %-12" PRIu64 " %-12" PRIu64 " %" PRIu64 "\n", name, stats.accesses,
+           stats.hits, stats.accesses ? (double)stats.hits / stats.accesses : 0.0,
+           stats.coherence.coherence_misses, stats.coherence.invalidations, stats.coherence.bus_reads,
+           stats.coherence.bus_read_exclusives, stats.coherence.upgrades, stats.writebacks,
+           stats.coherence.transfers);
+  }
+}
 
-  // Set cache size and cacheline structure
-  uint32_t num_of_cache_lines = cache_size / BLOCK_SIZE;
 
-  const uint32_t BLOCK_OFFSET_NUM_OF_BITS = floor(log2(BLOCK_SIZE));  // 6 bits for indexing to 64B
-  uint32_t tag_num_of_bits = ADDRESS_SIZE - BLOCK_OFFSET_NUM_OF_BITS;
+static void print_phase_statistics(const phase_detector_t* phases) {
+  /* Print the phases with their representative windows, and the hit rate
+   * the representatives estimate for the whole trace, each weighted by the
+   * accesses of its phase. Only the first boundaries are listed, the window
+   * CSV marks all of them.
+   */
+  uint64_t total = 0;
+  uint32_t boundaries = 0;
+  for (uint64_t index = 0; index < phases->num_windows; index++) {
+    total += phases->windows[index].accesses;
+    boundaries += index > 0 && phases->windows[index].phase != phases->windows[index - 1].phase;
+  }
+  printf("\nPhases\n");
+  printf("------\n\n");
+  printf("Windows:    %" PRIu64 " of %" PRIu64 " accesses\n", phases->num_windows, phases->window);
+  printf("Phases:     %" PRIu32 ", %" PRIu32 " boundaries\n", phases->num_phases, boundaries);
+  if (boundaries > 0) {
+    printf("Boundaries:");
+    uint32_t listed = 0;
+    for (uint64_t index = 1; index < phases->num_windows && listed < 16; index++) {
+      if (phases->windows[index].phase == phases->windows[index - 1].phase) continue;
+      printf(" %" PRIu64 ":%" PRIu32 "->%" PRIu32, index, phases->windows[index - 1].phase,
+             phases->windows[index].phase);
+      listed++;
+    }
+    printf("%s\n", boundaries > listed ? " ..." : "");
+  }
+  printf("\n%-6s %-9s %-14s %-9s %-15s %-14s %s\n", "Phase", "Windows", "Accesses", "Hit Rate",
+         "Representative", "Start Access", "Its Hit Rate");
+  double estimate = 0.0;
+  for (uint32_t phase = 0; phase < phases->num_phases; phase++) {
+    uint64_t accesses = 0, hits = 0;
+    for (uint64_t index = 0; index < phases->num_windows; index++) {
+      if (phases->windows[index].phase != phase) continue;
+      accesses += phases->windows[index].accesses;
+      hits += phases->windows[index].hits;
+    }
+    uint64_t representative = phase_representative(phases, phase);
+    const window_stat_t* window = &phases->windows[representative];
+    double rate = window->accesses ? (double)window->hits / window->accesses : 0.0;
+    estimate += total ? rate * accesses / total : 0.0;
+    printf("%-6" PRIu32 " %-9" PRIu64 " %-14" PRIu64 " %-9.4f %-15" PRIu64 " %-14" PRIu64 " %.4f\n",
+           phase, phases->members[phase], accesses, accesses ? (double)hits / accesses : 0.0,
+           representative, representative * phases->window, rate);
+  }
+  printf("\nHit rate estimated from the representatives: %.4f\n", estimate);
+}
 
-  // Allocate memory for cache valid bit and tag storage
-  uint32_t* cache = (uint32_t*)calloc(num_of_cache_lines, sizeof(uint32_t));
-  
-  // Generate mask bits
-  uint32_t tag_mask = ((1 << tag_num_of_bits) - 1);
-  
-  /* Loop until whole trace file has been read */
-  while (1) {
-    access = read_transaction(ptr_file);
-    // If no transactions left, break out of loop
-    if (access.address == 0) break;
-    
-    // Move the relevant bits for tag and index to the right and mask them
-    uint32_t access_tag = (access.address >> (BLOCK_OFFSET_NUM_OF_BITS)) & tag_mask;
 
-    /* Do a cache access */ 
-    access_fa(cache, access_tag, num_of_cache_lines, access.accesstype);
+static void print_prefetch_statistics(const cache_sim_t* sim) {
+  /* Print what the prefetches of each access type did. Accuracy is the share
+   * of fills that were used, coverage the share of the misses without
+   * prefetching that the used fills saved. Late fills were used within
+   * PREFETCH_LATE_ACCESSES accesses, the distance is their mean fill to use.
+   */
+  static const char* type_names[] = {"Instruction", "Data"};
+  printf("\nPrefetching\n");
+  printf("-----------\n\n");
+  printf("Prefetcher: %s, degree %" PRIu32 "\n\n", prefetcher_names[sim->config.prefetcher],
+         sim->config.prefetch_degree);
+  printf("%-12s %-12s %-12s %-12s %-12s %-9s %-9s %-9s %-9s %-12s %s\n", "Stream", "Issued", "Fills",
+         "Useful", "Unused", "Accuracy", "Coverage", "Late", "Distance", "Evicted", "Polluting");
+  for (int type = instruction; type <= data; type++) {
+    cache_prefetch_stat_t stats = cache_sim_prefetch_stats(sim, type);
+    cache_stream_stat_t stream = cache_sim_stream_stats(sim, type);
+    printf("%-12s %-12" PRIu64 " %-12" PRIu64 " %-12" PRIu64 " %-12" PRIu64 " %-9.4f %-9.4f %-9.4f"
+           " %-9.1f %-12" PRIu64 " %" PRIu64 "\n", type_names[type], stats.issued, stats.fills,
+           stats.useful, stats.unused, stats.fills ? (double)stats.useful / stats.fills : 0.0,
+           stats.useful ? (double)stats.useful / (stats.useful + stream.misses) : 0.0,
+           stats.useful ? (double)stats.late / stats.useful : 0.0,
+           stats.useful ? (double)stats.use_distance / stats.useful : 0.0, stats.evicted_lines,
+           stats.polluting_misses);
   }
-  free(cache);
 }
 
 
-void fa_sc_cache(FILE* ptr_file) {
-  mem_access_t access;
+static void format_tlb(char* out, size_t size, const cache_t* tlb) {
+  uint32_t entries = tlb->num_sets * tlb->num_ways;
+  if (tlb->num_sets == 1) {
+    snprintf(out, size, "%" PRIu32 " entries fully associative", entries);
+  } else {
+    snprintf(out, size, "%" PRIu32 " entries %" PRIu32 "-way", entries, tlb->num_ways);
+  }
+}
 
-  // Set cache size
-  uint32_t split_cache_size = cache_size / 2;
-  uint32_t num_of_cache_lines = cache_size / BLOCK_SIZE;
-  
-  // Set cache line structure
-  const uint32_t BLOCK_OFFSET_NUM_OF_BITS = floor(log2(BLOCK_SIZE));  // 6 bits for indexing to 64B
-  uint32_t tag_num_of_bits = ADDRESS_SIZE - BLOCK_OFFSET_NUM_OF_BITS;
+static void print_tlb_statistics(const cache_sim_t* sim) {
+  /* Print the TLB geometry and where the translations of each access type
+   * ended: in its own TLB, in the L2 TLB or in a page walk
+   */
+  static const char* type_names[] = {"Instruction", "Data"};
+  char geometry[64];
+  printf("\nTLBs\n");
+  printf("----\n\n");
+  printf("Page size: %" PRIu64 " KiB\n", ((uint64_t)1 << sim->config.page_bits) / 1024);
+  const cache_t* tlbs[] = {sim->tlbs[instruction], sim->tlbs[data], sim->l2_tlb};
+  const char* names[] = {"ITLB", "DTLB", "L2 TLB"};
+  for (int i = 0; i < 3; i++) {
+    if (!tlbs[i]) continue;
+    format_tlb(geometry, sizeof(geometry), tlbs[i]);
+    printf("%-10s %s\n", names[i], geometry);
+  }
+  printf("\n%-12s %-12s %-12s %-9s %-12s %-12s %s\n", "Stream", "Accesses", "Hits", "Hit Rate",
+         "L2 Hits", "Walks", "Walks/1K");
+  for (int type = instruction; type <= data; type++) {
+    if (!sim->tlbs[type]) continue;
+    cache_tlb_stat_t stats = cache_sim_tlb_stats(sim, type);
+    printf("%-12s %-12" PRIu64 " %-12" PRIu64 " %-9.4f %-12" PRIu64 " %-12" PRIu64 " %.3f\n",
+           type_names[type], stats.accesses, stats.hits,
+           stats.accesses ? (double)stats.hits / stats.accesses : 0.0, stats.l2_hits, stats.walks,
+           stats.accesses ? 1000.0 * stats.walks / stats.accesses : 0.0);
+  }
+}
 
-  // Allocate memory for cache valid bit and tag storage
-  uint32_t* instruction_cache = (uint32_t*)calloc(num_of_cache_lines, sizeof(uint32_t));
-  uint32_t* data_cache = (uint32_t*)calloc(num_of_cache_lines, sizeof(uint32_t));
-  
-  // Generate mask bits
-  uint32_t tag_mask = ((1 << tag_num_of_bits) - 1);
-  
-  /* Loop until whole trace file has been read */
-  while (1) {
-    access = read_transaction(ptr_file);
-    // If no transactions left, break out of loop
-    if (access.address == 0) break;
-    
-    // Move the relevant bits for tag and index to the right and mask them
-    uint32_t access_tag = (access.address >> (BLOCK_OFFSET_NUM_OF_BITS)) & tag_mask;
 
-    /* Do a cache access */
-    if (access.accesstype == instruction) { 
-      access_fa(instruction_cache, access_tag, num_of_cache_lines, access.accesstype);
-    } else if (access.accesstype == data) {
-      access_fa(data_cache, access_tag, num_of_cache_lines, access.accesstype);
-    } 
+static void print_timing_statistics(const cache_sim_t* sim) {
+  /* Print the AMAT of each access type, where the cycles went and how the
+   * latencies spread
+   */
+  static const char* type_names[] = {"Instruction", "Data"};
+  static const char* level_names[] = {"L1", "L2", "L3", "Memory"};
+  const timing_config_t* config = &sim->config.timing;
+  cache_timing_stat_t stats = cache_sim_timing_stats(sim);
+  uint64_t accesses = stats.accesses[instruction] + stats.accesses[data];
+  uint64_t latency = stats.latency[instruction] + stats.latency[data];
+
+  printf("\nTiming\n");
+  printf("------\n\n");
+  printf("Latencies: ");
+  for (uint32_t level = 0; level < sim->num_levels; level++) {
+    printf("%s %" PRIu32 ", ", level_names[level], config->hit_latency[level]);
+  }
+  printf("memory %" PRIu32 " cycles\n", config->memory_latency);
+  if (config->bytes_per_cycle > 0) {
+    printf("Memory:    %" PRIu32 " bytes per cycle\n", config->bytes_per_cycle);
+  } else {
+    printf("Memory:    unlimited bandwidth\n");
+  }
+  if (config->mshrs > 0) {
+    printf("MSHRs:     %" PRIu32 "\n\n", config->mshrs);
+  } else {
+    printf("MSHRs:     none, L1 blocks on every miss\n\n");
+  }
+
+  printf("AMAT:             %.3f cycles\n", accesses ? (double)latency / accesses : 0.0);
+  for (int type = instruction; type <= data; type++) {
+    if (stats.accesses[type] == 0) continue;
+    printf("  %-15s %.3f cycles\n", type_names[type],
+           (double)stats.latency[type] / stats.accesses[type]);
+  }
+  printf("Cycles:           %" PRIu64 "\n", stats.cycles);
+  printf("Stall cycles:     %" PRIu64 " (%.2f%%)\n", stats.stall_cycles,
+         stats.cycles ? 100.0 * stats.stall_cycles / stats.cycles : 0.0);
+  printf("Bandwidth wait:   %" PRIu64 " cycles\n", stats.bandwidth_cycles);
+  printf("MSHR wait:        %" PRIu64 " cycles\n\n", stats.mshr_cycles);
+
+  printf("%-8s %-14s %s\n", "Level", "Cycles", "Share of latency");
+  for (uint32_t level = 0; level <= MAX_CACHE_LEVELS; level++) {
+    if (level >= sim->num_levels && level < MAX_CACHE_LEVELS) continue;
+    printf("%-8s %-14" PRIu64 " %.4f\n", level_names[level], stats.level_cycles[level],
+           latency ? (double)stats.level_cycles[level] / latency : 0.0);
+  }
+
+  printf("\n%-14s %-14s %s\n", "Latency", "Accesses", "Share");
+  int last = CACHE_SIM_LATENCY_BUCKETS - 1;
+  while (last > 0 && stats.histogram[last] == 0) last--;
+  for (int bucket = 0; bucket <= last; bucket++) {
+    char range[32];
+    if (bucket == CACHE_SIM_LATENCY_BUCKETS - 1) {
+      snprintf(range, sizeof(range), "%" PRIu64 "+", (uint64_t)1 << bucket);
+    } else {
+      snprintf(range, sizeof(range), "%" PRIu64 "-%" PRIu64, (uint64_t)1 << bucket,
+               ((uint64_t)2 << bucket) - 1);
+    }
+    printf("%-14s %-14" PRIu64 " %.4f\n", range, stats.histogram[bucket],
+           accesses ? (double)stats.histogram[bucket] / accesses : 0.0);
   }
-  free(instruction_cache);
-  free(data_cache);
 }
 
 
-void access_dm(cache_line_t* cache, uint32_t access_tag, uint32_t access_index) {
-  if (cache[access_index].valid && (access_tag == cache[access_index].tag)) {
-    // Hit!
-    cache_statistics.hits++;
+// Two sided 95% quantile of Student's t distribution
+static double student_t_95(int degrees) {
+  static const double quantiles[] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306,
+                                     2.262,  2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120,
+                                     2.110,  2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064,
+                                     2.060,  2.056, 2.052, 2.048, 2.045, 2.042};
+  return degrees <= 30 ? quantiles[degrees - 1] : 1.96;
+}
+
+static void print_sampling_statistics(const set_sampling_t* sampling) {
+  /* Print the sample and the 95% confidence interval of the hit rate. The
+   * variance is that of a ratio estimator over the sample groups, with the
+   * finite population correction for sampling sets without replacement, and
+   * the interval uses the t distribution since there are few groups.
+   */
+  uint64_t accesses = 0, hits = 0;
+  for (int group = 0; group < SAMPLE_GROUPS; group++) {
+    accesses += sampling->groups[group].accesses;
+    hits += sampling->groups[group].hits;
+  }
+  double rate = accesses ? (double)hits / accesses : 0.0;
+
+  int groups = 0;
+  double squares = 0.0;
+  for (int group = 0; group < SAMPLE_GROUPS; group++) {
+    if (sampling->groups[group].accesses == 0) continue;
+    double residual = sampling->groups[group].hits - rate * sampling->groups[group].accesses;
+    squares += residual * residual;
+    groups++;
+  }
+  double fraction = (double)sampling->sampled_sets / sampling->total_sets;
+  double variance = groups > 1 && accesses
+                        ? (1.0 - fraction) * groups / (groups - 1.0) * squares / ((double)accesses * accesses)
+                        : 0.0;
+
+  printf("\nSet Sampling\n");
+  printf("------------\n\n");
+  printf("Sampled sets:     %" PRIu64 " of %" PRIu64 " (%.2f%%)\n", sampling->sampled_sets,
+         sampling->total_sets, 100.0 * fraction);
+  printf("Sampled accesses: %" PRIu64 " of %" PRIu64 "\n", accesses,
+         accesses + sampling->skipped_accesses);
+  if (groups > 1) {
+    printf("Hit Rate:         %.4f +- %.4f (95%% confidence)\n", rate,
+           student_t_95(groups - 1) * sqrt(variance));
   } else {
-    // No hit
-    cache[access_index].tag = access_tag;
-    cache[access_index].valid = 1;
+    printf("Hit Rate:         %.4f (too few sampled sets for a confidence interval)\n", rate);
   }
-  cache_statistics.accesses++;
 }
 
 
-void access_fa(uint32_t* cache, uint32_t access_tag, uint32_t num_of_cache_lines, access_t accesstype) {
-  /* Do a cache access for a fully associative cache */
-  uint8_t hit_flag = 0;
+/* Bytes of the arrays behind a cache, see create_cache() */
+static size_t cache_bytes(const cache_t* cache) {
+  size_t lines = (size_t)cache->num_sets * cache->num_ways;
+  size_t bytes = ((lines * sizeof(uint32_t) + 63) & ~(size_t)63) +
+                 (size_t)cache->num_sets * (cache->valid_words + cache->policy_words) * sizeof(uint64_t);
+  if (cache->fa_index) {
+    bytes += (cache->fa_index_mask + 1ull) * sizeof(uint64_t) + 4 * lines * sizeof(uint32_t);
+  }
+  if (cache->dirty) {
+    bytes += (size_t)cache->num_sets * cache->valid_words * sizeof(uint64_t);
+  }
+  if (cache->set_misses) {
+    bytes += cache->num_sets * sizeof(uint64_t);
+  }
+  return bytes;
+}
 
-  for (uint32_t i = 0; i < num_of_cache_lines; i++) {
-    if (cache[i] == access_tag) {
-      cache_statistics.hits++;
-      hit_flag = 1;
-      break;
-    } else if (cache[i] == 0) {
-      break;
+/* Simulator state of every cache. The seen bitmaps of miss classification
+ * and the block bitmaps of prefetching are left out, only the pages of
+ * blocks the trace touches are ever backed.
+ */
+static size_t sim_state_bytes(const cache_sim_t* sim) {
+  size_t bytes = sizeof(cache_sim_t);
+  for (int type = instruction; type <= data; type++) {
+    if (type == data && sim->caches[data] == sim->caches[instruction]) break;
+    bytes += cache_bytes(sim->caches[type]);
+    if (sim->shadows[type]) bytes += cache_bytes(sim->shadows[type]);
+    if (sim->prefetch_stamps[type]) {
+      bytes += (size_t)sim->caches[type]->num_sets * sim->caches[type]->valid_words * 64 *
+               sizeof(uint64_t);
+    }
+  }
+  for (uint32_t level = 1; level < sim->num_levels; level++) {
+    bytes += cache_bytes(sim->levels[level]);
+  }
+  const cache_t* tlbs[] = {sim->tlbs[instruction], sim->tlbs[data], sim->l2_tlb};
+  for (int i = 0; i < 3; i++) {
+    if (tlbs[i]) bytes += cache_bytes(tlbs[i]);
+  }
+  return bytes;
+}
+
+// Bytes of the caches and of the directory pages in use
+static size_t multi_core_bytes(const multi_core_t* mc) {
+  size_t bytes = sizeof(multi_core_t) + mc->num_agents * sizeof(coherent_cache_t) +
+                 mc->directory_pages * sizeof(*mc->directory);
+  for (uint32_t id = 0; id < mc->num_agents; id++) {
+    const cache_t* cache = mc->agents[id].cache;
+    bytes += cache_bytes(cache) + (size_t)cache->num_sets * cache->valid_words * sizeof(uint64_t);
+  }
+  for (uint64_t page = 0; page < mc->directory_pages; page++) {
+    if (mc->directory[page]) {
+      bytes += ((size_t)1 << DIRECTORY_PAGE_BITS) * sizeof(directory_entry_t);
+    }
+  }
+  return bytes;
+}
+
+/* Fills the caches of every level in report order with their names, L1 or
+ * its split halves first. Returns how many there are.
+ */
+static int report_caches(const cache_sim_t* sim, const cache_t* caches[], const char* names[]) {
+  static const char* level_names[] = {"L1", "L2", "L3"};
+  int n = 0;
+  if (sim->caches[data] == sim->caches[instruction]) {
+    caches[n] = sim->caches[instruction];
+    names[n++] = "L1";
+  } else {
+    caches[n] = sim->caches[instruction];
+    names[n++] = "L1I";
+    caches[n] = sim->caches[data];
+    names[n++] = "L1D";
+  }
+  for (uint32_t level = 1; level < sim->num_levels; level++) {
+    caches[n] = sim->levels[level];
+    names[n++] = level_names[level];
+  }
+  return n;
+}
+
+static void write_json_string(FILE* out, const char* string) {
+  fputc('"', out);
+  for (const unsigned char* c = (const unsigned char*)string; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      fprintf(out, "\\%c", *c);
+    } else if (*c < 0x20) {
+      fprintf(out, "\\u%04x", *c);
+    } else {
+      fputc(*c, out);
     }
   }
+  fputc('"', out);
+}
+
+static long peak_rss_kib(void) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+static void write_json_report(FILE* out, const run_report_t* report) {
+  /* Write the configuration, the statistics of every stream and cache, and
+   * where the time and memory of the run went, as one JSON object
+   */
+  const cache_config_t* config = report->config;
+  const cache_stat_t* stats = &report->stats;
+  double simulate_seconds = report->total_seconds - report->decode_seconds;
 
-  if (!hit_flag) {
-    if (cache_org == uc) {
-      static uint32_t fifo_index_uc = 0;
-      cache[fifo_index_uc] = access_tag;
+  fprintf(out, "{\n  \"config\": {\"size\": %" PRIu32 ", \"mapping\": \"%s\", \"ways\": %" PRIu32
+          ", \"organization\": \"%s\", \"policy\": \"%s\", \"l2_size\": %" PRIu32 ", \"l3_size\": %"
+          PRIu32 ", \"write_policy\": \"%s\", \"write_miss_policy\": \"%s\", \"prefetcher\": \"%s\", "
+          "\"prefetch_degree\": %" PRIu32 ", \"itlb_entries\": %" PRIu32 ", \"dtlb_entries\": %"
+          PRIu32 ", \"l2_tlb_entries\": %" PRIu32 ", \"page_bits\": %" PRIu32 ", \"threads\": %"
+          PRIu32 ", \"sample_rate\": %" PRIu32 ", \"trace\": ",
+          config->size, mapping_names[config->mapping], cache_config_ways(config),
+          org_names[config->org], policy_names[config->policy], config->l2.size, config->l3.size,
+          write_policy_names[config->write_policy],
+          write_miss_policy_names[config->write_miss_policy], prefetcher_names[config->prefetcher],
+          report->sim ? report->sim->config.prefetch_degree : 0, config->itlb.entries,
+          config->dtlb.entries, config->l2_tlb.entries,
+          report->sim ? report->sim->config.page_bits : 0, num_sim_threads, sample_rate);
+  write_json_string(out, report->trace);
+  fprintf(out, "},\n");
+  fprintf(out, "  \"accesses\": %" PRIu64 ",\n  \"hits\": %" PRIu64 ",\n  \"misses\": %" PRIu64
+          ",\n  \"hit_rate\": %.6f,\n", stats->accesses, stats->hits, stats->accesses - stats->hits,
+          stats->accesses ? (double)stats->hits / stats->accesses : 0.0);
 
-      fifo_index_uc++;
-      if (fifo_index_uc == num_of_cache_lines) {
-        fifo_index_uc = 0;
+  if (report->sim) {
+    static const char* type_names[] = {"instruction", "data"};
+    fprintf(out, "  \"streams\": {");
+    for (int type = instruction; type <= data; type++) {
+      cache_stream_stat_t stream = cache_sim_stream_stats(report->sim, type);
+      fprintf(out, "%s\n    \"%s\": {\"accesses\": %" PRIu64 ", \"hits\": %" PRIu64 ", \"misses\": %"
+              PRIu64 ", \"evictions\": %" PRIu64 ", \"cold_fills\": %" PRIu64 ", \"writes\": %"
+              PRIu64 ", \"write_misses\": %" PRIu64,
+              type == instruction ? "" : ",", type_names[type], stream.accesses, stream.hits,
+              stream.misses, stream.evictions, stream.cold_fills, stream.writes, stream.write_misses);
+      if (config->prefetcher != no_prefetch) {
+        cache_prefetch_stat_t prefetch = cache_sim_prefetch_stats(report->sim, type);
+        fprintf(out, ",\n     \"prefetch\": {\"issued\": %" PRIu64 ", \"fills\": %" PRIu64
+                ", \"useful\": %" PRIu64 ", \"unused\": %" PRIu64 ", \"pending\": %" PRIu64
+                ", \"late\": %" PRIu64 ", \"use_distance\": %" PRIu64 ", \"evicted_lines\": %"
+                PRIu64 ", \"polluting_misses\": %" PRIu64 "}",
+                prefetch.issued, prefetch.fills, prefetch.useful, prefetch.unused, prefetch.pending,
+                prefetch.late, prefetch.use_distance, prefetch.evicted_lines,
+                prefetch.polluting_misses);
+      }
+      if (report->sim->tlbs[type]) {
+        cache_tlb_stat_t tlb = cache_sim_tlb_stats(report->sim, type);
+        fprintf(out, ",\n     \"tlb\": {\"accesses\": %" PRIu64 ", \"hits\": %" PRIu64
+                ", \"l2_hits\": %" PRIu64 ", \"walks\": %" PRIu64 "}",
+                tlb.accesses, tlb.hits, tlb.l2_hits, tlb.walks);
       }
-    } else if(accesstype == instruction) {
-      static uint32_t fifo_index_instruction = 0;
-      cache[fifo_index_instruction] = access_tag;
-      fifo_index_instruction++;
-      if (fifo_index_instruction == num_of_cache_lines) {
-        fifo_index_instruction = 0;
+      fprintf(out, "}");
+    }
+    fprintf(out, "\n  },\n  \"traffic\": [");
+    for (uint32_t level = 1; level <= report->sim->num_levels; level++) {
+      cache_level_stat_t traffic = cache_sim_level_stats(report->sim, level);
+      fprintf(out, "%s\n    {\"level\": %" PRIu32 ", \"bytes_read\": %" PRIu64 ", \"bytes_written\": %"
+              PRIu64 ", \"writebacks\": %" PRIu64 ", \"dirty_lines\": %" PRIu64 "}",
+              level == 1 ? "" : ",", level, traffic.bytes_read, traffic.bytes_written,
+              traffic.writebacks, traffic.dirty_lines);
+    }
+    if (config->timing.hit_latency[0] > 0) {
+      cache_timing_stat_t timing = cache_sim_timing_stats(report->sim);
+      uint64_t accesses = timing.accesses[instruction] + timing.accesses[data];
+      uint64_t latency = timing.latency[instruction] + timing.latency[data];
+      fprintf(out, "\n  ],\n  \"cycles\": {\"amat\": %.6f, \"instruction_amat\": %.6f, "
+              "\"data_amat\": %.6f, \"cycles\": %" PRIu64 ", \"stall_cycles\": %" PRIu64
+              ", \"bandwidth_cycles\": %" PRIu64 ", \"mshr_cycles\": %" PRIu64
+              ",\n    \"level_cycles\": [%" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64
+              "], \"latency_histogram\": [",
+              accesses ? (double)latency / accesses : 0.0,
+              timing.accesses[instruction]
+                  ? (double)timing.latency[instruction] / timing.accesses[instruction] : 0.0,
+              timing.accesses[data] ? (double)timing.latency[data] / timing.accesses[data] : 0.0,
+              timing.cycles, timing.stall_cycles, timing.bandwidth_cycles, timing.mshr_cycles,
+              timing.level_cycles[0], timing.level_cycles[1], timing.level_cycles[2],
+              timing.level_cycles[3]);
+      for (int bucket = 0; bucket < CACHE_SIM_LATENCY_BUCKETS; bucket++) {
+        fprintf(out, "%s%" PRIu64, bucket == 0 ? "" : ", ", timing.histogram[bucket]);
       }
-    } else if (accesstype == data) {
-      static uint32_t fifo_index_data = 0;
-      cache[fifo_index_data] = access_tag;
-      fifo_index_data++;
-      if (fifo_index_data == num_of_cache_lines) {
-        fifo_index_data = 0;
+      fprintf(out, "]}");
+    } else {
+      fprintf(out, "\n  ]");
+    }
+    fprintf(out, ",\n  \"caches\": [");
+
+    const cache_t* caches[MAX_CACHE_LEVELS + 1];
+    const char* names[MAX_CACHE_LEVELS + 1];
+    int num_caches = report_caches(report->sim, caches, names);
+    for (int i = 0; i < num_caches; i++) {
+      const cache_t* cache = caches[i];
+      fprintf(out, "%s\n    {\"name\": \"%s\", \"accesses\": %" PRIu64 ", \"hits\": %" PRIu64
+              ", \"misses\": %" PRIu64 ", \"evictions\": %" PRIu64 ", \"cold_fills\": %" PRIu64
+              ", \"writebacks\": %" PRIu64 ", \"stores\": %" PRIu64,
+              i == 0 ? "" : ",", names[i], cache->stats.accesses, cache->stats.hits,
+              cache->stats.accesses - cache->stats.hits, cache_evictions(cache),
+              cache->cold_fills + cache->prefetch_cold_fills, cache->writebacks, cache->stores);
+      if (cache->set_misses) {
+        fprintf(out, ",\n     \"set_misses\": [");
+        for (uint32_t set = 0; set < cache->num_sets; set++) {
+          fprintf(out, "%s%" PRIu64, set == 0 ? "" : ", ", cache->set_misses[set]);
+        }
+        fprintf(out, "]");
       }
+      fprintf(out, "}");
+    }
+    fprintf(out, "\n  ],\n");
+  }
+  if (report->mc) {
+    const multi_core_t* mc = report->mc;
+    fprintf(out, "  \"coherence\": {\"protocol\": \"%s\", \"interleave\": %" PRIu32
+            ", \"threaded\": %s, \"cores\": [", coherence_names[mc->protocol], mc->interleave,
+            num_sim_threads > 1 && mc->num_cores > 1 ? "true" : "false");
+    for (uint32_t core = 0; core < mc->num_cores; core++) {
+      core_stat_t stats = core_stats(mc, core);
+      fprintf(out, "%s\n    {\"trace\": ", core == 0 ? "" : ",");
+      write_json_string(out, trace_file_names[core]);
+      fprintf(out, ", \"accesses\": %" PRIu64 ", \"hits\": %" PRIu64 ", \"coherence_misses\": %"
+              PRIu64 ", \"bus_reads\": %" PRIu64 ", \"bus_read_exclusives\": %" PRIu64
+              ", \"upgrades\": %" PRIu64 ", \"invalidations\": %" PRIu64 ", \"transfers\": %"
+              PRIu64 ", \"writebacks\": %" PRIu64 "}",
+              stats.accesses, stats.hits, stats.coherence.coherence_misses, stats.coherence.bus_reads,
+              stats.coherence.bus_read_exclusives, stats.coherence.upgrades,
+              stats.coherence.invalidations, stats.coherence.transfers, stats.writebacks);
+    }
+    fprintf(out, "\n  ]},\n");
+  }
+  if (report->phases) {
+    const phase_detector_t* phases = report->phases;
+    fprintf(out, "  \"phases\": {\"window\": %" PRIu64 ", \"windows\": %" PRIu64 ", \"window_phases\": [",
+            phases->window, phases->num_windows);
+    for (uint64_t index = 0; index < phases->num_windows; index++) {
+      fprintf(out, "%s%" PRIu32, index == 0 ? "" : ", ", phases->windows[index].phase);
+    }
+    fprintf(out, "],\n    \"phases\": [");
+    for (uint32_t phase = 0; phase < phases->num_phases; phase++) {
+      uint64_t representative = phase_representative(phases, phase);
+      const window_stat_t* window = &phases->windows[representative];
+      fprintf(out, "%s\n      {\"phase\": %" PRIu32 ", \"windows\": %" PRIu64
+              ", \"representative\": %" PRIu64 ", \"start\": %" PRIu64 ", \"accesses\": %" PRIu64
+              ", \"hits\": %" PRIu64 "}", phase == 0 ? "" : ",", phase, phases->members[phase],
+              representative, representative * phases->window, window->accesses, window->hits);
     }
-    hit_flag = 0;
+    fprintf(out, "\n  ]},\n");
   }
-  cache_statistics.accesses++;
+
+  fprintf(out, "  \"timing\": {\"decode_seconds\": %.6f, \"simulate_seconds\": %.6f, "
+          "\"total_seconds\": %.6f, \"accesses_per_second\": %.0f},\n", report->decode_seconds,
+          simulate_seconds, report->total_seconds,
+          report->total_seconds > 0 ? stats->accesses / report->total_seconds : 0.0);
+  fprintf(out, "  \"memory\": {\"peak_rss_kib\": %ld, \"state_bytes\": %zu}\n}\n", peak_rss_kib(),
+          report->state_bytes);
 }
 
+static void write_csv_report(FILE* out, const run_report_t* report) {
+  /* Write the same numbers as write_json_report(), one per row */
+  const cache_stat_t* stats = &report->stats;
+  double simulate_seconds = report->total_seconds - report->decode_seconds;
 
-FILE* read_access_from_file(char *file_name){
-    /* Open the file mem_trace.txt to read memory accesses */
-  FILE* ptr_file;
-  ptr_file = fopen(file_name, "r");
-  if (!ptr_file) {
-    printf("Unable to open the trace file\n");
-    exit(1);
+  fprintf(out, "section,name,metric,value\n");
+  fprintf(out, "total,,accesses,%" PRIu64 "\n", stats->accesses);
+  fprintf(out, "total,,hits,%" PRIu64 "\n", stats->hits);
+  fprintf(out, "total,,misses,%" PRIu64 "\n", stats->accesses - stats->hits);
+  fprintf(out, "total,,hit_rate,%.6f\n", stats->accesses ? (double)stats->hits / stats->accesses : 0.0);
+
+  if (report->sim) {
+    static const char* type_names[] = {"instruction", "data"};
+    for (int type = instruction; type <= data; type++) {
+      cache_stream_stat_t stream = cache_sim_stream_stats(report->sim, type);
+      fprintf(out, "stream,%s,accesses,%" PRIu64 "\n", type_names[type], stream.accesses);
+      fprintf(out, "stream,%s,hits,%" PRIu64 "\n", type_names[type], stream.hits);
+      fprintf(out, "stream,%s,misses,%" PRIu64 "\n", type_names[type], stream.misses);
+      fprintf(out, "stream,%s,evictions,%" PRIu64 "\n", type_names[type], stream.evictions);
+      fprintf(out, "stream,%s,cold_fills,%" PRIu64 "\n", type_names[type], stream.cold_fills);
+      fprintf(out, "stream,%s,writes,%" PRIu64 "\n", type_names[type], stream.writes);
+      fprintf(out, "stream,%s,write_misses,%" PRIu64 "\n", type_names[type], stream.write_misses);
+      if (report->config->prefetcher != no_prefetch) {
+        cache_prefetch_stat_t prefetch = cache_sim_prefetch_stats(report->sim, type);
+        const char* metrics[] = {"issued", "fills", "useful", "unused", "pending", "late",
+                                 "use_distance", "evicted_lines", "polluting_misses"};
+        uint64_t values[] = {prefetch.issued, prefetch.fills, prefetch.useful, prefetch.unused,
+                             prefetch.pending, prefetch.late, prefetch.use_distance,
+                             prefetch.evicted_lines, prefetch.polluting_misses};
+        for (int i = 0; i < 9; i++) {
+          fprintf(out, "prefetch,%s,%s,%" PRIu64 "\n", type_names[type], metrics[i], values[i]);
+        }
+      }
+      if (report->sim->tlbs[type]) {
+        cache_tlb_stat_t tlb = cache_sim_tlb_stats(report->sim, type);
+        fprintf(out, "tlb,%s,accesses,%" PRIu64 "\n", type_names[type], tlb.accesses);
+        fprintf(out, "tlb,%s,hits,%" PRIu64 "\n", type_names[type], tlb.hits);
+        fprintf(out, "tlb,%s,l2_hits,%" PRIu64 "\n", type_names[type], tlb.l2_hits);
+        fprintf(out, "tlb,%s,walks,%" PRIu64 "\n", type_names[type], tlb.walks);
+      }
+    }
+    for (uint32_t level = 1; level <= report->sim->num_levels; level++) {
+      cache_level_stat_t traffic = cache_sim_level_stats(report->sim, level);
+      fprintf(out, "traffic,L%" PRIu32 ",bytes_read,%" PRIu64 "\n", level, traffic.bytes_read);
+      fprintf(out, "traffic,L%" PRIu32 ",bytes_written,%" PRIu64 "\n", level, traffic.bytes_written);
+      fprintf(out, "traffic,L%" PRIu32 ",writebacks,%" PRIu64 "\n", level, traffic.writebacks);
+      fprintf(out, "traffic,L%" PRIu32 ",dirty_lines,%" PRIu64 "\n", level, traffic.dirty_lines);
+    }
+    if (report->config->timing.hit_latency[0] > 0) {
+      static const char* level_names[] = {"L1", "L2", "L3", "memory"};
+      cache_timing_stat_t timing = cache_sim_timing_stats(report->sim);
+      uint64_t accesses = timing.accesses[instruction] + timing.accesses[data];
+      uint64_t latency = timing.latency[instruction] + timing.latency[data];
+      fprintf(out, "cycles,,amat,%.6f\n", accesses ? (double)latency / accesses : 0.0);
+      for (int type = instruction; type <= data; type++) {
+        fprintf(out, "cycles,%s,amat,%.6f\n", type_names[type],
+                timing.accesses[type] ? (double)timing.latency[type] / timing.accesses[type] : 0.0);
+      }
+      fprintf(out, "cycles,,cycles,%" PRIu64 "\n", timing.cycles);
+      fprintf(out, "cycles,,stall_cycles,%" PRIu64 "\n", timing.stall_cycles);
+      fprintf(out, "cycles,,bandwidth_cycles,%" PRIu64 "\n", timing.bandwidth_cycles);
+      fprintf(out, "cycles,,mshr_cycles,%" PRIu64 "\n", timing.mshr_cycles);
+      for (int level = 0; level <= MAX_CACHE_LEVELS; level++) {
+        fprintf(out, "cycles,%s,level_cycles,%" PRIu64 "\n", level_names[level],
+                timing.level_cycles[level]);
+      }
+      for (int bucket = 0; bucket < CACHE_SIM_LATENCY_BUCKETS; bucket++) {
+        fprintf(out, "latency_histogram,%" PRIu64 ",accesses,%" PRIu64 "\n", (uint64_t)1 << bucket,
+                timing.histogram[bucket]);
+      }
+    }
+
+    const cache_t* caches[MAX_CACHE_LEVELS + 1];
+    const char* names[MAX_CACHE_LEVELS + 1];
+    int num_caches = report_caches(report->sim, caches, names);
+    for (int i = 0; i < num_caches; i++) {
+      const cache_t* cache = caches[i];
+      fprintf(out, "cache,%s,accesses,%" PRIu64 "\n", names[i], cache->stats.accesses);
+      fprintf(out, "cache,%s,hits,%" PRIu64 "\n", names[i], cache->stats.hits);
+      fprintf(out, "cache,%s,misses,%" PRIu64 "\n", names[i], cache->stats.accesses - cache->stats.hits);
+      fprintf(out, "cache,%s,evictions,%" PRIu64 "\n", names[i], cache_evictions(cache));
+      fprintf(out, "cache,%s,cold_fills,%" PRIu64 "\n", names[i],
+              cache->cold_fills + cache->prefetch_cold_fills);
+      fprintf(out, "cache,%s,writebacks,%" PRIu64 "\n", names[i], cache->writebacks);
+      fprintf(out, "cache,%s,stores,%" PRIu64 "\n", names[i], cache->stores);
+    }
+    // Set histograms last, they are by far the longest part
+    for (int i = 0; i < num_caches; i++) {
+      if (!caches[i]->set_misses) continue;
+      for (uint32_t set = 0; set < caches[i]->num_sets; set++) {
+        fprintf(out, "set_misses,%s,%" PRIu32 ",%" PRIu64 "\n", names[i], set, caches[i]->set_misses[set]);
+      }
+    }
+  }
+  if (report->mc) {
+    const char* metrics[] = {"accesses", "hits", "coherence_misses", "bus_reads",
+                             "bus_read_exclusives", "upgrades", "invalidations", "transfers",
+                             "writebacks"};
+    for (uint32_t core = 0; core < report->mc->num_cores; core++) {
+      core_stat_t stats = core_stats(report->mc, core);
+      uint64_t values[] = {stats.accesses, stats.hits, stats.coherence.coherence_misses,
+                           stats.coherence.bus_reads, stats.coherence.bus_read_exclusives,
+                           stats.coherence.upgrades, stats.coherence.invalidations,
+                           stats.coherence.transfers, stats.writebacks};
+      for (int i = 0; i < 9; i++) {
+        fprintf(out, "core,%" PRIu32 ",%s,%" PRIu64 "\n", core, metrics[i], values[i]);
+      }
+    }
+  }
+  if (report->phases) {
+    const phase_detector_t* phases = report->phases;
+    for (uint32_t phase = 0; phase < phases->num_phases; phase++) {
+      uint64_t representative = phase_representative(phases, phase);
+      fprintf(out, "phase,%" PRIu32 ",windows,%" PRIu64 "\n", phase, phases->members[phase]);
+      fprintf(out, "phase,%" PRIu32 ",representative,%" PRIu64 "\n", phase, representative);
+      fprintf(out, "phase,%" PRIu32 ",start,%" PRIu64 "\n", phase, representative * phases->window);
+    }
   }
-  return ptr_file;
-}
 
+  fprintf(out, "timing,,decode_seconds,%.6f\n", report->decode_seconds);
+  fprintf(out, "timing,,simulate_seconds,%.6f\n", simulate_seconds);
+  fprintf(out, "timing,,total_seconds,%.6f\n", report->total_seconds);
+  fprintf(out, "timing,,accesses_per_second,%.0f\n",
+          report->total_seconds > 0 ? stats->accesses / report->total_seconds : 0.0);
+  fprintf(out, "memory,,peak_rss_kib,%ld\n", peak_rss_kib());
+  fprintf(out, "memory,,state_bytes,%zu\n", report->state_bytes);
+}
 
-void print_statistics(cache_stat_t cache_statistics){
-  /* Print the statistics */
-  // DO NOT CHANGE THE FOLLOWING LINES!
-  printf("\nCache Statistics\n");
-  printf("-----------------\n\n");
-  printf("Accesses: %ld\n", cache_statistics.accesses);
-  printf("Hits:     %ld\n", cache_statistics.hits);
-  printf("Hit Rate: %.4f\n",
-         (double)cache_statistics.hits / cache_statistics.accesses);
+// Writes the --json and --csv reports, "-" is stdout
+static void write_reports(const run_report_t* report) {
+  char* report_files[] = {json_file_name, csv_file_name};
+  for (int i = 0; i < 2; i++) {
+    if (!report_files[i]) continue;
+    FILE* out = strcmp(report_files[i], "-") == 0 ? stdout : fopen(report_files[i], "w");
+    if (!out) {
+      printf("Unable to open the report file %s\n", report_files[i]);
+      exit(1);
+    }
+    if (i == 0) {
+      write_json_report(out, report);
+    } else {
+      write_csv_report(out, report);
+    }
+    if (out != stdout) fclose(out);
+  }
 }
+#endif
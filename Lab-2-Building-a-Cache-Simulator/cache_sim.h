@@ -0,0 +1,284 @@
+#ifndef CACHE_SIM_H
+#define CACHE_SIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Library interface of the cache simulator. Build cache_sim.c with
+ * -DCACHE_SIM_LIBRARY to leave out main() and the command line code and link
+ * it into another program, which then sees only the cache_sim_* functions.
+ * Every cache_sim_t is independent, so any number of them can be fed from
+ * one process, each from one thread at a time.
+ */
+
+typedef enum { dm, fa, sa } cache_map_t;
+typedef enum { uc, sc } cache_org_t;
+typedef enum { instruction, data } access_t;
+/* Replacement policies: tree-PLRU is pseudo LRU over a binary tree per set,
+ * SRRIP and BRRIP are static and bimodal re-reference interval prediction,
+ * NRU evicts a line not used since the used bits last reset, and rnd picks a
+ * pseudo random way from a seeded per-set generator. opt is Belady's optimal
+ * replacement, which needs the whole trace up front, see cache_sim_opt().
+ */
+typedef enum { fifo, lru, plru, srrip, brrip, nru, rnd, opt } cache_policy_t;
+typedef enum { inclusive, exclusive, nine } inclusion_t;
+/* Stores to a line L1 holds either mark it dirty, to be written to the level
+ * below when it is evicted (write-back), or go straight down (write-through).
+ * A store that misses L1 either fills the block first (write-allocate) or
+ * only goes down (no-write-allocate).
+ */
+typedef enum { write_back, write_through } write_policy_t;
+typedef enum { write_allocate, no_write_allocate } write_miss_policy_t;
+/* L1 prefetchers: next-line fetches the blocks after a miss, stride follows
+ * the block stride of each access type (the trace has no PCs to tell
+ * instructions apart), and stream tracks a few ascending or descending miss
+ * streams per access type and runs ahead of them. Next-line and stream also
+ * trigger on the first hit to a prefetched line, so they keep running ahead
+ * once their prefetches turn the misses into hits.
+ */
+typedef enum { no_prefetch, next_line_prefetch, stride_prefetch, stream_prefetch } prefetcher_t;
+
+/* write is only ever set for data accesses. Packed into one word with the
+ * type so a batch of accesses stays 8 bytes per access.
+ */
+typedef struct {
+  uint32_t address;
+  access_t accesstype : 8;
+  uint32_t write : 1;
+} mem_access_t;
+
+typedef struct {
+  uint64_t accesses;
+  uint64_t hits;
+} cache_stat_t;
+
+/* Unified cache level below L1. A size of 0 leaves the level out, ways 0
+ * makes it fully associative. The inclusion policy says how the level
+ * relates to the levels above it: inclusive levels back-invalidate their
+ * evictions above, exclusive levels only receive blocks evicted above, and
+ * NINE (non-inclusive non-exclusive) levels are filled on misses but never
+ * back-invalidate.
+ */
+typedef struct {
+  uint32_t size;
+  uint32_t ways;
+  cache_policy_t policy;
+  inclusion_t inclusion;
+} level_config_t;
+
+/* A TLB of entries page translations, 0 entries leaves it out. ways of 0
+ * makes it fully associative. Entries and ways are powers of two, and TLBs
+ * always replace LRU.
+ */
+typedef struct {
+  uint32_t entries;
+  uint32_t ways;
+} tlb_config_t;
+
+/* Timing of the accesses in cycles. The core issues an access per cycle,
+ * L1 hits are pipelined and a miss costs the lookups of every level down to
+ * the one that has the block, memory_latency on top if none has it.
+ * bytes_per_cycle limits the memory channel, 0 leaves it unlimited. With 0
+ * MSHRs L1 blocks on every miss. Otherwise data misses each hold one of
+ * mshrs registers until their block arrives and the core only stalls while
+ * all are busy, but instruction misses still block.
+ */
+typedef struct {
+  uint32_t hit_latency[3];  // lookup of L1, L2 and L3
+  uint32_t memory_latency;
+  uint32_t bytes_per_cycle;
+  uint32_t mshrs;           // at most 64
+} timing_config_t;
+
+/* One simulated configuration, ways only matters for the sa mapping. The
+ * mapping, organization, policy, write policies and prefetcher describe L1,
+ * the levels below are always write-back and take writes from above without
+ * allocating. The seed drives the rnd policy, equal seeds give equal
+ * results. A nonzero classify_misses also sorts every L1 miss by cause, see
+ * cache_sim_miss_stats(), and a nonzero set_histogram counts the misses of
+ * every set, see cache_sim_set_misses(). The prefetcher requests up to
+ * prefetch_degree blocks each time it triggers, 0 picks its default.
+ * The TLBs translate pages of 2^page_bits bytes, 0 picks 4 KiB pages: each
+ * access type looks up its own TLB and on a miss the shared L2 TLB, which
+ * needs both of them. Translation does not change what the caches see.
+ * A nonzero L1 latency in timing turns the timing model on, see
+ * cache_sim_timing_stats().
+ */
+typedef struct {
+  uint32_t size;
+  cache_map_t mapping;
+  cache_org_t org;
+  uint32_t ways;
+  cache_policy_t policy;
+  level_config_t l2;
+  level_config_t l3;
+  uint32_t seed;
+  int classify_misses;
+  int set_histogram;
+  write_policy_t write_policy;
+  write_miss_policy_t write_miss_policy;
+  prefetcher_t prefetcher;
+  uint32_t prefetch_degree;
+  tlb_config_t itlb;
+  tlb_config_t dtlb;
+  tlb_config_t l2_tlb;
+  uint32_t page_bits;
+  timing_config_t timing;
+} cache_config_t;
+
+// Lookups and block traffic of one cache level
+typedef struct {
+  uint64_t accesses;
+  uint64_t hits;
+  uint64_t blocks_in;           // blocks filled from the level below
+  uint64_t blocks_out;          // blocks sent down to the level below
+  uint64_t back_invalidations;  // blocks this level removed from the levels above
+  uint64_t evictions;           // valid lines replaced by a fill
+  uint64_t cold_fills;          // fills into an empty line
+  uint64_t writebacks;          // dirty blocks written to the level below
+  uint64_t bytes_read;          // from the level below or memory
+  uint64_t bytes_written;       // to the level below or memory, writebacks and stores
+  uint64_t dirty_lines;         // held dirty at the end, not written yet
+} cache_level_stat_t;
+
+/* L1 counters of one access type. Every miss fills a line, either an empty
+ * one (a cold fill) or one holding another block (an eviction), except the
+ * write misses of a no-write-allocate L1.
+ */
+typedef struct {
+  uint64_t accesses;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t cold_fills;
+  uint64_t writes;
+  uint64_t write_misses;
+} cache_stream_stat_t;
+
+/* L1 misses of one access type by cause (the 3C model). A miss is
+ * compulsory on the first access to the block, a capacity miss if a fully
+ * associative LRU cache of the same size would miss too, and a conflict miss
+ * otherwise.
+ */
+typedef struct {
+  uint64_t compulsory;
+  uint64_t capacity;
+  uint64_t conflict;
+} cache_miss_stat_t;
+
+/* L1 prefetches of one access type. A prefetch fills its block like a demand
+ * miss would but is not an access, it counts in no L1 hits or accesses, while
+ * the levels below see it like any other request from L1. A filled
+ * line is useful once a demand access hits it, unused if it was evicted
+ * first and pending if neither happened by the end. The accuracy is useful /
+ * fills and the coverage useful / (useful + misses). With no timing in the
+ * model, a prefetch used within 64 accesses of its fill counts as late, as
+ * memory would hardly have answered by then. Lines the fills evict and the
+ * misses that follow on them measure the pollution.
+ */
+typedef struct {
+  uint64_t issued;            // blocks requested, also those L1 already held
+  uint64_t fills;             // requests that filled a line
+  uint64_t useful;
+  uint64_t unused;
+  uint64_t pending;
+  uint64_t late;              // useful but used soon after the fill
+  uint64_t use_distance;      // accesses from fill to first use, summed over useful
+  uint64_t evicted_lines;     // lines of demand fills or hits evicted by fills
+  uint64_t polluting_misses;  // demand misses on blocks a fill had evicted
+} cache_prefetch_stat_t;
+
+/* Translations of one access type. Each access hits the TLB of its type, or
+ * after a miss there the L2 TLB, or walks the page table.
+ */
+typedef struct {
+  uint64_t accesses;
+  uint64_t hits;     // in the TLB of the access type
+  uint64_t l2_hits;
+  uint64_t walks;
+} cache_tlb_stat_t;
+
+#define CACHE_SIM_LATENCY_BUCKETS 16
+
+/* Cycles of the timing model. An access takes from its issue until its
+ * block is there, an L1 hit on a block still on its way included, and the
+ * AMAT is latency / accesses. The latencies are also summed by where they
+ * went: the lookups of each level and memory, waiting for the memory channel
+ * and waiting for an MSHR. Bucket i of the histogram counts the latencies
+ * from 2^i to 2^(i+1) - 1, the last one also those above.
+ */
+typedef struct {
+  uint64_t accesses[2];       // per access type
+  uint64_t latency[2];        // per access type
+  uint64_t cycles;            // from the first issue until the last block arrived
+  uint64_t stall_cycles;      // the core could not issue
+  uint64_t level_cycles[4];   // lookups of L1, L2 and L3, then memory
+  uint64_t bandwidth_cycles;  // waiting for the memory channel
+  uint64_t mshr_cycles;       // waiting for a free MSHR
+  uint64_t histogram[CACHE_SIM_LATENCY_BUCKETS];
+} cache_timing_stat_t;
+
+typedef struct cache_sim cache_sim_t;
+
+/* Creates a simulator for a 1024 byte direct mapped unified cache */
+cache_sim_t* cache_sim_create(void);
+
+/* Replaces the simulated caches with empty ones of the given configuration
+ * and clears the statistics. Returns NULL on success, otherwise why the
+ * configuration cannot be simulated, in which case nothing changes.
+ */
+const char* cache_sim_configure(cache_sim_t* sim, const cache_config_t* config);
+
+/* Simulates a batch of accesses in order */
+void cache_sim_feed(cache_sim_t* sim, const mem_access_t* batch, size_t batch_size);
+
+/* Statistics of all accesses fed since the last configure or reset */
+cache_stat_t cache_sim_stats(const cache_sim_t* sim);
+
+/* Statistics of level 1 (both halves of a split L1), 2 or 3. Levels that
+ * are not configured report all zeros.
+ */
+cache_level_stat_t cache_sim_level_stats(const cache_sim_t* sim, int level);
+
+/* L1 statistics of the access type, also for a unified L1 */
+cache_stream_stat_t cache_sim_stream_stats(const cache_sim_t* sim, access_t type);
+
+/* Misses per set of level 1, 2 or 3, NULL if the configuration does not
+ * have set_histogram set or the level is not configured. At level 1 the type
+ * picks the half of a split L1, the lower levels are unified. *num_sets gets
+ * the length of the array, which stays valid until the next configure,
+ * reset or destroy.
+ */
+const uint64_t* cache_sim_set_misses(const cache_sim_t* sim, int level, access_t type,
+                                     uint32_t* num_sets);
+
+/* L1 misses of the access type by cause, all zeros unless the configuration
+ * has classify_misses set
+ */
+cache_miss_stat_t cache_sim_miss_stats(const cache_sim_t* sim, access_t type);
+
+/* Prefetches issued for the access type, all zeros without a prefetcher. The
+ * misses of the type are in cache_sim_stream_stats().
+ */
+cache_prefetch_stat_t cache_sim_prefetch_stats(const cache_sim_t* sim, access_t type);
+
+/* Translations of the access type, all zeros if it has no TLB */
+cache_tlb_stat_t cache_sim_tlb_stats(const cache_sim_t* sim, access_t type);
+
+/* Cycles of every access fed so far, all zeros without the timing model */
+cache_timing_stat_t cache_sim_timing_stats(const cache_sim_t* sim);
+
+/* Simulates a single level configuration with OPT replacement (config->policy
+ * is not looked at) on a whole trace of fewer than 2^32 - 1 accesses, longer
+ * traces give all zeros. Stores count as reads. If peak_bytes is not NULL it gets the most memory the
+ * simulation held at once, without the trace itself.
+ */
+cache_stat_t cache_sim_opt(const cache_config_t* config, const mem_access_t* trace,
+                           size_t num_accesses, size_t* peak_bytes);
+
+/* Empties the caches and clears the statistics */
+void cache_sim_reset(cache_sim_t* sim);
+
+void cache_sim_destroy(cache_sim_t* sim);
+
+#endif